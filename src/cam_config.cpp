@@ -5,7 +5,9 @@ namespace camera
  
 CamConfig::CamConfig(std::string const& device) : mFd(0), mCapability(), mCamCtrls(), 
             mFormat(), mCropcap(), mFormatDescriptions(), mStreamparm(), mmapBuffer(NULL), 
-            mStreamingActivated(false), mConversionRequiredYUYV2RGB(false) {
+            mStreamingActivated(false), mBufferQueued(false), mKeepBufferQueued(false), 
+            mInsertJpegHuffmanTables(false), mConverter(NULL), mConversionSource(0), mConvertPool(NULL),
+            mOutputScale(1), mActiveOutputScale(1) {
     LOG_DEBUG("CamConfig: constructor");
     
     memset(&mCapability, 0, sizeof(struct v4l2_capability));
@@ -736,21 +738,105 @@ void CamConfig::readImageFormat() {
         mFormatDescriptions.push_back(format_description);
         index++;
     }
-    
-    /*
-     // Read camera crop capabilities.
+}
+
+bool CamConfig::readCropcap() {
+    LOG_DEBUG("CamConfig: readCropcap");
     memset(&mCropcap, 0, sizeof(struct v4l2_cropcap));
     mCropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (xioctl (mFd, VIDIOC_CROPCAP, &mCropcap) == -1)
-    {
-        std::string err_str(strerror(errno));
-        if(errno == EINVAL) {
-            throw CamConfigException(err_str.insert(0, 
-                    "VIDIOC_CROPCAP is not supported by device driver: "));
+
+#ifdef VIDIOC_G_SELECTION
+    struct v4l2_selection selection;
+    memset(&selection, 0, sizeof(struct v4l2_selection));
+    selection.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection.target = V4L2_SEL_TGT_CROP_BOUNDS;
+    if(xioctl(mFd, VIDIOC_G_SELECTION, &selection) == 0) {
+        mCropcap.bounds = selection.r;
+        selection.target = V4L2_SEL_TGT_CROP_DEFAULT;
+        mCropcap.defrect = xioctl(mFd, VIDIOC_G_SELECTION, &selection) == 0 ? 
+                selection.r : mCropcap.bounds;
+        mCropcap.pixelaspect.numerator = 1;
+        mCropcap.pixelaspect.denominator = 1;
+        return true;
+    }
+#endif
+
+    // Drivers without the selection API.
+    if(xioctl(mFd, VIDIOC_CROPCAP, &mCropcap) == -1) {
+        if(errno == EINVAL || errno == ENOTTY) {
+            LOG_INFO("Cropping is not supported by the device driver");
+            memset(&mCropcap, 0, sizeof(struct v4l2_cropcap));
+            return false;
         }
+        std::string err_str(strerror(errno));
         throw std::runtime_error(err_str.insert(0, "Could not read crop capability: "));        
     }
-    */
+    return true;
+}
+
+bool CamConfig::readCrop(struct v4l2_rect* rect) {
+#ifdef VIDIOC_G_SELECTION
+    struct v4l2_selection selection;
+    memset(&selection, 0, sizeof(struct v4l2_selection));
+    selection.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection.target = V4L2_SEL_TGT_CROP;
+    if(xioctl(mFd, VIDIOC_G_SELECTION, &selection) == 0) {
+        *rect = selection.r;
+        return true;
+    }
+#endif
+
+    struct v4l2_crop crop;
+    memset(&crop, 0, sizeof(struct v4l2_crop));
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if(xioctl(mFd, VIDIOC_G_CROP, &crop) == -1) {
+        if(errno == EINVAL || errno == ENOTTY) {
+            return false;
+        }
+        std::string err_str(strerror(errno));
+        throw std::runtime_error(err_str.insert(0, "Could not read crop rectangle: "));
+    }
+    *rect = crop.c;
+    return true;
+}
+
+bool CamConfig::writeCrop(struct v4l2_rect* rect) {
+    LOG_DEBUG("CamConfig: writeCrop %dx%d+%d+%d", rect->width, rect->height, rect->left, rect->top);
+
+#ifdef VIDIOC_S_SELECTION
+    struct v4l2_selection selection;
+    memset(&selection, 0, sizeof(struct v4l2_selection));
+    selection.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection.target = V4L2_SEL_TGT_CROP;
+    selection.r = *rect;
+    if(xioctl(mFd, VIDIOC_S_SELECTION, &selection) == 0) {
+        *rect = selection.r;
+        readImageFormat();
+        return true;
+    }
+    if(errno != EINVAL && errno != ENOTTY) {
+        std::string err_str(strerror(errno));
+        throw std::runtime_error(err_str.insert(0, "Could not write crop selection: "));
+    }
+#endif
+
+    // Drivers without the selection API.
+    struct v4l2_crop crop;
+    memset(&crop, 0, sizeof(struct v4l2_crop));
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = *rect;
+    if(xioctl(mFd, VIDIOC_S_CROP, &crop) == -1) {
+        if(errno == EINVAL || errno == ENOTTY) {
+            LOG_INFO("Cropping is not supported by the device driver");
+            return false;
+        }
+        std::string err_str(strerror(errno));
+        throw std::runtime_error(err_str.insert(0, "Could not write crop rectangle: "));
+    }
+    // VIDIOC_S_CROP does not return the adjusted rectangle.
+    readCrop(rect);
+    readImageFormat();
+    return true;
 }
 
 void CamConfig::writeImagePixelFormat(uint32_t const width, uint32_t const height, 
@@ -816,7 +902,9 @@ void CamConfig::listImageFormat() {
     }
     printf("\n");
     
-    /*
+    if(mCropcap.bounds.width == 0) { // Not read or not supported.
+        return;
+    }
     printf("CAMERA CROPPING\n");
     printf( "    Bounds: %dx%d+%d+%d\n"
             "    Default: %dx%d+%d+%d\n"
@@ -825,7 +913,6 @@ void CamConfig::listImageFormat() {
             mCropcap.defrect.width, mCropcap.defrect.height, mCropcap.defrect.left, mCropcap.defrect.top,
             mCropcap.pixelaspect.numerator, mCropcap.pixelaspect.denominator);  
     printf("\n");
-    */
 }
 
 bool CamConfig::getImageWidth(uint32_t* width) {
@@ -915,10 +1002,40 @@ bool CamConfig::getImageColorspace(uint32_t* colorspace) {
     return true;
 }
 
+bool CamConfig::isPixelformatAvailable(uint32_t pixelformat) {
+    std::vector<struct v4l2_fmtdesc>::iterator it = mFormatDescriptions.begin();
+    for(; it != mFormatDescriptions.end(); it++) {
+        if(it->pixelformat == pixelformat) {
+            return true;
+        }
+    }
+    return false;
+}
+
 uint32_t CamConfig::toV4L2ImageFormat(base::samples::frame::frame_mode_t mode) {
     using namespace base::samples::frame;
     // TODO: Do sth clever with the collected mFormatDescriptions.
     uint32_t v4l2_mode = 0;
+    mConverter = NULL;
+    mConversionSource = 0;
+    mActiveOutputScale = 1;
+
+    // Downscaling is done while converting, so the raw format is requested
+    // even if the camera supports the mode directly.
+    static const uint32_t scaled_sources[] = {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY};
+    for(size_t i = 0; mOutputScale > 1 && i < sizeof(scaled_sources) / sizeof(scaled_sources[0]); ++i) {
+        PixelConvertFunction converter = getScaledPixelConverter(scaled_sources[i], mode, mOutputScale);
+        if(converter != NULL && isPixelformatAvailable(scaled_sources[i])) {
+            LOG_INFO("Frame mode %d is converted from %c%c%c%c and reduced to 1/%d", mode,
+                    scaled_sources[i] & 0xFF, (scaled_sources[i] >> 8) & 0xFF, 
+                    (scaled_sources[i] >> 16) & 0xFF, (scaled_sources[i] >> 24) & 0xFF, mOutputScale);
+            mConverter = converter;
+            mConversionSource = scaled_sources[i];
+            mActiveOutputScale = mOutputScale;
+            return scaled_sources[i];
+        }
+    }
+
     switch(mode) {
         case MODE_GRAYSCALE: v4l2_mode = V4L2_PIX_FMT_GREY; break; 
         case MODE_RGB: v4l2_mode  = V4L2_PIX_FMT_RGB24; break; 
@@ -929,33 +1046,52 @@ uint32_t CamConfig::toV4L2ImageFormat(base::samples::frame::frame_mode_t mode) {
         default: break;
     }
     
+    if(v4l2_mode != 0 && isPixelformatAvailable(v4l2_mode)) {
+        return v4l2_mode;
+    }
+
     // Problem: The few rock image formats cannot cover all the v4l2 formats.
-    // And we do not have conversions for most of the camera formats like YUYV or H264.
-    // So for now for frame mode RGB we have to:
-    // 1. Request YUV images. 
-    // 2. Convert the image manually to RBG.
-    // 3. Now the frame helper can compress the image to JPEG.
-    bool yuyv_available = false;
-    std::vector<struct v4l2_fmtdesc>::iterator it = mFormatDescriptions.begin();
-    for(; it != mFormatDescriptions.end(); it++) {
-        if(it->pixelformat == v4l2_mode) {
-            return v4l2_mode;
-        }
-        if(it->pixelformat == V4L2_PIX_FMT_YUYV) {
-            yuyv_available = true;
+    // So if the requested mode is not available, a raw format of the camera
+    // is requested and converted within getBuffer(). The list is in order of preference.
+    static const uint32_t sources[] = {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, 
+            V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_GREY};
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i) {
+        PixelConvertFunction converter = getPixelConverter(sources[i], mode);
+        if(converter != NULL && isPixelformatAvailable(sources[i])) {
+            LOG_INFO("Frame mode %d is not available, %c%c%c%c is requested and converted", mode,
+                    sources[i] & 0xFF, (sources[i] >> 8) & 0xFF, 
+                    (sources[i] >> 16) & 0xFF, (sources[i] >> 24) & 0xFF);
+            mConverter = converter;
+            mConversionSource = sources[i];
+            return sources[i];
         }
     }
     
-    // If the requested mode (which is not available) is RGB and the camera got 
-    // the YUYV format, we will use that and do an extra to RGB conversion.
-    if(mode == MODE_RGB && yuyv_available) {
-        mConversionRequiredYUYV2RGB = true;
-        return V4L2_PIX_FMT_YUYV;
-    }
-    
     return 0;
 }
 
+bool CamConfig::disableActiveOutputScale(base::samples::frame::frame_mode_t mode) {
+    if(mActiveOutputScale == 1) {
+        return true;
+    }
+    PixelConvertFunction converter = getPixelConverter(mConversionSource, mode);
+    if(converter == NULL) {
+        return false;
+    }
+    mConverter = converter;
+    mActiveOutputScale = 1;
+    return true;
+}
+
+bool CamConfig::setOutputScale(uint32_t denominator) {
+    if(denominator != 1 && denominator != 2 && denominator != 4) {
+        LOG_ERROR("Output scale 1/%d is not supported, use 1, 2 or 4", denominator);
+        return false;
+    }
+    mOutputScale = denominator;
+    return true;
+}
+
 // STREAMPARM
 void CamConfig::readStreamparm() {
     LOG_DEBUG("CamConfig: readStreamparm");
@@ -1141,6 +1277,10 @@ void CamConfig::initRequesting() {
     }
     
     mStreamingActivated = true;
+    mBufferQueued = false;
+    if(mKeepBufferQueued) {
+        queueBuffer();
+    }
 }
 
 bool CamConfig::isImageAvailable(int32_t timeout_ms) {
@@ -1161,7 +1301,7 @@ bool CamConfig::isImageAvailable(int32_t timeout_ms) {
     }
     
     if(ret == 0) {
-        std::cout << "No image availale" << std::endl;
+        LOG_DEBUG("No image available");
         return false;
     }
     
@@ -1172,15 +1312,18 @@ bool CamConfig::isImageAvailable(int32_t timeout_ms) {
     * Used http://www.jayrambhia.com/blog/capture-v4l2
     * \param blocking_read Not used, function always waits timeout_ms milliseconds.
     */
-bool CamConfig::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, int32_t timeout_ms) {
-    
+bool CamConfig::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, int32_t timeout_ms,
+        ImageRegion* region, JpegHeaderInfo* info) {
+    if(info != NULL) {
+        *info = JpegHeaderInfo();
+    }
+
     struct v4l2_buffer q_buffer = {0};
     q_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     q_buffer.memory = V4L2_MEMORY_MMAP;
     q_buffer.index = 0;
-    if(-1 == xioctl(mFd, VIDIOC_QBUF, &q_buffer))
-    {
-        perror("Query Buffer");
+    // Still queued if the last call timed out.
+    if(!queueBuffer()) {
         return false;
     }
  
@@ -1199,16 +1342,66 @@ bool CamConfig::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, int3
         std::string err_str(strerror(errno));
         throw std::runtime_error(err_str.insert(0, "Error capturing the image: "));
     }
+    mBufferQueued = false;
     
-    // Image is available at mmapBuffer now.
-    if(mConversionRequiredYUYV2RGB) {
-        helpers.convertYUYV2RGB(mmapBuffer, q_buffer.length, buffer);
+    // Image is available at mmapBuffer now. For compressed formats only
+    // 'bytesused' of the buffer contain image data.
+    size_t image_size = q_buffer.bytesused > 0 ? q_buffer.bytesused : q_buffer.length;
+    uint32_t pixelformat = mFormat.fmt.pix.pixelformat;
+    bool success = true;
+    bool convert = mConverter != NULL && pixelformat == mConversionSource;
+    if(region != NULL && !clipRegion(pixelformat, mFormat.fmt.pix.width, mFormat.fmt.pix.height,
+            convert ? mActiveOutputScale : 1, *region)) {
+        *region = ImageRegion();
+    }
+    if(region != NULL && !region->isEmpty()) {
+        success = extractRegion(mmapBuffer, image_size, mFormat.fmt.pix.width, 
+                mFormat.fmt.pix.bytesperline, pixelformat, convert ? mConverter : NULL, 
+                *region, buffer, mConvertPool);
+    } else if(convert) {
+        success = mConverter(mmapBuffer, image_size, mFormat.fmt.pix.width, 
+                mFormat.fmt.pix.height, mFormat.fmt.pix.bytesperline, buffer, mConvertPool);
+    } else if(pixelformat == V4L2_PIX_FMT_MJPEG || pixelformat == V4L2_PIX_FMT_JPEG) {
+        Helpers::normalizeJpeg(mmapBuffer, image_size, buffer, mInsertJpegHuffmanTables, info);
     } else {
-        buffer.resize(q_buffer.length);
-        memcpy(buffer.data(), mmapBuffer, q_buffer.length);
+        buffer.resize(image_size);
+        memcpy(buffer.data(), mmapBuffer, image_size);
+    }
+
+    if(mKeepBufferQueued) {
+        queueBuffer();
     }
     
-    return true;
+    return success;
+}
+
+void CamConfig::requeueBuffers() {
+    if(!mStreamingActivated) {
+        LOG_INFO("v4l2 streaming is not active, nothing to requeue");
+        return;
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if(xioctl(mFd, VIDIOC_STREAMOFF, &type) == -1) {
+        std::string err_str(strerror(errno));
+        throw std::runtime_error(err_str.insert(0, "Could not stop capturing: "));
+    }
+    mBufferQueued = false;
+
+    if(xioctl(mFd, VIDIOC_STREAMON, &type) == -1) {
+        std::string err_str(strerror(errno));
+        throw std::runtime_error(err_str.insert(0, "Could not start capturing: "));
+    }
+    if(mKeepBufferQueued) {
+        queueBuffer();
+    }
+}
+
+void CamConfig::setKeepBufferQueued(bool keep_queued) {
+    mKeepBufferQueued = keep_queued;
+    if(mKeepBufferQueued && mStreamingActivated) {
+        queueBuffer();
+    }
 }
 
 void CamConfig::cleanupRequesting() {
@@ -1235,6 +1428,24 @@ void CamConfig::cleanupRequesting() {
     mmapBuffer = NULL;
     
     mStreamingActivated = false;
+    mBufferQueued = false;
+}
+
+bool CamConfig::queueBuffer() {
+    if(mBufferQueued) {
+        return true;
+    }
+    struct v4l2_buffer q_buffer = {0};
+    q_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    q_buffer.memory = V4L2_MEMORY_MMAP;
+    q_buffer.index = 0;
+    if(-1 == xioctl(mFd, VIDIOC_QBUF, &q_buffer))
+    {
+        perror("Query Buffer");
+        return false;
+    }
+    mBufferQueued = true;
+    return true;
 }
 
 void CamConfig::getQueryBuffer(struct v4l2_buffer& query_buffer) {
@@ -44,6 +44,7 @@
 #include <base/samples/Frame.hpp>
 
 #include "helpers.h"
+#include "pixel_converter.h"
 
 namespace camera 
 {
@@ -230,6 +231,37 @@ class CamConfig
 
     void listImageFormat();
 
+    /**
+     * Reads the crop bounds and the default crop rectangle of the sensor to mCropcap,
+     * using VIDIOC_G_SELECTION or VIDIOC_CROPCAP for older drivers.
+     * \return false if cropping is not supported by the driver.
+     */
+    bool readCropcap();
+
+    /**
+     * Reads the current crop rectangle (VIDIOC_G_SELECTION, VIDIOC_G_CROP).
+     * \return false if cropping is not supported by the driver.
+     */
+    bool readCrop(struct v4l2_rect* rect);
+
+    /**
+     * Crops the sensor, so only 'rect' is read out and transferred
+     * (VIDIOC_S_SELECTION, VIDIOC_S_CROP for older drivers). The driver adjusts the 
+     * rectangle, 'rect' receives the one which has been set. Because the driver may 
+     * change the image size as well, the image format is read again. An image size 
+     * (writeImagePixelFormat()) smaller than the crop is realized by binning or 
+     * scaling on the chip, if supported.
+     * \return false if cropping is not supported by the driver.
+     */
+    bool writeCrop(struct v4l2_rect* rect);
+
+    /**
+     * Valid after readCropcap().
+     */
+    inline struct v4l2_cropcap const& getCropcap() const {
+        return mCropcap;
+    }
+
     bool getImageWidth(uint32_t* width);
 
     bool getImageHeight(uint32_t* height);
@@ -238,6 +270,12 @@ class CamConfig
 
     bool getImagePixelformatString(std::string* pixelformat_str);
 
+    /**
+     * Returns true if the camera lists 'pixelformat' (e.g. V4L2_PIX_FMT_YUYV)
+     * within its format descriptions.
+     */
+    bool isPixelformatAvailable(uint32_t pixelformat);
+
     /**
      * Whats this?
      */ 
@@ -255,11 +293,38 @@ class CamConfig
     /**
      * Tries to map a rock to a v4l2 mode. Problem is that rock 
      * only supports a few image formats and e.g. no YUYV which is a base raw format
-     * for most of the cameras. So if RGB is requested but not available
-     * YUV will be used and converted to RGB.
+     * for most of the cameras. So if e.g. RGB is requested but not available
+     * YUYV, UYVY, NV12, YU12 or GREY will be used and converted within getBuffer()
+     * (see getPixelConverter()).
+     * With an output scale (see setOutputScale()) YUYV or UYVY is preferred for
+     * RGB, BGR and grayscale and downscaled while converting.
      */
     uint32_t toV4L2ImageFormat(base::samples::frame::frame_mode_t mode);
 
+    /**
+     * Requested reduction of the images converted within getBuffer(), used by
+     * the following calls of toV4L2ImageFormat(). 
+     * \param denominator 1, 2 or 4, the images are reduced to 1/denominator by a box filter.
+     * \return false if the scale is not supported.
+     */
+    bool setOutputScale(uint32_t denominator);
+
+    /**
+     * Returns the scale realized by the last toV4L2ImageFormat(), 1 if the images
+     * are not reduced.
+     */
+    inline uint32_t getActiveOutputScale() const {
+        return mActiveOutputScale;
+    }
+
+    /**
+     * Converts the raw format chosen by the last toV4L2ImageFormat() without reducing it,
+     * e.g. if the negotiated image size can not be reduced (see isScalableSize()).
+     * The pixelformat requested from the camera does not change.
+     * \return false if the format can not be converted to 'mode' without scaling.
+     */
+    bool disableActiveOutputScale(base::samples::frame::frame_mode_t mode);
+
  public: // STREAMPARM, not suoported by e-CAM32!
     void readStreamparm();
 
@@ -315,8 +380,44 @@ class CamConfig
     /**
      * Used http://www.jayrambhia.com/blog/capture-v4l2
      * \param blocking_read Not used, function always waits timeout_ms milliseconds.
+     * \param region If set, only this part of the image is copied or converted (see 
+     * extractRegion()). It is clipped to the image, an empty region is returned if the 
+     * whole image has been copied (compressed and planar formats can not be cut).
+     * \param info If set, receives the header of a JPEG image, collected while copying.
+     * Reset for other images.
+     */
+    bool getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, int32_t timeout_ms,
+            ImageRegion* region = NULL, JpegHeaderInfo* info = NULL);
+
+    /**
+     * Stops and restarts streaming without reallocating the buffer. STREAMOFF returns
+     * all buffers to the application, so a buffer the driver does not
+     * deliver anymore is queued again with the next getBuffer().
+     */
+    void requeueBuffers();
+
+    /**
+     * If activated, the buffer is queued again directly after it has been copied
+     * (and after the start of the streaming). So the device fd becomes readable
+     * as soon as the next image is available and not only while getBuffer() waits.
      */
-    bool getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, int32_t timeout_ms);
+    void setKeepBufferQueued(bool keep_queued);
+
+    /**
+     * Conversions within getBuffer() (see toV4L2ImageFormat()) are distributed 
+     * to 'pool' if set. The pool is not owned by CamConfig.
+     */
+    inline void setConvertPool(ConvertPool* pool) {
+        mConvertPool = pool;
+    }
+
+    /**
+     * If set, the standard Huffman tables are inserted into MJPEG images
+     * which do not contain any (see Helpers::normalizeJpeg()).
+     */
+    inline void setInsertJpegHuffmanTables(bool insert) {
+        mInsertJpegHuffmanTables = insert;
+    }
     
     void cleanupRequesting();
 
@@ -340,8 +441,15 @@ class CamConfig
     // Points to the image which has been requested via ioctl.
     uint8_t* mmapBuffer;
     bool mStreamingActivated;
-    bool mConversionRequiredYUYV2RGB; // YUVU is not yet supported by Rock.
-    Helpers helpers;
+    bool mBufferQueued; // Buffer is owned by the driver (QBUF without DQBUF).
+    bool mKeepBufferQueued;
+    bool mInsertJpegHuffmanTables;
+    // Used if the requested mode is not available, see toV4L2ImageFormat().
+    PixelConvertFunction mConverter;
+    uint32_t mConversionSource; // v4l2 pixelformat the converter expects.
+    ConvertPool* mConvertPool;
+    uint32_t mOutputScale; // Requested, see setOutputScale().
+    uint32_t mActiveOutputScale;
 
     CamConfig() {}
     
@@ -349,6 +457,11 @@ class CamConfig
      * Used in the request image functions.
      */
     void getQueryBuffer(struct v4l2_buffer& query_buffer);
+
+    /**
+     * Passes the buffer to the driver if it is not queued yet.
+     */
+    bool queueBuffer();
     
     /**
      * ioctl calls could be interrupted (EINTR), in this case another call is required.
@@ -0,0 +1,119 @@
+#include "cam_convert_pool.h"
+
+#include <base-logging/Logging.hpp>
+
+namespace camera
+{
+
+ConvertPool::ConvertPool(uint32_t thread_count) : mThreads(), 
+        mBandBytes(DEFAULT_BAND_BYTES), mMinParallelBytes(DEFAULT_MIN_PARALLEL_BYTES),
+        mRunning(true), mFunction(NULL), mContext(NULL), mRows(0), mBandRows(0), 
+        mNextRow(0), mBandsPending(0) {
+    LOG_DEBUG("ConvertPool: constructor, %d threads", thread_count);
+    pthread_mutex_init(&mRunMutex, NULL);
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCondWork, NULL);
+    pthread_cond_init(&mCondDone, NULL);
+
+    if(thread_count > 1) {
+        mThreads.resize(thread_count - 1);
+        for(uint32_t i = 0; i < mThreads.size(); ++i) {
+            pthread_create(&mThreads[i], NULL, workerLoop, (void*)this);
+        }
+    }
+}
+
+ConvertPool::~ConvertPool() {
+    LOG_DEBUG("ConvertPool: destructor");
+    pthread_mutex_lock(&mMutex);
+    mRunning = false;
+    pthread_cond_broadcast(&mCondWork);
+    pthread_mutex_unlock(&mMutex);
+
+    for(uint32_t i = 0; i < mThreads.size(); ++i) {
+        pthread_join(mThreads[i], NULL);
+    }
+
+    pthread_cond_destroy(&mCondDone);
+    pthread_cond_destroy(&mCondWork);
+    pthread_mutex_destroy(&mMutex);
+    pthread_mutex_destroy(&mRunMutex);
+}
+
+void ConvertPool::run(BandFunction function, void* context, uint32_t rows, size_t row_bytes) {
+    if(rows == 0) {
+        return;
+    }
+    // Fast path: Waking up the workers would take longer than the conversion.
+    if(mThreads.empty() || (size_t)rows * row_bytes < mMinParallelBytes) {
+        function(context, 0, rows);
+        return;
+    }
+
+    uint32_t band_rows = row_bytes > 0 ? mBandBytes / row_bytes : rows;
+    band_rows = band_rows < 2 ? 2 : (band_rows + 1) / 2 * 2;
+
+    pthread_mutex_lock(&mRunMutex);
+    pthread_mutex_lock(&mMutex);
+    mFunction = function;
+    mContext = context;
+    mRows = rows;
+    mBandRows = band_rows;
+    mNextRow = 0;
+    mBandsPending = (rows + band_rows - 1) / band_rows;
+    pthread_cond_broadcast(&mCondWork);
+
+    // The calling thread takes part.
+    processBands();
+    while(mBandsPending > 0) {
+        pthread_cond_wait(&mCondDone, &mMutex);
+    }
+    mFunction = NULL;
+    mContext = NULL;
+    pthread_mutex_unlock(&mMutex);
+    pthread_mutex_unlock(&mRunMutex);
+}
+
+// PRIVATE
+bool ConvertPool::takeBand(uint32_t* first_row, uint32_t* end_row) {
+    if(mFunction == NULL || mNextRow >= mRows) {
+        return false;
+    }
+    *first_row = mNextRow;
+    mNextRow = mRows - mNextRow > mBandRows ? mNextRow + mBandRows : mRows;
+    *end_row = mNextRow;
+    return true;
+}
+
+void ConvertPool::processBands() {
+    uint32_t first_row = 0, end_row = 0;
+    while(takeBand(&first_row, &end_row)) {
+        BandFunction function = mFunction;
+        void* context = mContext;
+        pthread_mutex_unlock(&mMutex);
+
+        function(context, first_row, end_row);
+
+        pthread_mutex_lock(&mMutex);
+        if(--mBandsPending == 0) {
+            pthread_cond_signal(&mCondDone);
+        }
+    }
+}
+
+// PRIVATE STATIC
+void* ConvertPool::workerLoop(void* ptr) {
+    ConvertPool* pool = (ConvertPool*)ptr;
+
+    pthread_mutex_lock(&pool->mMutex);
+    while(pool->mRunning) {
+        pool->processBands();
+        if(pool->mRunning) {
+            pthread_cond_wait(&pool->mCondWork, &pool->mMutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mMutex);
+    return NULL;
+}
+
+} // end namespace camera
@@ -0,0 +1,114 @@
+/*
+ * \file    cam_convert_pool.h
+ *
+ * \brief   Distributes row bands of an image to a persistent pool of threads.
+ *
+ * \details Converting a 4K frame on a single core exceeds the frame interval, 
+ *          so the rows are split into bands which fit into the cache and which are
+ *          processed by the worker threads and the calling thread. run() returns
+ *          after all bands have been processed. The bands do not overlap, so the
+ *          result does not depend on the scheduling.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _CAM_CONVERT_POOL_H_
+#define _CAM_CONVERT_POOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace camera
+{
+
+class ConvertPool {
+
+ public:
+    /**
+     * Processes the rows [first_row, end_row) of the image described by 'context'.
+     */
+    typedef void (*BandFunction)(void* context, uint32_t first_row, uint32_t end_row);
+
+    // Source and destination of a band should fit into the L2 cache.
+    static const size_t DEFAULT_BAND_BYTES = 256 * 1024;
+    // Smaller images are processed by the calling thread only.
+    static const size_t DEFAULT_MIN_PARALLEL_BYTES = 1024 * 1024;
+
+    /**
+     * Starts 'thread_count' - 1 workers, the calling thread of run() is the last one.
+     */
+    explicit ConvertPool(uint32_t thread_count);
+
+    /**
+     * Stops and joins the worker threads.
+     */
+    ~ConvertPool();
+
+    /**
+     * Processes all 'rows' in bands and returns when all bands are done.
+     * Calls from several threads are serialized.
+     * \param row_bytes Bytes read and written per row, used to size the bands.
+     */
+    void run(BandFunction function, void* context, uint32_t rows, size_t row_bytes);
+
+    /**
+     * Bands contain at least two rows, so 4:2:0 chroma rows are not split.
+     */
+    inline void setBandBytes(size_t band_bytes) {
+        mBandBytes = band_bytes;
+    }
+
+    inline void setMinParallelBytes(size_t min_parallel_bytes) {
+        mMinParallelBytes = min_parallel_bytes;
+    }
+
+    inline uint32_t getThreadCount() const {
+        return mThreads.size() + 1;
+    }
+
+ private:
+    ConvertPool();
+    ConvertPool(ConvertPool const&);
+    ConvertPool& operator=(ConvertPool const&);
+
+    /**
+     * Takes the next band of the current job. mMutex has to be locked.
+     * \return false if all bands have been taken.
+     */
+    bool takeBand(uint32_t* first_row, uint32_t* end_row);
+
+    /**
+     * Processes bands until none is left. Called with mMutex locked, returns with mMutex locked.
+     */
+    void processBands();
+
+    static void* workerLoop(void* ptr);
+
+    std::vector<pthread_t> mThreads;
+    size_t mBandBytes;
+    size_t mMinParallelBytes;
+    bool mRunning;
+
+    // Current job, protected by mMutex.
+    BandFunction mFunction;
+    void* mContext;
+    uint32_t mRows;
+    uint32_t mBandRows;
+    uint32_t mNextRow;
+    uint32_t mBandsPending; // Taken or not, but not finished.
+
+    pthread_mutex_t mRunMutex; // Serializes run().
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCondWork; // Workers wait for bands.
+    pthread_cond_t mCondDone; // run() waits for the last band.
+};
+
+} // end namespace camera
+
+#endif
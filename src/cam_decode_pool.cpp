@@ -0,0 +1,319 @@
+#include "cam_decode_pool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <base-logging/Logging.hpp>
+
+#include "cam_jpeg.h"
+#include "helpers.h"
+
+namespace camera
+{
+
+JpegDecodePool::JpegDecodePool(uint32_t thread_count, bool drop_stale) :
+        mJobs(), mThreads(), mDropStale(drop_stale), mRunning(true), mScaleDenominator(1),
+        mNextSequence(0), mNextDelivery(0), mDroppedCount(0), mEventFd(-1),
+        mEventFdSignalled(false), mpDoneCallback(NULL), mpDonePassThroughPointer(NULL) {
+    LOG_DEBUG("JpegDecodePool: constructor, %d threads", thread_count);
+    if(thread_count == 0) {
+        thread_count = 1;
+    }
+    // One image per worker can be decoded while the next ones are received.
+    mJobs.resize(2 * thread_count);
+
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCondQueued, NULL);
+    pthread_cond_init(&mCondDone, NULL);
+
+    mThreads.resize(thread_count);
+    for(uint32_t i = 0; i < thread_count; ++i) {
+        pthread_create(&mThreads[i], NULL, workerLoop, (void*)this);
+    }
+}
+
+JpegDecodePool::~JpegDecodePool() {
+    LOG_DEBUG("JpegDecodePool: destructor");
+    pthread_mutex_lock(&mMutex);
+    mRunning = false;
+    pthread_cond_broadcast(&mCondQueued);
+    pthread_mutex_unlock(&mMutex);
+
+    for(uint32_t i = 0; i < mThreads.size(); ++i) {
+        pthread_join(mThreads[i], NULL);
+    }
+
+    if(mEventFd != -1) {
+        close(mEventFd);
+        mEventFd = -1;
+    }
+    pthread_cond_destroy(&mCondDone);
+    pthread_cond_destroy(&mCondQueued);
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool JpegDecodePool::setScale(uint32_t denominator) {
+    if(denominator != 1 && denominator != 2 && denominator != 4 && denominator != 8) {
+        LOG_ERROR("JPEG scale 1/%d is not supported, use 1, 2, 4 or 8", denominator);
+        return false;
+    }
+    pthread_mutex_lock(&mMutex);
+    mScaleDenominator = denominator;
+    pthread_mutex_unlock(&mMutex);
+    return true;
+}
+
+bool JpegDecodePool::push(uint8_t const* data, size_t size, base::samples::frame::frame_mode_t mode,
+        base::Time const& time, JpegHeaderInfo* info, bool complete_only) {
+    JpegHeaderInfo header;
+    if(info == NULL) {
+        info = &header;
+    }
+    pthread_mutex_lock(&mMutex);
+
+    Job* job = NULL;
+    Job* oldest = NULL;
+    for(uint32_t i = 0; i < mJobs.size(); ++i) {
+        if(mJobs[i].state == JOB_FREE) {
+            job = &mJobs[i];
+            break;
+        }
+        // Images which are decoded at the moment can not be replaced.
+        if(mJobs[i].state != JOB_DECODING &&
+                (oldest == NULL || mJobs[i].sequence < oldest->sequence)) {
+            oldest = &mJobs[i];
+        }
+    }
+
+    if(job == NULL) {
+        mDroppedCount++;
+        if(!mDropStale || oldest == NULL) {
+            LOG_DEBUG("Decode pool fell behind, new image dropped");
+            pthread_mutex_unlock(&mMutex);
+            // Not copied, so the header is read here.
+            Helpers::inspectJpeg(data, size, info);
+            return false;
+        }
+        LOG_DEBUG("Decode pool fell behind, image %d dropped", (int)oldest->sequence);
+        job = oldest;
+    }
+
+    // Not every libjpeg version accepts MJPEG images without Huffman tables.
+    Helpers::normalizeJpeg(data, size, job->data, true, info);
+    if(complete_only && !info->isComplete()) {
+        // A replaced image is lost anyway, it has been counted as dropped.
+        LOG_DEBUG("Incomplete image dropped");
+        job->state = JOB_FREE;
+        updateEventFd();
+        pthread_mutex_unlock(&mMutex);
+        return false;
+    }
+    job->state = JOB_QUEUED;
+    job->sequence = mNextSequence++;
+    job->mode = mode;
+    job->scale = mScaleDenominator;
+    job->time = time;
+
+    // The replaced image may have been the next one to deliver.
+    updateEventFd();
+    pthread_cond_signal(&mCondQueued);
+    pthread_mutex_unlock(&mMutex);
+    return true;
+}
+
+bool JpegDecodePool::pop(base::samples::frame::Frame& frame, int32_t timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mMutex);
+    Job* job = getNextJob();
+    while(job == NULL || job->state != JOB_DONE) {
+        if(timeout_ms <= 0 ||
+                pthread_cond_timedwait(&mCondDone, &mMutex, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&mMutex);
+            return false;
+        }
+        job = getNextJob();
+    }
+
+    // The buffers are swapped, the slot reuses the buffer of the passed frame.
+    base::samples::frame::Frame& decoded = job->frame;
+    frame.image.swap(decoded.image);
+    Helpers::setFrameFormat(frame, decoded.getWidth(), decoded.getHeight(), 
+            decoded.getDataDepth(), decoded.getFrameMode());
+    frame.attributes.clear();
+    frame.frame_status = base::samples::frame::STATUS_VALID;
+    frame.time = job->time;
+
+    job->state = JOB_FREE;
+    mNextDelivery++;
+    updateEventFd();
+    pthread_mutex_unlock(&mMutex);
+    return true;
+}
+
+bool JpegDecodePool::hasFrame() {
+    pthread_mutex_lock(&mMutex);
+    bool available = isNextJobDone();
+    pthread_mutex_unlock(&mMutex);
+    return available;
+}
+
+void JpegDecodePool::clear() {
+    pthread_mutex_lock(&mMutex);
+    for(uint32_t i = 0; i < mJobs.size(); ++i) {
+        // Images being decoded are released by the worker.
+        if(mJobs[i].state != JOB_DECODING) {
+            mJobs[i].state = JOB_FREE;
+        }
+    }
+    mNextDelivery = mNextSequence;
+    updateEventFd();
+    pthread_mutex_unlock(&mMutex);
+}
+
+int JpegDecodePool::getEventFd() {
+    pthread_mutex_lock(&mMutex);
+    if(mEventFd == -1) {
+        mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(mEventFd == -1) {
+            LOG_ERROR("eventfd could not be created: %s", strerror(errno));
+        } else {
+            mEventFdSignalled = false;
+            updateEventFd();
+        }
+    }
+    int fd = mEventFd;
+    pthread_mutex_unlock(&mMutex);
+    return fd;
+}
+
+void JpegDecodePool::setDoneCallback(void (*callback)(void* p), void* p) {
+    pthread_mutex_lock(&mMutex);
+    mpDoneCallback = callback;
+    mpDonePassThroughPointer = p;
+    pthread_mutex_unlock(&mMutex);
+}
+
+uint32_t JpegDecodePool::getDroppedCount() {
+    pthread_mutex_lock(&mMutex);
+    uint32_t count = mDroppedCount;
+    pthread_mutex_unlock(&mMutex);
+    return count;
+}
+
+// PRIVATE
+JpegDecodePool::Job* JpegDecodePool::getNextJob() {
+    while(mNextDelivery < mNextSequence) {
+        Job* job = NULL;
+        for(uint32_t i = 0; i < mJobs.size(); ++i) {
+            if(mJobs[i].state != JOB_FREE && mJobs[i].sequence == mNextDelivery) {
+                job = &mJobs[i];
+                break;
+            }
+        }
+        if(job == NULL) { // Dropped.
+            mNextDelivery++;
+            continue;
+        }
+        if(job->state == JOB_FAILED) {
+            job->state = JOB_FREE;
+            mNextDelivery++;
+            continue;
+        }
+        return job;
+    }
+    return NULL;
+}
+
+bool JpegDecodePool::isNextJobDone() {
+    Job* job = getNextJob();
+    return job != NULL && job->state == JOB_DONE;
+}
+
+void JpegDecodePool::updateEventFd() {
+    if(mEventFd == -1) {
+        return;
+    }
+    bool available = isNextJobDone();
+    if(available == mEventFdSignalled) {
+        return;
+    }
+    eventfd_t value = 1;
+    int ret = available ? eventfd_write(mEventFd, value) : eventfd_read(mEventFd, &value);
+    if(ret == -1 && errno != EAGAIN) {
+        LOG_WARN("eventfd could not be updated: %s", strerror(errno));
+        return;
+    }
+    mEventFdSignalled = available;
+}
+
+// PRIVATE STATIC
+void* JpegDecodePool::workerLoop(void* ptr) {
+    JpegDecodePool* pool = (JpegDecodePool*)ptr;
+    JpegDecoder decoder;
+
+    pthread_mutex_lock(&pool->mMutex);
+    while(true) {
+        // Decode the oldest queued image first.
+        Job* job = NULL;
+        while(pool->mRunning) {
+            for(uint32_t i = 0; i < pool->mJobs.size(); ++i) {
+                Job& candidate = pool->mJobs[i];
+                if(candidate.state == JOB_QUEUED &&
+                        (job == NULL || candidate.sequence < job->sequence)) {
+                    job = &candidate;
+                }
+            }
+            if(job != NULL) {
+                break;
+            }
+            pthread_cond_wait(&pool->mCondQueued, &pool->mMutex);
+        }
+        if(!pool->mRunning) {
+            break;
+        }
+
+        job->state = JOB_DECODING;
+        uint64_t sequence = job->sequence;
+        decoder.setScale(job->scale);
+        pthread_mutex_unlock(&pool->mMutex);
+
+        bool success = !job->data.empty() &&
+                decoder.decode(&job->data[0], job->data.size(), job->mode, job->frame);
+
+        pthread_mutex_lock(&pool->mMutex);
+        if(sequence < pool->mNextDelivery) { // Cleared in the meantime.
+            job->state = JOB_FREE;
+        } else if(success) {
+            job->state = JOB_DONE;
+        } else {
+            job->state = JOB_FAILED;
+            pool->mDroppedCount++;
+        }
+        pool->updateEventFd();
+        pthread_cond_broadcast(&pool->mCondDone);
+
+        // A failed image may have blocked frames which had been decoded before.
+        if(pool->mpDoneCallback != NULL && pool->isNextJobDone()) {
+            void (*callback)(void*) = pool->mpDoneCallback;
+            void* p = pool->mpDonePassThroughPointer;
+            pthread_mutex_unlock(&pool->mMutex);
+            callback(p);
+            pthread_mutex_lock(&pool->mMutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mMutex);
+    return NULL;
+}
+
+} // end namespace camera
@@ -0,0 +1,176 @@
+/*
+ * \file    cam_decode_pool.h
+ *
+ * \brief   Decodes MJPEG images on several threads and delivers them in capture order.
+ *
+ * \details Decoding a large MJPEG image can take longer than a frame interval,
+ *          so the images are distributed to worker threads, each with its own
+ *          JpegDecoder. The decoded frames are reordered using their sequence number.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _CAM_DECODE_POOL_H_
+#define _CAM_DECODE_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <base/Time.hpp>
+#include <base/samples/Frame.hpp>
+
+namespace camera
+{
+
+struct JpegHeaderInfo;
+
+/**
+ * The images are pushed by the capture thread and popped by the consumer.
+ * A fixed number of slots (two per worker) is allocated once, the image buffers
+ * of the slots and of the popped frames are swapped, so nothing is allocated
+ * in steady state. If all slots are in use the pool has fallen behind
+ * and either the oldest pending image or the new image is dropped.
+ */
+class JpegDecodePool {
+
+ public:
+    /**
+     * Starts the worker threads.
+     * \param drop_stale If the pool falls behind, drop the oldest image which has not been
+     * decoded or retrieved yet. Otherwise the new image is dropped.
+     */
+    JpegDecodePool(uint32_t thread_count, bool drop_stale);
+
+    /**
+     * Stops and joins the worker threads.
+     */
+    ~JpegDecodePool();
+
+    /**
+     * See JpegDecoder::setScale(), used for all following images.
+     */
+    bool setScale(uint32_t denominator);
+
+    /**
+     * Copies the JPEG image and queues it for decoding. Never blocks.
+     * Comments are removed and missing Huffman tables inserted while copying.
+     * \param time Capture time, passed to the decoded frame.
+     * \param info If set, receives the header information collected while copying.
+     * \param complete_only Drops the image if it is incomplete (see JpegHeaderInfo::isComplete()).
+     * \return false if the image has been dropped.
+     */
+    bool push(uint8_t const* data, size_t size, base::samples::frame::frame_mode_t mode,
+            base::Time const& time, JpegHeaderInfo* info = NULL, bool complete_only = false);
+
+    /**
+     * Returns the next decoded frame in capture order. Dropped images and
+     * images which could not be decoded are skipped.
+     * The image buffer of 'frame' is passed back to the pool.
+     * \param timeout_ms Waits up to 'timeout_ms' for the frame, 0 does not wait.
+     */
+    bool pop(base::samples::frame::Frame& frame, int32_t timeout_ms);
+
+    /**
+     * Returns true if pop() would return a frame without waiting.
+     */
+    bool hasFrame();
+
+    /**
+     * Discards all pending images, e.g. after a restart of the stream.
+     */
+    void clear();
+
+    /**
+     * Creates an eventfd on the first call which is readable as long as hasFrame()
+     * returns true. Do not read from it. Closed in the destructor.
+     * \return The fd or -1 if it could not be created.
+     */
+    int getEventFd();
+
+    /**
+     * Sets a function which is called by the worker threads after an image has been
+     * decoded or failed and the next frame in capture order can be popped, so the
+     * frames can be delivered without polling. Called without the pool being locked,
+     * it must not delete the pool. Pass NULL to remove it.
+     */
+    void setDoneCallback(void (*callback)(void* p), void* p);
+
+    /**
+     * Number of images dropped because the pool fell behind, or which could not be decoded.
+     */
+    uint32_t getDroppedCount();
+
+    inline uint32_t getThreadCount() const {
+        return mThreads.size();
+    }
+
+ private:
+    enum JOB_STATE {
+        JOB_FREE,
+        JOB_QUEUED,
+        JOB_DECODING,
+        JOB_DONE,
+        JOB_FAILED
+    };
+
+    struct Job {
+        Job() : state(JOB_FREE), sequence(0), data(), mode(), scale(1), time(), frame() {}
+
+        enum JOB_STATE state;
+        uint64_t sequence;
+        std::vector<uint8_t> data;
+        base::samples::frame::frame_mode_t mode;
+        uint32_t scale;
+        base::Time time;
+        base::samples::frame::Frame frame;
+    };
+
+    JpegDecodePool();
+    JpegDecodePool(JpegDecodePool const&);
+    JpegDecodePool& operator=(JpegDecodePool const&);
+
+    /**
+     * Returns the job which has to be delivered next, skips dropped and failed images.
+     * mMutex has to be locked.
+     * \return NULL if the next image has not been pushed yet.
+     */
+    Job* getNextJob();
+
+    /**
+     * Returns true if the next job in capture order has been decoded. mMutex has to be locked.
+     */
+    bool isNextJobDone();
+
+    /**
+     * Signals or resets the eventfd according to hasFrame(). mMutex has to be locked.
+     */
+    void updateEventFd();
+
+    static void* workerLoop(void* ptr);
+
+    std::vector<Job> mJobs;
+    std::vector<pthread_t> mThreads;
+    bool mDropStale;
+    bool mRunning;
+    uint32_t mScaleDenominator;
+    uint64_t mNextSequence; // Assigned to the next pushed image.
+    uint64_t mNextDelivery; // Sequence of the next image returned by pop().
+    uint32_t mDroppedCount;
+    int mEventFd;
+    bool mEventFdSignalled;
+    void (*mpDoneCallback)(void* p);
+    void* mpDonePassThroughPointer;
+
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCondQueued; // Workers wait for images.
+    pthread_cond_t mCondDone; // pop() waits for decoded images.
+};
+
+} // end namespace camera
+
+#endif
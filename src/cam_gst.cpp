@@ -1,5 +1,8 @@
 #include "cam_gst.h"
+#include <errno.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include <boost/lexical_cast.hpp>
 
 using namespace base::samples::frame;
@@ -18,48 +21,86 @@ CamGst::InitGuard::~InitGuard() {
     gst_deinit();
 }
 
+CamGst::MainLoopGuard::MainLoopGuard() : mMainLoop(NULL), mThread() {
+    LOG_DEBUG("Starting gst main loop thread");
+    mMainLoop = g_main_loop_new (NULL, FALSE);
+    pthread_create(&mThread, NULL, mainLoop, (void*)mMainLoop);
+}
+
+CamGst::MainLoopGuard::~MainLoopGuard() {
+    // Quitting within the loop, g_main_loop_quit() before g_main_loop_run() 
+    // would be ignored.
+    g_idle_add(quitMainLoop, mMainLoop);
+    pthread_join(mThread, NULL);
+    g_main_loop_unref(mMainLoop);
+    mMainLoop = NULL;
+}
+
+pthread_mutex_t CamGst::sMutexDispatch = PTHREAD_MUTEX_INITIALIZER;
+
 // PUBLIC
 CamGst::CamGst(std::string const& device) : mDevice(device), 
         mJpegQuality(DEFAULT_JPEG_QUALITY), 
-        mLoop(NULL),
-        mMainLoopThread(NULL),
         mPipeline(NULL),
         mGstPipelineBus(NULL),
+        mBusWatchId(0),
         mPipelineRunning(false),
-        mBuffer(NULL),
-        mBufferSize(0),
-        mNewBuffer(false),
+        mPipelineError(false),
+        mQueue(1, (GstBuffer*)NULL),
+        mQueueFirst(0),
+        mQueueCount(0),
+        mQueuePolicy(QUEUE_DROP_OLDEST),
+        mQueueReleased(false),
+        mOverflowCount(0),
+        mpNewBufferCallbackFunction(NULL),
+        mpNewBufferPassThroughPointer(NULL),
+        mLastBufferTime(),
+        mStartTime(),
+        mFirstBufferTime(),
+        mStartEvents(0),
+        mEventFd(-1),
+        mEventFdSignalled(false),
         mSource(NULL),
+        mSink(NULL),
+        mSinkMaxBuffers(DEFAULT_SINK_MAX_BUFFERS),
+        mSinkDrop(true),
+        mSourceQueue(NULL),
+        mSourceQueueMaxBuffers(0),
+        mSourceQueueLeak(QUEUE_LEAK_DOWNSTREAM),
         mFileDescriptor(-1),
-        mRequestedFrameMode(MODE_UNDEFINED)
+        mRequestedFrameMode(MODE_UNDEFINED),
+        mRequestedWidth(0),
+        mRequestedHeight(0),
+        mDefaultParams(),
+        mPipelineDescription(),
+        mPipelineSinkName(),
+        mInsertJpegHuffmanTables(false)
 {
     LOG_DEBUG("CamGst: constructor");
     // gst_is_initialized() not available (since 0.10.31), 
     // could lead to a gst-mini-unref-warning.
     static InitGuard gInit;
+    static MainLoopGuard gMainLoop;
 
-    mLoop = g_main_loop_new (NULL, FALSE);
     pthread_mutex_init(&mMutexBuffer, NULL);
-    LOG_DEBUG("Starting gst main loop thread");
-    mMainLoopThread = new pthread_t();
-    pthread_create(mMainLoopThread, NULL, mainLoop, (void*)mLoop);
+    pthread_cond_init(&mCondQueueSpace, NULL);
+    pthread_cond_init(&mCondStartEvent, NULL);
 }
 
 CamGst::~CamGst() {
     LOG_DEBUG("CamGst: destructor");
-    if(mBuffer != NULL) {
-        gst_buffer_unref(mBuffer);
-        mBuffer = NULL;
-        mBufferSize = 0; 
-    }
     deletePipeline();
-    g_main_loop_quit(mLoop);
-    g_main_loop_unref(mLoop);
-    mLoop = NULL;
+    pthread_mutex_lock(&mMutexBuffer);
+    clearQueue();
+    pthread_mutex_unlock(&mMutexBuffer);
+    if(mEventFd != -1) {
+        close(mEventFd);
+        mEventFd = -1;
+    }
+    // The bus watch has been removed by deletePipeline(), the main loop keeps running.
+    pthread_cond_destroy(&mCondQueueSpace);
+    pthread_cond_destroy(&mCondStartEvent);
     pthread_mutex_destroy(&mMutexBuffer);
-    pthread_join(*mMainLoopThread, NULL);
-    delete mMainLoopThread;
-    mMainLoopThread = NULL;
 }
 
 void CamGst::printElementFactories() {
@@ -85,6 +126,7 @@ void CamGst::createDefaultPipeline(bool check_for_valid_params,
         uint32_t jpeg_quality) {
     LOG_DEBUG("CamGst: createDefaultPipeline");
     deletePipeline();
+    DefaultPipelineParams params = {true, width, height, fps, bpp, image_mode, jpeg_quality};
 
     // Sets the passed parameters if possible, otherwise valid ones.
     if(check_for_valid_params) {
@@ -93,50 +135,128 @@ void CamGst::createDefaultPipeline(bool check_for_valid_params,
     mJpegQuality = jpeg_quality;
 
     GstElement* source = createDefaultSource(mDevice);
-    GstElement* colorspace  = gst_element_factory_make("ffmpegcolorspace", "colorspace");
-    if(colorspace == NULL) {
-        deletePipeline();
-        throw CamGstException("Colorspace convertion element could not be created");
+    GstCaps* caps = createDefaultCaps(width, height, fps, bpp, image_mode);
+
+    // The colorspace conversion is only inserted if the camera can not provide the format.
+    GstElement* colorspace = NULL;
+    if(image_mode != MODE_JPEG && !isNativeFormat(source, caps)) {
+        colorspace = gst_element_factory_make("ffmpegcolorspace", "colorspace");
+        if(colorspace == NULL) {
+            gst_caps_unref(caps);
+            deletePipeline();
+            throw CamGstException("Colorspace convertion element could not be created");
+        }
     }
     
+    GstElement* queue = mSourceQueueMaxBuffers > 0 ? createDefaultQueue() : NULL;
     GstElement* sink = createDefaultSink();
     mSource = source;
+    mSink = sink;
+    mSourceQueue = queue;
 
     if((mPipeline = gst_pipeline_new ("default_pipeline")) == NULL) {
         deletePipeline();
         throw CamGstException("Default pipeline could not be created.");    
     }
 
-    // Add a message handler.
-    if(mGstPipelineBus != NULL) {
-        gst_object_unref (mGstPipelineBus); 
-        mGstPipelineBus = NULL;
-    }
-    mGstPipelineBus = gst_pipeline_get_bus (GST_PIPELINE (mPipeline));
-    gst_bus_add_watch (mGstPipelineBus, callbackMessagesStatic, this);  
+    addMessageHandler();
 
     GstElement* cap = 0;
    
-    cap = createDefaultCap(width, height, fps, bpp, image_mode); // format
-    if (image_mode == MODE_JPEG)
-    {
-        gst_bin_add_many (GST_BIN (mPipeline), source,  cap,  sink, (void*)NULL);
-        if (!gst_element_link_many (source,  cap, sink, (void*)NULL)) {
-            deletePipeline();
-            throw CamGstException("Failed to link jpeg pipeline, try another image mode");
-        }
+    cap = createDefaultCap(caps); // format
+    gst_caps_unref(caps);
+
+    // source ! [queue] ! [colorspace] ! cap ! sink
+    std::vector<GstElement*> elements;
+    elements.push_back(source);
+    if(queue != NULL) {
+        elements.push_back(queue);
     }
-    else
-    {
-        gst_bin_add_many (GST_BIN (mPipeline), source, colorspace, cap, sink, (void*)NULL);
-        if (!gst_element_link_many (source, colorspace, cap, sink, (void*)NULL)) {
+    if(colorspace != NULL) {
+        elements.push_back(colorspace);
+    }
+    elements.push_back(cap);
+    elements.push_back(sink);
+    for(unsigned int i=0; i<elements.size(); ++i) {
+        gst_bin_add(GST_BIN (mPipeline), elements[i]);
+    }
+    for(unsigned int i=1; i<elements.size(); ++i) {
+        if(!gst_element_link(elements[i-1], elements[i])) {
             deletePipeline();
-            throw CamGstException("Failed to link default pipeline, try another image mode");
+            throw CamGstException(image_mode == MODE_JPEG ? 
+                    "Failed to link jpeg pipeline, try another image mode" :
+                    "Failed to link default pipeline, try another image mode");
         }
     }
     
     // Required to check if the image is a JPEG within getBuffer() (for header adaptions).
     mRequestedFrameMode = image_mode;
+    mRequestedWidth = width;
+    mRequestedHeight = height;
+    mDefaultParams = params;
+}
+
+void CamGst::createPipeline(std::string const& description, std::string const& sink_name,
+        frame_mode_t image_mode, uint32_t width, uint32_t height) {
+    LOG_DEBUG("CamGst: createPipeline %s", description.c_str());
+    deletePipeline();
+
+    GError* err = NULL;
+    GstElement* pipeline = gst_parse_launch(description.c_str(), &err);
+    if(err != NULL) {
+        // Also set for recoverable errors like missing properties, which are not accepted.
+        std::string msg = std::string("Pipeline could not be parsed: ") + err->message;
+        g_error_free(err);
+        if(pipeline != NULL) {
+            gst_object_unref(GST_OBJECT(pipeline));
+        }
+        throw CamGstException(msg);
+    }
+    if(pipeline == NULL || !GST_IS_PIPELINE(pipeline)) {
+        // A single element is returned as it is.
+        if(pipeline != NULL) {
+            gst_object_unref(GST_OBJECT(pipeline));
+        }
+        throw CamGstException("Pipeline description has to contain a source and a sink");
+    }
+    mPipeline = pipeline;
+    addMessageHandler();
+
+    GstElement* sink = gst_bin_get_by_name(GST_BIN(mPipeline), sink_name.c_str());
+    if(sink == NULL || !GST_IS_APP_SINK(sink)) {
+        if(sink != NULL) {
+            gst_object_unref(GST_OBJECT(sink));
+        }
+        deletePipeline();
+        throw CamGstException("Pipeline contains no appsink named " + sink_name);
+    }
+    configureSink(sink);
+    mSink = sink;
+    gst_object_unref(GST_OBJECT(sink)); // Owned by the pipeline.
+
+    mSource = findFdSource();
+    if(mSource == NULL) {
+        LOG_WARN("Pipeline contains no source providing 'device-fd', the fd is not available");
+    }
+
+    mRequestedFrameMode = image_mode;
+    mRequestedWidth = width;
+    mRequestedHeight = height;
+    mPipelineDescription = description;
+    mPipelineSinkName = sink_name;
+}
+
+bool CamGst::isPipeline(std::string const& description, std::string const& sink_name) {
+    return mPipeline != NULL && !hasPipelineError() && !mPipelineDescription.empty() && 
+            mPipelineDescription == description && mPipelineSinkName == sink_name;
+}
+
+bool CamGst::isDefaultPipeline(uint32_t width, uint32_t height, uint32_t fps, uint32_t bpp,
+        frame_mode_t mode, uint32_t jpeg_quality) {
+    DefaultPipelineParams const& p = mDefaultParams;
+    return mPipeline != NULL && !hasPipelineError() && p.valid && p.width == width && 
+            p.height == height && p.fps == fps && p.bpp == bpp && p.mode == mode && 
+            p.jpeg_quality == jpeg_quality;
 }
 
 void CamGst::deletePipeline() {
@@ -148,14 +268,22 @@ void CamGst::deletePipeline() {
     
     stopPipeline();
 
-    gst_object_unref(GST_OBJECT(mGstPipelineBus)); 
-    mGstPipelineBus = NULL;
+    removeMessageHandler();
 
     gst_object_unref(GST_OBJECT(mPipeline));
     mPipeline = NULL;
+    mSource = NULL;
+    mSink = NULL;
+    mSourceQueue = NULL;
     mPipelineRunning = false;
+    mDefaultParams.valid = false;
+    mPipelineDescription.clear();
+    mPipelineSinkName.clear();
 
-    mNewBuffer = false;
+    pthread_mutex_lock(&mMutexBuffer);
+    mPipelineError = false;
+    clearQueue();
+    pthread_mutex_unlock(&mMutexBuffer);
 }
 
 // Print GstMessage
@@ -174,27 +302,25 @@ bool CamGst::startPipeline() {
     GstState state;
     GstStateChangeReturn ret_state;
 
+    pthread_mutex_lock(&mMutexBuffer);
+    mPipelineError = false;
+    mLastBufferTime = base::Time();
+    mFirstBufferTime = base::Time();
+    mStartTime = base::Time::now();
+    mQueueReleased = false;
+    pthread_mutex_unlock(&mMutexBuffer);
     ret_state = gst_element_set_state(mPipeline, GST_STATE_PLAYING);
     LOG_DEBUG("Set pipeline to playing returned %d",ret_state); 
 
-    timeval start, end;
-    gettimeofday(&start, 0);
-    int time_passed_msec = 0;
-    
     if(ret_state == GST_STATE_CHANGE_ASYNC) {
-        // gst_element_get_state will return immediately (other than written in the gst-docu!)
-        do {
-            ret_state = gst_element_get_state(mPipeline, &state, NULL, DEFAULT_PIPELINE_TIMEOUT);
-            gettimeofday(&end, 0);
-            
-            time_passed_msec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
-            if(time_passed_msec > (int)DEFAULT_PIPELINE_TIMEOUT) {
-                LOG_ERROR("Pipeline could not be started. If you wanted to restart the pipeline, try to delete and recreate the pipeline instead");
-                return false;
-            }
-        } while(ret_state == GST_STATE_CHANGE_ASYNC);
+        ret_state = waitForStateChange(DEFAULT_PIPELINE_TIMEOUT / 1000);
+        if(ret_state == GST_STATE_CHANGE_ASYNC) {
+            LOG_ERROR("Pipeline could not be started. If you wanted to restart the pipeline, try to delete and recreate the pipeline instead");
+            return false;
+        }
     } else {
-        ret_state = gst_element_get_state(mPipeline, &state, NULL, DEFAULT_PIPELINE_TIMEOUT);
+        ret_state = gst_element_get_state(mPipeline, &state, NULL, 
+                DEFAULT_PIPELINE_TIMEOUT * GST_USECOND);
     }
 
     mPipelineRunning = (ret_state == GST_STATE_CHANGE_SUCCESS ? true : false);
@@ -225,15 +351,74 @@ void CamGst::stopPipeline() {
     }
 
     // Setting to GST_STATE_NULL does not happen asynchronously, wait until stop.
+    releaseQueue();
     gst_element_set_state(mPipeline, GST_STATE_NULL);
     mPipelineRunning = false;
 
     rmFileDescriptor();
 }
 
+void CamGst::pausePipeline() {
+    LOG_DEBUG("CamGst: pausePipeline");
+    if(mPipeline == NULL) {
+        LOG_INFO("No pipeline available, can not be paused");
+        return;
+    }
+
+    // Synchronous for the source, which closes its stream but keeps the device.
+    releaseQueue();
+    gst_element_set_state(mPipeline, GST_STATE_READY);
+    gst_element_get_state(mPipeline, NULL, NULL, DEFAULT_PIPELINE_TIMEOUT * GST_USECOND);
+    mPipelineRunning = false;
+    rmFileDescriptor();
+
+    // The next image has to be one of the restarted stream.
+    pthread_mutex_lock(&mMutexBuffer);
+    clearQueue();
+    pthread_mutex_unlock(&mMutexBuffer);
+}
+
+bool CamGst::flushPipeline() {
+    LOG_DEBUG("CamGst: flushPipeline");
+    if(!mPipelineRunning) {
+        LOG_INFO("Pipeline not running, nothing to flush");
+        return false;
+    }
+
+    // A streaming thread waiting for space within the queue (QUEUE_BLOCK) would block 
+    // the flush, it drops its image instead.
+    releaseQueue();
+    bool flushed = gst_element_send_event(mPipeline, gst_event_new_flush_start());
+    flushed = gst_element_send_event(mPipeline, gst_event_new_flush_stop()) && flushed;
+    pthread_mutex_lock(&mMutexBuffer);
+    mQueueReleased = false;
+    pthread_mutex_unlock(&mMutexBuffer);
+    if(!flushed) {
+        LOG_WARN("Flush events have not been handled by the pipeline");
+    }
+    return flushed;
+}
+
+bool CamGst::hasPipelineError() {
+    pthread_mutex_lock(&mMutexBuffer);
+    bool error = mPipelineError;
+    pthread_mutex_unlock(&mMutexBuffer);
+    return error;
+}
+
+base::Time CamGst::getLastBufferTime() {
+    pthread_mutex_lock(&mMutexBuffer);
+    base::Time time = mLastBufferTime;
+    pthread_mutex_unlock(&mMutexBuffer);
+    return time;
+}
+
 bool CamGst::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read, 
-        int32_t timeout) {
+        int32_t timeout, ImageRegion* region, uint32_t scale, JpegHeaderInfo* info) {
     LOG_DEBUG("CamGst: getBuffer");
+    if(info != NULL) {
+        *info = JpegHeaderInfo();
+    }
     struct timeval start, end;
     long mtime=0, seconds=0, useconds=0; 
     if(timeout > 0) {
@@ -241,7 +426,7 @@ bool CamGst::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read,
     }
     do { 
         pthread_mutex_lock(&mMutexBuffer);
-        if(mBuffer == NULL || mBufferSize == 0 || mNewBuffer == false) {
+        if(mQueueCount == 0) {
             if(!blocking_read) { // !blocking: unlock and return.
                 pthread_mutex_unlock(&mMutexBuffer);
                 LOG_DEBUG("No image available");
@@ -251,11 +436,35 @@ bool CamGst::getBuffer(std::vector<uint8_t>& buffer, bool blocking_read,
                 usleep(50); // blocking: wait
             }
         } else {
-            // Copy buffer for return.
-            buffer.resize(mBufferSize);
-            memcpy(&buffer[0], GST_BUFFER_DATA(mBuffer), mBufferSize);
-            mNewBuffer = false;
+            // The oldest image is removed from the queue, so it can be copied
+            // without blocking the streaming thread.
+            GstBuffer* gst_buffer = popBuffer();
+            updateEventFd();
+            pthread_cond_signal(&mCondQueueSpace);
             pthread_mutex_unlock(&mMutexBuffer);
+
+            // Copy buffer for return, JPEG comments are skipped while copying.
+            // GStreamer 0.10 pads the rows of raw video to multiples of 4 bytes.
+            uint8_t* data = GST_BUFFER_DATA(gst_buffer);
+            uint32_t size = GST_BUFFER_SIZE(gst_buffer);
+            uint32_t fourcc = getPackedFourcc(mRequestedFrameMode);
+            uint32_t stride = (mRequestedWidth * getPackedPixelSize(fourcc) + 3) & ~3u;
+            bool region_copied = region != NULL && 
+                    clipRegion(fourcc, mRequestedWidth, mRequestedHeight, scale, *region) &&
+                    extractRegion(data, size, mRequestedWidth, 
+                    stride, fourcc, NULL, *region, buffer);
+            if(region != NULL && !region_copied) {
+                *region = ImageRegion();
+            }
+            if(region_copied) {
+                // Only the region has been copied.
+            } else if(mRequestedFrameMode == MODE_JPEG) {
+                Helpers::normalizeJpeg(data, size, buffer, mInsertJpegHuffmanTables, info);
+            } else {
+                buffer.resize(size);
+                memcpy(&buffer[0], data, size);
+            }
+            gst_buffer_unref(gst_buffer);
             blocking_read = false; // Done, return true.
             return true;
         }
@@ -279,12 +488,92 @@ bool CamGst::skipBuffer() {
     LOG_DEBUG("CamGst: skipBuffer");
     bool skipped = false;
     pthread_mutex_lock(&mMutexBuffer);
-    skipped = mNewBuffer;
-    mNewBuffer = false;
+    skipped = mQueueCount > 0;
+    clearQueue();
     pthread_mutex_unlock(&mMutexBuffer);
     return skipped;
 }
 
+void CamGst::setBufferQueue(uint32_t length, enum QUEUE_POLICY policy) {
+    if(length == 0) {
+        length = 1;
+    }
+    pthread_mutex_lock(&mMutexBuffer);
+    if(length != mQueue.size()) {
+        // The newest images are kept if the queue shrinks.
+        while(mQueueCount > length) {
+            gst_buffer_unref(popBuffer());
+        }
+        std::vector<GstBuffer*> queue(length, (GstBuffer*)NULL);
+        for(uint32_t i=0; i<mQueueCount; ++i) {
+            queue[i] = mQueue[(mQueueFirst + i) % mQueue.size()];
+        }
+        mQueue.swap(queue);
+        mQueueFirst = 0;
+        updateEventFd();
+        LOG_INFO("GStreamer buffer queue holds %d images", length);
+    }
+    mQueuePolicy = policy;
+    // A waiting streaming thread has to check the new size and policy.
+    pthread_cond_broadcast(&mCondQueueSpace);
+    pthread_mutex_unlock(&mMutexBuffer);
+}
+
+uint32_t CamGst::getOverflowCount() {
+    pthread_mutex_lock(&mMutexBuffer);
+    uint32_t count = mOverflowCount;
+    pthread_mutex_unlock(&mMutexBuffer);
+    return count;
+}
+
+void CamGst::setNewBufferCallback(bool (*pcallback_function)(uint8_t const* data, uint32_t size, void* p), 
+        void* p) {
+    pthread_mutex_lock(&mMutexBuffer);
+    mpNewBufferCallbackFunction = pcallback_function;
+    mpNewBufferPassThroughPointer = p;
+    pthread_mutex_unlock(&mMutexBuffer);
+}
+
+void CamGst::setSinkQueue(uint32_t max_buffers, bool drop) {
+    mSinkMaxBuffers = max_buffers;
+    mSinkDrop = drop;
+    if(mSink != NULL) {
+        gst_app_sink_set_max_buffers((GstAppSink*)mSink, max_buffers);
+        gst_app_sink_set_drop((GstAppSink*)mSink, drop ? TRUE : FALSE);
+    }
+}
+
+void CamGst::setSourceQueue(uint32_t max_buffers, enum QUEUE_LEAK leak) {
+    bool recreate = (max_buffers > 0) != (mSourceQueueMaxBuffers > 0);
+    mSourceQueueMaxBuffers = max_buffers;
+    mSourceQueueLeak = leak;
+    if(recreate) {
+        // Adding or removing the element requires a new default pipeline.
+        mDefaultParams.valid = false;
+    } else if(mSourceQueue != NULL) {
+        g_object_set (G_OBJECT (mSourceQueue), 
+                "max-size-buffers", max_buffers,
+                "leaky", (gint)leak,
+                (void*)NULL);
+    }
+}
+
+int CamGst::getEventFd() {
+    pthread_mutex_lock(&mMutexBuffer);
+    if(mEventFd == -1) {
+        mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(mEventFd == -1) {
+            LOG_ERROR("eventfd could not be created: %s", strerror(errno));
+        } else {
+            mEventFdSignalled = false;
+            updateEventFd();
+        }
+    }
+    int fd = mEventFd;
+    pthread_mutex_unlock(&mMutexBuffer);
+    return fd;
+}
+
 // PRIVATE
 
 CamGst::CamGst() {}
@@ -353,12 +642,8 @@ static std::string toGstreamerFourCC(frame_mode_t mode)
 }
 
 // remove format, bb to 24?
-GstElement* CamGst::createDefaultCap(uint32_t const width, uint32_t const height, uint32_t const fps, uint32_t bpp, frame_mode_t image_mode ) {
-    LOG_DEBUG("createDefaultCap, width: %d, height: %d, fps: %d", width, height, fps);
-    GstElement* element = gst_element_factory_make("capsfilter", "default_cap");
-    if(element == NULL)
-        throw CamGstException("Default cap could not be created.");
-
+GstCaps* CamGst::createDefaultCaps(uint32_t const width, uint32_t const height, uint32_t const fps, uint32_t bpp, frame_mode_t image_mode ) {
+    LOG_DEBUG("createDefaultCaps, width: %d, height: %d, fps: %d", width, height, fps);
     std::string media_type("video/x-raw-yuv"), fourcc;
     if (image_mode != MODE_UNDEFINED)
     {
@@ -383,14 +668,45 @@ GstElement* CamGst::createDefaultCap(uint32_t const width, uint32_t const height
     }
 
     char* debug_str = gst_caps_to_string(caps);
-    LOG_DEBUG("createDefaultCap: %s", debug_str);
+    LOG_DEBUG("createDefaultCaps: %s", debug_str);
     g_free(debug_str);
+    return caps;
+}
 
-    // Set property 'caps' of element 'capsfilter'.
+GstElement* CamGst::createDefaultCap(GstCaps* caps) {
+    GstElement* element = gst_element_factory_make("capsfilter", "default_cap");
+    if(element == NULL)
+        throw CamGstException("Default cap could not be created.");
+
+    // Set property 'caps' of element 'capsfilter', which keeps its own reference.
     g_object_set (G_OBJECT (element), "caps", caps, (void*)NULL);
     return element;
 }
 
+bool CamGst::isNativeFormat(GstElement* source, GstCaps* caps) {
+    // v4l2src only reports the formats of the camera after opening the device.
+    if(gst_element_set_state(source, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE) {
+        LOG_WARN("Source could not be opened, formats of the camera are unknown");
+        gst_element_set_state(source, GST_STATE_NULL);
+        return false;
+    }
+    bool native = false;
+    GstPad* pad = gst_element_get_static_pad(source, "src");
+    if(pad != NULL) {
+        GstCaps* source_caps = gst_pad_get_caps(pad);
+        if(source_caps != NULL) {
+            // ANY would intersect with everything without telling anything.
+            native = !gst_caps_is_any(source_caps) && gst_caps_can_intersect(source_caps, caps);
+            gst_caps_unref(source_caps);
+        }
+        gst_object_unref(GST_OBJECT(pad));
+    }
+    gst_element_set_state(source, GST_STATE_NULL);
+    LOG_INFO("Requested format is %sprovided by the camera%s", native ? "" : "not ", 
+            native ? ", no colorspace conversion" : "");
+    return native;
+}
+
 // mode to 1 - streaming?
 GstElement* CamGst::createDefaultEncoder(int32_t const jpeg_quality) {
     LOG_DEBUG("CamGst: createDefaultEncoder jpegenc, jpeg_quality: %d", jpeg_quality);
@@ -410,16 +726,87 @@ GstElement* CamGst::createDefaultSink() {
     GstElement* element  = gst_element_factory_make("appsink", "default_buffer_sink");
     if(element == NULL)
         throw CamGstException("Default sink could not be created.");
+    configureSink(element);
+    return element;
+}
+
+GstElement* CamGst::createDefaultQueue() {
+    LOG_DEBUG("CamGst: createDefaultQueue, max buffers: %d, leak: %d", 
+            mSourceQueueMaxBuffers, (int)mSourceQueueLeak);
+    GstElement* element = gst_element_factory_make("queue", "default_queue");
+    if(element == NULL)
+        throw CamGstException("Default queue could not be created.");
+    // Only limited by the number of buffers.
     g_object_set (G_OBJECT (element), 
+            "max-size-buffers", mSourceQueueMaxBuffers,
+            "max-size-bytes", 0,
+            "max-size-time", (guint64)0,
+            "leaky", (gint)mSourceQueueLeak,
+            (void*)NULL);
+    return element;
+}
+
+void CamGst::configureSink(GstElement* sink) {
+    g_object_set (G_OBJECT (sink), 
             "sync", FALSE, 
-            //"max_buffers", 8,
-            //"drop", FALSE,
+            "max-buffers", mSinkMaxBuffers,
+            "drop", mSinkDrop ? TRUE : FALSE,
             (void*)NULL);
-	gst_app_sink_set_emit_signals ((GstAppSink*) element, TRUE);
 
-    // do after add und link? Disconnecting?
-	g_signal_connect (element, "new-buffer",  G_CALLBACK (callbackNewBufferStatic), this);
-    return element;
+    // No signals, the callbacks are called directly.
+    GstAppSinkCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(GstAppSinkCallbacks));
+    callbacks.eos = callbackEosStatic;
+    callbacks.new_buffer = callbackNewBufferStatic;
+    gst_app_sink_set_callbacks((GstAppSink*)sink, &callbacks, this, NULL);
+}
+
+GstElement* CamGst::findFdSource() {
+    GstElement* source = NULL;
+    GstIterator* it = gst_bin_iterate_sources(GST_BIN(mPipeline));
+    bool done = false;
+    while(!done) {
+        gpointer item = NULL;
+        switch(gst_iterator_next(it, &item)) {
+            case GST_ITERATOR_OK:
+                if(source == NULL && g_object_class_find_property(
+                        G_OBJECT_GET_CLASS(item), "device-fd") != NULL) {
+                    source = (GstElement*)item;
+                }
+                gst_object_unref(item); // The pipeline keeps its reference.
+                break;
+            case GST_ITERATOR_RESYNC:
+                source = NULL;
+                gst_iterator_resync(it);
+                break;
+            default: // DONE or ERROR
+                done = true;
+                break;
+        }
+    }
+    gst_iterator_free(it);
+    return source;
+}
+
+void CamGst::addMessageHandler() {
+    removeMessageHandler();
+    mGstPipelineBus = gst_pipeline_get_bus (GST_PIPELINE (mPipeline));
+    mBusWatchId = gst_bus_add_watch (mGstPipelineBus, callbackMessagesStatic, this);  
+}
+
+void CamGst::removeMessageHandler() {
+    if(mBusWatchId != 0) {
+        // No message of this object is dispatched after the watch has been removed,
+        // see callbackMessagesStatic().
+        pthread_mutex_lock(&sMutexDispatch);
+        g_source_remove(mBusWatchId);
+        pthread_mutex_unlock(&sMutexDispatch);
+        mBusWatchId = 0;
+    }
+    if(mGstPipelineBus != NULL) {
+        gst_object_unref (mGstPipelineBus); 
+        mGstPipelineBus = NULL;
+    }
 }
 
 bool CamGst::readFileDescriptor(){
@@ -449,10 +836,23 @@ void* CamGst::mainLoop(void* ptr) {
     return NULL;
 }
 
+gboolean CamGst::quitMainLoop(gpointer data) {
+    g_main_loop_quit((GMainLoop*)data);
+    return FALSE; // Removes the idle source.
+}
+
 gboolean CamGst::callbackMessagesStatic(GstBus* bus, GstMessage* msg, gpointer data)
 {
-    CamGst* cam_gst = (CamGst*)data;
-    return cam_gst->callbackMessages(bus, msg, data);
+    // The watch may have been removed while waiting for the lock, 
+    // the object may not exist anymore.
+    gboolean ret = TRUE;
+    pthread_mutex_lock(&sMutexDispatch);
+    if(!g_source_is_destroyed(g_main_current_source())) {
+        CamGst* cam_gst = (CamGst*)data;
+        ret = cam_gst->callbackMessages(bus, msg, data);
+    }
+    pthread_mutex_unlock(&sMutexDispatch);
+    return ret;
 }
 
 gboolean CamGst::callbackMessages(GstBus* bus, GstMessage* msg, gpointer data)
@@ -474,41 +874,226 @@ gboolean CamGst::callbackMessages(GstBus* bus, GstMessage* msg, gpointer data)
             gst_message_parse_error (msg, &error, &debug);
             g_free (debug);
 
-            LOG_INFO("GStreamer error message received: ", error->message);
+            LOG_ERROR("GStreamer error message received: %s", error->message);
             g_error_free (error);
-            //cam_gst->deletePipeline();
+            pthread_mutex_lock(&mMutexBuffer);
+            mPipelineError = true;
+            pthread_mutex_unlock(&mMutexBuffer);
+            notifyStartEvent();
         break;
         }
+        case GST_MESSAGE_ASYNC_DONE:
+            notifyStartEvent();
+        break;
+        case GST_MESSAGE_STATE_CHANGED:
+            if(GST_MESSAGE_SRC (msg) == GST_OBJECT (mPipeline)) {
+                notifyStartEvent();
+            }
+        break;
         default: break;
     }
     return true;
 }
 
-void CamGst::callbackNewBufferStatic(GstElement* object, CamGst* cam_gst_p) {
-    cam_gst_p->callbackNewBuffer(object, cam_gst_p);
+void CamGst::updateEventFd() {
+    bool new_buffer = hasNewBuffer();
+    if(mEventFd == -1 || new_buffer == mEventFdSignalled) {
+        return;
+    }
+    // The counter of the eventfd is either 0 or 1, reading resets it to 0.
+    eventfd_t value = 1;
+    int ret = new_buffer ? eventfd_write(mEventFd, value) : eventfd_read(mEventFd, &value);
+    if(ret == -1 && errno != EAGAIN) {
+        LOG_WARN("eventfd could not be updated: %s", strerror(errno));
+        return;
+    }
+    mEventFdSignalled = new_buffer;
+}
+
+GstBuffer* CamGst::popBuffer() {
+    if(mQueueCount == 0) {
+        return NULL;
+    }
+    GstBuffer* buffer = mQueue[mQueueFirst];
+    mQueue[mQueueFirst] = NULL;
+    mQueueFirst = (mQueueFirst + 1) % mQueue.size();
+    mQueueCount--;
+    return buffer;
+}
+
+void CamGst::clearQueue() {
+    while(mQueueCount > 0) {
+        gst_buffer_unref(popBuffer());
+    }
+    mQueueFirst = 0;
+    updateEventFd();
+    pthread_cond_broadcast(&mCondQueueSpace);
+}
+
+void CamGst::releaseQueue() {
+    pthread_mutex_lock(&mMutexBuffer);
+    mQueueReleased = true;
+    pthread_cond_broadcast(&mCondQueueSpace);
+    pthread_cond_broadcast(&mCondStartEvent);
+    pthread_mutex_unlock(&mMutexBuffer);
+}
+
+void CamGst::notifyStartEvent() {
+    pthread_mutex_lock(&mMutexBuffer);
+    mStartEvents++;
+    pthread_cond_broadcast(&mCondStartEvent);
+    pthread_mutex_unlock(&mMutexBuffer);
+}
+
+GstStateChangeReturn CamGst::waitForStateChange(int32_t timeout_ms) {
+    struct timespec deadline = getDeadline(timeout_ms);
+    GstStateChangeReturn ret = GST_STATE_CHANGE_ASYNC;
+    bool timeout = false;
+    pthread_mutex_lock(&mMutexBuffer);
+    while(true) {
+        // Each event only triggers a non-blocking query of the state, the counter
+        // catches events which are received during the query.
+        uint32_t events = mStartEvents;
+        pthread_mutex_unlock(&mMutexBuffer);
+        ret = gst_element_get_state(mPipeline, NULL, NULL, 0);
+        pthread_mutex_lock(&mMutexBuffer);
+        if(ret != GST_STATE_CHANGE_ASYNC || mPipelineError || timeout) {
+            break;
+        }
+        while(events == mStartEvents && !timeout) {
+            timeout = pthread_cond_timedwait(&mCondStartEvent, &mMutexBuffer, 
+                    &deadline) == ETIMEDOUT;
+        }
+    }
+    if(mPipelineError) {
+        ret = GST_STATE_CHANGE_FAILURE;
+    }
+    pthread_mutex_unlock(&mMutexBuffer);
+    return ret;
+}
+
+bool CamGst::waitForFirstBuffer(int32_t timeout_ms) {
+    struct timespec deadline = getDeadline(timeout_ms);
+    pthread_mutex_lock(&mMutexBuffer);
+    while(mFirstBufferTime.isNull() && !mQueueReleased && !mPipelineError) {
+        if(pthread_cond_timedwait(&mCondStartEvent, &mMutexBuffer, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool received = !mFirstBufferTime.isNull();
+    pthread_mutex_unlock(&mMutexBuffer);
+    return received;
+}
+
+base::Time CamGst::getTimeToFirstBuffer() {
+    pthread_mutex_lock(&mMutexBuffer);
+    base::Time time = mFirstBufferTime.isNull() ? base::Time() : mFirstBufferTime - mStartTime;
+    pthread_mutex_unlock(&mMutexBuffer);
+    return time;
+}
+
+struct timespec CamGst::getDeadline(int32_t timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+GstFlowReturn CamGst::callbackNewBufferStatic(GstAppSink* sink, gpointer data) {
+    ((CamGst*)data)->callbackNewBuffer(sink);
+    return GST_FLOW_OK;
 }   
 
-void CamGst::callbackNewBuffer(GstElement* object, CamGst* cam_gst_p) {
-    LOG_DEBUG("CamGst: callbackNewBuffer");
+void CamGst::callbackEosStatic(GstAppSink* /*sink*/, gpointer /*data*/) {
+    LOG_INFO("GStreamer appsink received end of stream");
+}
+
+void CamGst::callbackNewBuffer(GstAppSink* sink) {
+    // Called for each image, so nothing is logged here. The buffer is pulled
+    // before locking, the mutex only guards the queue.
+    GstBuffer* buffer = gst_app_sink_pull_buffer(sink);
+    if(buffer == NULL) { // EOS was received in the meantime.
+        return;
+    }
+    base::Time now = base::Time::now();
+
     pthread_mutex_lock(&mMutexBuffer);
-    if(mBuffer != NULL) {
-        LOG_DEBUG("Unref old image buffer");
-        gst_buffer_unref(mBuffer);
-        mBuffer = NULL;
-        mBufferSize = 0; 
-    }
-    mBuffer = gst_app_sink_pull_buffer((GstAppSink*)object);
-
-    if(mBuffer == NULL) { // EOS was received before any buffer
-        mBufferSize = 0;
-        mNewBuffer = false;
-        LOG_WARN("EOS was received before any buffer");
-    } else {
-        mBufferSize = GST_BUFFER_SIZE(mBuffer);
-        mNewBuffer = true;
-        LOG_DEBUG("New image received, size: %d",mBufferSize); 
+    mLastBufferTime = now;
+    bool first_buffer = mFirstBufferTime.isNull();
+    if(first_buffer) {
+        mFirstBufferTime = now;
+        mStartEvents++;
+        pthread_cond_broadcast(&mCondStartEvent);
+    }
+    GstBuffer* dropped_buffer = NULL;
+    if(mQueueCount >= mQueue.size()) {
+        mOverflowCount++;
+        // Blocking the streaming thread lets the images pile up within the driver.
+        while(mQueuePolicy == QUEUE_BLOCK && !mQueueReleased && 
+                mQueueCount >= mQueue.size()) {
+            pthread_cond_wait(&mCondQueueSpace, &mMutexBuffer);
+        }
+    }
+    if(mQueueCount >= mQueue.size()) {
+        if(mQueuePolicy == QUEUE_DROP_OLDEST) {
+            dropped_buffer = popBuffer();
+        } else { // Newest image or released while blocking.
+            dropped_buffer = buffer;
+            buffer = NULL;
+        }
+    }
+    if(buffer != NULL) {
+        mQueue[(mQueueFirst + mQueueCount) % mQueue.size()] = buffer;
+        mQueueCount++;
+        updateEventFd();
+    }
+
+    // The callback is called without holding the mutex, the additional
+    // reference keeps the data valid even if the image leaves the queue.
+    GstBuffer* callback_buffer = NULL;
+    bool (*callback_function)(uint8_t const*, uint32_t, void*) = mpNewBufferCallbackFunction;
+    void* pass_through_pointer = mpNewBufferPassThroughPointer;
+    if(callback_function != NULL && buffer != NULL) {
+        callback_buffer = gst_buffer_ref(buffer);
     }
     pthread_mutex_unlock(&mMutexBuffer);
+
+    if(first_buffer) {
+        LOG_INFO("First image received %d ms after starting the pipeline", 
+                (int)(now - mStartTime).toMilliseconds());
+    }
+
+    if(dropped_buffer != NULL) {
+        gst_buffer_unref(dropped_buffer);
+    }
+
+    if(callback_buffer != NULL) {
+        bool consumed = callback_function(GST_BUFFER_DATA(callback_buffer), 
+                GST_BUFFER_SIZE(callback_buffer), pass_through_pointer);
+        if(consumed) {
+            // Removes the image if it is still the newest one within the queue.
+            GstBuffer* consumed_buffer = NULL;
+            pthread_mutex_lock(&mMutexBuffer);
+            uint32_t last = (mQueueFirst + mQueueCount + mQueue.size() - 1) % mQueue.size();
+            if(mQueueCount > 0 && mQueue[last] == callback_buffer) {
+                consumed_buffer = mQueue[last];
+                mQueue[last] = NULL;
+                mQueueCount--;
+                updateEventFd();
+                pthread_cond_signal(&mCondQueueSpace);
+            }
+            pthread_mutex_unlock(&mMutexBuffer);
+            if(consumed_buffer != NULL) {
+                gst_buffer_unref(consumed_buffer);
+            }
+        }
+        gst_buffer_unref(callback_buffer);
+    }
 } 
 } // end namespace camera
 
@@ -52,11 +52,32 @@ class CamGst {
     static const uint32_t DEFAULT_FPS = 10;
     static const uint32_t DEFAULT_BPP = 24;
     static const uint32_t DEFAULT_JPEG_QUALITY = 85; // 0 to 100
-    static const uint32_t DEFAULT_PIPELINE_TIMEOUT = 4000000; // 4 sec.
+    static const uint32_t DEFAULT_PIPELINE_TIMEOUT = 4000000; // 4 sec in microseconds.
+    static const uint32_t DEFAULT_SINK_MAX_BUFFERS = 1; // Only the newest image is queued.
+
+    /**
+     * What happens to a new image if the buffer queue is full, see setBufferQueue().
+     */
+    enum QUEUE_POLICY {
+        QUEUE_DROP_OLDEST, // The oldest image is dropped.
+        QUEUE_DROP_NEWEST, // The new image is dropped.
+        QUEUE_BLOCK // The streaming thread waits, so the source stops dequeuing images.
+    };
+
+    /**
+     * Which images are dropped by the queue behind the source if it is full, 
+     * see setSourceQueue(). Values of the 'leaky' property of the queue element.
+     */
+    enum QUEUE_LEAK {
+        QUEUE_LEAK_NONE = 0, // The source waits.
+        QUEUE_LEAK_UPSTREAM = 1, // New images are dropped.
+        QUEUE_LEAK_DOWNSTREAM = 2 // The oldest images are dropped, so the newest are processed.
+    };
 
  public:
     /**
-     * Initialize GStreamer and starts the GMainLoop in its own thread.
+     * Initialize GStreamer and starts the GMainLoop in its own thread if this is the
+     * first instance, all instances share this loop (see MainLoopGuard).
      * \param device Only used to configure the GStreamer source (e.g. /dev/video0).
      * \param cam_config Pointer to a CamConfig object, used to get a valid image size 
      * and fps and for general configurations.
@@ -64,7 +85,7 @@ class CamGst {
     CamGst(std::string const& device);
 
     /**
-     * Stops the GMainLoop and its thread.
+     * The GMainLoop keeps running until the process exits.
      */
     ~CamGst();
 
@@ -92,6 +113,34 @@ class CamGst {
             base::samples::frame::frame_mode_t mode = base::samples::frame::MODE_UNDEFINED,
             uint32_t jpeg_quality = DEFAULT_JPEG_QUALITY);
 
+    /**
+     * Creates a pipeline from a gst-launch description, e.g.
+     * "v4l2src device=/dev/video0 ! video/x-raw-yuv,width=640,height=480 ! dspjpegenc ! appsink name=sink".
+     * The appsink 'sink_name' is configured like the default sink, so the buffer queue, 
+     * the callbacks and start/stop behave like with the default pipeline. The fd is 
+     * requested from the first source providing 'device-fd' (v4l2src).
+     * \param mode, width, height Format of the images received by the sink, used to
+     * normalize JPEGs and to copy regions within getBuffer(). A width of 0 disables regions.
+     * \return If the pipeline can not be parsed or contains no such appsink a 
+     * CamGstException is thrown.
+     */
+    void createPipeline(std::string const& description, std::string const& sink_name = "sink",
+            base::samples::frame::frame_mode_t mode = base::samples::frame::MODE_UNDEFINED,
+            uint32_t width = 0, uint32_t height = 0);
+
+    /**
+     * Returns true if the pipeline has been created by createPipeline() with the same
+     * description and has not failed.
+     */
+    bool isPipeline(std::string const& description, std::string const& sink_name);
+
+    /**
+     * Returns true if the pipeline has been created by createDefaultPipeline() with the
+     * same parameters and has not failed, so it can be restarted instead of recreated.
+     */
+    bool isDefaultPipeline(uint32_t width, uint32_t height, uint32_t fps, uint32_t bpp,
+            base::samples::frame::frame_mode_t mode, uint32_t jpeg_quality);
+
     /**
      * Deletes pipeline, clears buffer.
      */
@@ -103,34 +152,131 @@ class CamGst {
      * an error message will be printed and false will be returned.
      * \warning Just stopping and starting a pipeline may not work.
      * You should delete and recreate the pipeline instead!
+     * Waits for the state change to PLAYING, which is signalled by the messages of the 
+     * bus (see callbackMessages()) or the first image, for DEFAULT_PIPELINE_TIMEOUT at most.
      * \return True if its already running or could be started.
      */
     bool startPipeline();
 
+    /**
+     * Waits until the first image after startPipeline() has been received, which
+     * also signals the eventfd (see getEventFd()).
+     * \return False on timeout, error or if the pipeline has been stopped.
+     */
+    bool waitForFirstBuffer(int32_t timeout_ms);
+
+    /**
+     * Time from startPipeline() until the first image has been received, 
+     * null if no image has been received yet.
+     */
+    base::Time getTimeToFirstBuffer();
+
     /**
      * \warning Just stopping and starting a pipeline may not work.
      * You should delete and recreate the pipeline instead!
      */
     void stopPipeline();
 
+    /**
+     * Stops the stream but keeps the pipeline in READY: The elements, the main loop and 
+     * the opened device are kept, only the capture buffers are released, so the camera 
+     * can be configured via v4l2 meanwhile. startPipeline() restarts the stream with 
+     * a state change. The last buffer is released.
+     */
+    void pausePipeline();
+
+    /**
+     * Sends a flush start/stop pair through the running pipeline. Buffers in flight
+     * are discarded and the source requeues its capture buffers.
+     * \return false if the pipeline is not running or the events were not handled.
+     */
+    bool flushPipeline();
+
     /**
      * Allows to request a copy of the new image.
      * \param buffer Will receive the image if available.
      * \param blocking_read If true, method will return as soon as a new image is available. 
      * \param timeout Max. time to wait for the frame in msec. < 1 means no timeout.
+     * \param region If set, only this part of the image is copied, see CamConfig::getBuffer().
+     * \param scale The region is clipped to a multiple of 'scale', see clipRegion().
+     * \param info If set, receives the header of a JPEG image, collected while copying.
+     * Reset for other images.
      * \return blocking-read not active: true if a new image is available, otherwise false. \n
      * blocking_read active: Returns true as soon as a new image is available or false 
      * after 'timeout' msec.
      */
     bool getBuffer(std::vector<uint8_t>& buffer, 
-            bool blocking_read=false, int32_t timeout=0);
+            bool blocking_read=false, int32_t timeout=0, 
+            ImageRegion* region=NULL, uint32_t scale=1, JpegHeaderInfo* info=NULL);
 
     /**
-     * Just sets mNewBuffer to false.
+     * Drops all queued images.
      * \return True if a new buffer was available.
      */
     bool skipBuffer();
 
+    /**
+     * Received images are queued until they are requested by getBuffer(), which returns
+     * the oldest one. If 'length' images are queued, a new one is handled according to 
+     * 'policy' and counted as overflow. Default is a single image which is replaced.
+     */
+    void setBufferQueue(uint32_t length, enum QUEUE_POLICY policy);
+
+    /**
+     * Number of images which did not fit into the buffer queue (or had to wait 
+     * with QUEUE_BLOCK) since the creation of the object.
+     */
+    uint32_t getOverflowCount();
+
+    /**
+     * The callback is called within the GStreamer streaming thread for each new buffer,
+     * after the buffer has been stored. 'data' is only valid during the call.
+     * If the callback returns true the buffer is marked as consumed 
+     * (hasNewBuffer() returns false).
+     */
+    void setNewBufferCallback(bool (*pcallback_function)(uint8_t const* data, uint32_t size, void* p), 
+            void* p);
+
+    /**
+     * Queue of the appsink: At most 'max_buffers' (0 unlimited) images are queued if the
+     * streaming thread delivers faster than they are handled. With 'drop' the oldest image
+     * is dropped, otherwise the streaming thread blocks. Applied to the current sink
+     * and to following pipelines. Default is DEFAULT_SINK_MAX_BUFFERS with dropping.
+     */
+    void setSinkQueue(uint32_t max_buffers, bool drop);
+
+    /**
+     * Inserts a queue element behind the source of the default pipeline, so the
+     * conversion runs within its own thread and the source keeps dequeuing images
+     * at the rate of the camera. At most 'max_buffers' are queued, 0 removes the 
+     * element (default). Changes of the size and leak are applied to the current queue,
+     * adding or removing it takes effect with the next createDefaultPipeline().
+     */
+    void setSourceQueue(uint32_t max_buffers, enum QUEUE_LEAK leak = QUEUE_LEAK_DOWNSTREAM);
+
+    /**
+     * Creates an eventfd on the first call which is readable as long as a new
+     * buffer is available (hasNewBuffer() returns true). Do not read from it,
+     * it is reset by getBuffer() and skipBuffer(). Closed in the destructor.
+     * \return The fd or -1 if it could not be created.
+     */
+    int getEventFd();
+
+    /**
+     * If set, the standard Huffman tables are inserted into JPEG images
+     * which do not contain any (see Helpers::normalizeJpeg()).
+     */
+    inline void setInsertJpegHuffmanTables(bool insert) {
+        mInsertJpegHuffmanTables = insert;
+    }
+
+    /**
+     * JPEG quality passed to the last createDefaultPipeline() call.
+     */
+    inline uint32_t getJpegQuality() const {
+        return mJpegQuality;
+    }
+
     /**
      * Stores the image to a file.
      * \return false if the file could not be opened or not all of the bytes could be written.
@@ -142,13 +288,25 @@ class CamGst {
      * True if a new buffer is available.
      */
     inline bool hasNewBuffer() {
-        return mNewBuffer;
+        return mQueueCount > 0;
     }
 
     inline bool isPipelineRunning() {
         return mPipelineRunning;
     }
 
+    /**
+     * Time the last buffer has been received from the pipeline,
+     * null if no buffer has been received since the pipeline has been started.
+     */
+    base::Time getLastBufferTime();
+
+    /**
+     * True if an error message has been received since the pipeline has been started,
+     * e.g. because the device has been removed (ENODEV).
+     */
+    bool hasPipelineError();
+
     /**
      * Returns the file descriptor used by GStreamer.
      * The pipeline has to be running, otherwise -1 will be returned.
@@ -170,15 +328,52 @@ class CamGst {
 
     GstElement* createDefaultSource(std::string const& device);
 
-    GstElement* createDefaultCap(uint32_t const width, uint32_t const height, uint32_t const fps, uint32_t bpp, base::samples::frame::frame_mode_t mode );
+    GstCaps* createDefaultCaps(uint32_t const width, uint32_t const height, uint32_t const fps, uint32_t bpp, base::samples::frame::frame_mode_t mode );
 
     /**
-     * Currently not used anymore, instead the encoding of the camera base class is used.
+     * Capsfilter restricting the stream to 'caps'.
+     */
+    GstElement* createDefaultCap(GstCaps* caps);
+
+    /**
+     * Opens the source to check whether the camera provides 'caps' directly, 
+     * so no colorspace conversion is required. The source is closed again.
+     */
+    bool isNativeFormat(GstElement* source, GstCaps* caps);
+
+    /**
+     * Currently not used anymore, raw images are encoded by the JpegEncoder
+     * of CamUsb instead (see CamUsb::setJpegEncoding()).
      */
     GstElement* createDefaultEncoder(int32_t const jpeg_quality);
 
     GstElement* createDefaultSink();
 
+    /**
+     * Queue element configured by setSourceQueue().
+     */
+    GstElement* createDefaultQueue();
+
+    /**
+     * Sets the queue properties and the callbacks of an appsink.
+     */
+    void configureSink(GstElement* sink);
+
+    /**
+     * Returns the first source of mPipeline which provides the property 'device-fd' or NULL.
+     */
+    GstElement* findFdSource();
+
+    /**
+     * Adds callbackMessages() as watch of the bus of mPipeline.
+     */
+    void addMessageHandler();
+
+    /**
+     * Removes the watch of the bus, so callbackMessages() is not called anymore.
+     */
+    void removeMessageHandler();
+
     /**
      * Set 'mFileDescriptor' to the fd of the current source (e.g. v4l2).
      * To get a valid fd the pipeline has to be running.
@@ -195,6 +390,12 @@ class CamGst {
  private: // STATIC METHODS
     static void* mainLoop(void* ptr);
 
+    /**
+     * Idle callback which quits the passed GMainLoop from within its thread.
+     */
+    static gboolean quitMainLoop(gpointer data);
+
+
     /**
      * Calls the method 'callbackMessages()' of the passed (using 'gpointer data') CamGst object.
      */
@@ -202,18 +403,63 @@ class CamGst {
 
     /**
      * Reports GST_MESSAGE_EOS and GST_MESSAGE_ERROR messages.
+     * An error sets 'mPipelineError', recovering is up to the owner (see CamUsb).
      */
     gboolean callbackMessages(GstBus* bus, GstMessage* msg, gpointer data);
 
     /**
+     * Registered with gst_app_sink_set_callbacks(), which calls them directly
+     * within the streaming thread without any signal marshalling.
      * Calls the method 'callbackNewBuffer()' of the passed CamGst object.
      */
-    static void callbackNewBufferStatic(GstElement* object, CamGst* cam_gst_p); 
+    static GstFlowReturn callbackNewBufferStatic(GstAppSink* sink, gpointer data); 
+
+    static void callbackEosStatic(GstAppSink* sink, gpointer data);
     
     /**
-     * Copies the received image to 'mBuffer'.
+     * Signals or resets the eventfd according to hasNewBuffer().
+     * mMutexBuffer has to be locked.
+     */
+    void updateEventFd();
+
+    /**
+     * Removes the oldest image of the queue, the reference is passed to the caller.
+     * mMutexBuffer has to be locked.
+     */
+    GstBuffer* popBuffer();
+
+    /**
+     * Releases all queued images. mMutexBuffer has to be locked.
+     */
+    void clearQueue();
+
+    /**
+     * Wakes up a streaming thread which waits for space within the queue (QUEUE_BLOCK), 
+     * has to be called before the pipeline is stopped or flushed. New images are dropped
+     * until the pipeline is started again (or the flush is finished).
+     */
+    void releaseQueue();
+
+    /**
+     * Wakes up waitForStateChange() to check the state of the pipeline.
+     */
+    void notifyStartEvent();
+
+    /**
+     * Waits until the asynchronous state change of the pipeline has been finished,
+     * without polling. Returns GST_STATE_CHANGE_ASYNC on timeout.
+     */
+    GstStateChangeReturn waitForStateChange(int32_t timeout_ms);
+
+    /**
+     * Absolute CLOCK_REALTIME 'timeout_ms' from now, for pthread_cond_timedwait().
+     */
+    static struct timespec getDeadline(int32_t timeout_ms);
+
+    /**
+     * Queues the received image and passes it to the new buffer callback.
      */
-    void callbackNewBuffer(GstElement* object, CamGst* cam_gst_p); 
+    void callbackNewBuffer(GstAppSink* sink); 
 
     /**
      * Print element factories for debugging purposes
@@ -223,21 +469,58 @@ class CamGst {
  private:
     std::string mDevice;
     uint32_t mJpegQuality;
-    GMainLoop* mLoop;
-    pthread_t* mMainLoopThread;
     GstElement* mPipeline;
     GstBus* mGstPipelineBus;
+    guint mBusWatchId; // 0 if no watch has been added.
     bool mPipelineRunning;
+    bool mPipelineError; // Protected by mMutexBuffer, set within the main loop thread.
 
     pthread_mutex_t mMutexBuffer;
-    GstBuffer* mBuffer;
-    uint32_t mBufferSize;
-    bool mNewBuffer;
+    pthread_cond_t mCondQueueSpace; // Signalled if an image has been removed from the queue.
+    pthread_cond_t mCondStartEvent; // State changes, errors and the first image, see mStartEvents.
+    // Ring of references to the received images, mQueueFirst is the oldest.
+    std::vector<GstBuffer*> mQueue;
+    uint32_t mQueueFirst;
+    uint32_t mQueueCount;
+    enum QUEUE_POLICY mQueuePolicy;
+    bool mQueueReleased; // See releaseQueue().
+    uint32_t mOverflowCount;
+    bool (*mpNewBufferCallbackFunction)(uint8_t const* data, uint32_t size, void* p);
+    void* mpNewBufferPassThroughPointer;
+    base::Time mLastBufferTime;
+    base::Time mStartTime; // Of the last startPipeline().
+    base::Time mFirstBufferTime; // Null until the first image after mStartTime.
+    uint32_t mStartEvents; // Counts notifyStartEvent() and the first image.
+    int mEventFd;
+    bool mEventFdSignalled;
 
     GstElement* mSource; // Used to request the fd.
+    GstElement* mSink; // Owned by the pipeline.
+    uint32_t mSinkMaxBuffers;
+    bool mSinkDrop;
+    GstElement* mSourceQueue; // Owned by the pipeline, NULL if not used.
+    uint32_t mSourceQueueMaxBuffers; // See setSourceQueue().
+    enum QUEUE_LEAK mSourceQueueLeak;
     int mFileDescriptor; // File descriptor of the pipeline source. -1 if not available.
     
     base::samples::frame::frame_mode_t mRequestedFrameMode;
+    uint32_t mRequestedWidth; // 0 if the current setting of the camera is used.
+    uint32_t mRequestedHeight;
+
+    // Parameters passed to the last createDefaultPipeline(), see isDefaultPipeline().
+    struct DefaultPipelineParams {
+        bool valid;
+        uint32_t width;
+        uint32_t height;
+        uint32_t fps;
+        uint32_t bpp;
+        base::samples::frame::frame_mode_t mode;
+        uint32_t jpeg_quality;
+    } mDefaultParams;
+    // Passed to the last createPipeline(), see isPipeline().
+    std::string mPipelineDescription;
+    std::string mPipelineSinkName;
+    bool mInsertJpegHuffmanTables;
 
     /**
      * Using GstGuard to making sure that GStreamer is initialized/deinitialized only once, i.e. use
@@ -249,6 +532,23 @@ class CamGst {
         ~InitGuard();
     };
 
+    /**
+     * The bus messages of all instances are dispatched by a single GMainLoop thread.
+     * It is started with the first instance and stopped at process exit, so creating
+     * and deleting instances (e.g. on close() or a device recovery) costs no thread.
+     * Used like InitGuard, constructed after it and thus destroyed before gst_deinit().
+     */
+    class MainLoopGuard {
+    public:
+        MainLoopGuard();
+        ~MainLoopGuard();
+    private:
+        GMainLoop* mMainLoop;
+        pthread_t mThread;
+    };
+
+    static pthread_mutex_t sMutexDispatch; // Held while a bus message is dispatched.
+
 };
 
 } // end namespace camera
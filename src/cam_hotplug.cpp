@@ -0,0 +1,281 @@
+#include "cam_hotplug.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <base-logging/Logging.hpp>
+
+namespace camera
+{
+
+CamHotplug::CamHotplug(std::string const& device, std::string const& bus_info) :
+        mDevice(device),
+        mBusInfo(bus_info),
+        mInotifyFd(-1),
+        mWatchDescriptor(-1),
+        mRunning(false),
+        mMonitorThread(NULL),
+        mPresent(true),
+        mRemovalCount(0)
+{
+    LOG_DEBUG("CamHotplug: constructor, device %s, bus info %s", device.c_str(), bus_info.c_str());
+    pthread_mutex_init(&mMutexState, NULL);
+    pthread_cond_init(&mCondPresent, NULL);
+}
+
+CamHotplug::~CamHotplug() {
+    LOG_DEBUG("CamHotplug: destructor");
+    stop();
+    pthread_cond_destroy(&mCondPresent);
+    pthread_mutex_destroy(&mMutexState);
+}
+
+bool CamHotplug::start() {
+    LOG_DEBUG("CamHotplug: start");
+    if(mRunning) {
+        LOG_INFO("Hotplug monitor already running");
+        return true;
+    }
+
+    mInotifyFd = inotify_init();
+    if(mInotifyFd == -1) {
+        LOG_ERROR("inotify could not be initialized: %s", strerror(errno));
+        return false;
+    }
+    mWatchDescriptor = inotify_add_watch(mInotifyFd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if(mWatchDescriptor == -1) {
+        LOG_ERROR("/dev could not be watched: %s", strerror(errno));
+        ::close(mInotifyFd);
+        mInotifyFd = -1;
+        return false;
+    }
+
+    pthread_mutex_lock(&mMutexState);
+    mRunning = true;
+    pthread_mutex_unlock(&mMutexState);
+    mMonitorThread = new pthread_t();
+    pthread_create(mMonitorThread, NULL, monitorLoop, (void*)this);
+    return true;
+}
+
+void CamHotplug::stop() {
+    LOG_DEBUG("CamHotplug: stop");
+    if(!mRunning) {
+        return;
+    }
+    // The thread checks the flag at least every POLL_TIMEOUT_MS.
+    pthread_mutex_lock(&mMutexState);
+    mRunning = false;
+    pthread_mutex_unlock(&mMutexState);
+    pthread_join(*mMonitorThread, NULL);
+    delete mMonitorThread;
+    mMonitorThread = NULL;
+
+    inotify_rm_watch(mInotifyFd, mWatchDescriptor);
+    ::close(mInotifyFd);
+    mInotifyFd = -1;
+    mWatchDescriptor = -1;
+}
+
+bool CamHotplug::isDevicePresent(std::string* device) {
+    pthread_mutex_lock(&mMutexState);
+    bool present = mPresent;
+    if(present && device != NULL) {
+        *device = mDevice;
+    }
+    pthread_mutex_unlock(&mMutexState);
+    return present;
+}
+
+bool CamHotplug::waitForDevice(int32_t timeout_ms, std::string* device) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mMutexState);
+    while(!mPresent) {
+        if(pthread_cond_timedwait(&mCondPresent, &mMutexState, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool present = mPresent;
+    if(present && device != NULL) {
+        *device = mDevice;
+    }
+    pthread_mutex_unlock(&mMutexState);
+    return present;
+}
+
+uint32_t CamHotplug::getRemovalCount() {
+    pthread_mutex_lock(&mMutexState);
+    uint32_t count = mRemovalCount;
+    pthread_mutex_unlock(&mMutexState);
+    return count;
+}
+
+bool CamHotplug::readBusInfo(std::string const& device, std::string* bus_info) {
+    int fd = ::open(device.c_str(), O_NONBLOCK | O_RDWR);
+    if(fd == -1) {
+        LOG_DEBUG("%s could not be opened: %s", device.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct v4l2_capability capability;
+    memset(&capability, 0, sizeof(struct v4l2_capability));
+    int ret = 0;
+    do {
+        ret = ioctl(fd, VIDIOC_QUERYCAP, &capability);
+    } while(ret == -1 && errno == EINTR);
+    ::close(fd);
+
+    if(ret == -1) {
+        LOG_DEBUG("VIDIOC_QUERYCAP failed on %s: %s", device.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Ignore e.g. the metadata node of a UVC camera, it uses the same bus_info.
+    uint32_t caps = capability.capabilities;
+#ifdef V4L2_CAP_DEVICE_CAPS
+    if(caps & V4L2_CAP_DEVICE_CAPS) {
+        caps = capability.device_caps;
+    }
+#endif
+    if(!(caps & V4L2_CAP_VIDEO_CAPTURE)) {
+        return false;
+    }
+
+    char buffer[33];
+    snprintf(buffer, 33, "%s", capability.bus_info);
+    *bus_info = buffer;
+    return true;
+}
+
+// PRIVATE
+CamHotplug::CamHotplug() {}
+
+bool CamHotplug::findDevice(std::string* device) {
+    DIR* dir = opendir("/dev");
+    if(dir == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    struct dirent* entry = NULL;
+    while(!found && (entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "video", 5) != 0) {
+            continue;
+        }
+        std::string node = std::string("/dev/") + entry->d_name;
+        std::string bus_info;
+        if(readBusInfo(node, &bus_info) && bus_info == mBusInfo) {
+            *device = node;
+            found = true;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+void CamHotplug::handleEvent(uint32_t mask, std::string const& name) {
+    if(name.compare(0, 5, "video") != 0) {
+        return;
+    }
+    std::string node = "/dev/" + name;
+
+    if(mask & IN_DELETE) {
+        pthread_mutex_lock(&mMutexState);
+        bool own_device = mPresent && node == mDevice;
+        pthread_mutex_unlock(&mMutexState);
+        if(own_device) {
+            LOG_WARN("Camera %s (%s) has been removed", node.c_str(), mBusInfo.c_str());
+            setRemoved();
+        }
+        return;
+    }
+
+    // IN_CREATE or IN_ATTRIB: udev may change the permissions after creating
+    // the node, so the node could be unreadable on IN_CREATE.
+    if(isDevicePresent()) {
+        return;
+    }
+    std::string bus_info;
+    if(readBusInfo(node, &bus_info) && bus_info == mBusInfo) {
+        LOG_INFO("Camera %s has been reconnected as %s", mBusInfo.c_str(), node.c_str());
+        setPresent(node);
+    }
+}
+
+void CamHotplug::setPresent(std::string const& device) {
+    pthread_mutex_lock(&mMutexState);
+    mDevice = device;
+    mPresent = true;
+    pthread_cond_broadcast(&mCondPresent);
+    pthread_mutex_unlock(&mMutexState);
+}
+
+void CamHotplug::setRemoved() {
+    pthread_mutex_lock(&mMutexState);
+    mPresent = false;
+    mRemovalCount++;
+    pthread_mutex_unlock(&mMutexState);
+}
+
+bool CamHotplug::isRunning() {
+    pthread_mutex_lock(&mMutexState);
+    bool running = mRunning;
+    pthread_mutex_unlock(&mMutexState);
+    return running;
+}
+
+// PRIVATE STATIC
+void* CamHotplug::monitorLoop(void* ptr) {
+    LOG_INFO("Start hotplug monitor");
+    CamHotplug* hotplug = (CamHotplug*)ptr;
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    pfd.fd = hotplug->mInotifyFd;
+    pfd.events = POLLIN;
+
+    while(hotplug->isRunning()) {
+        int ret = poll(&pfd, 1, POLL_TIMEOUT_MS);
+        if(ret == -1 && errno != EINTR) {
+            LOG_ERROR("Hotplug monitor: poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if(ret > 0 && (pfd.revents & POLLIN)) {
+            ssize_t len = read(hotplug->mInotifyFd, buffer, sizeof(buffer));
+            for(char* p = buffer; len > 0 && p < buffer + len; ) {
+                struct inotify_event* event = (struct inotify_event*)p;
+                if(event->len > 0) {
+                    hotplug->handleEvent(event->mask, event->name);
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        } else if(ret == 0 && !hotplug->isDevicePresent()) {
+            // Fallback for missed events (e.g. the inotify queue overflowed).
+            std::string device;
+            if(hotplug->findDevice(&device)) {
+                LOG_INFO("Camera %s found as %s", hotplug->mBusInfo.c_str(), device.c_str());
+                hotplug->setPresent(device);
+            }
+        }
+    }
+    LOG_INFO("Stop hotplug monitor");
+    return NULL;
+}
+
+} // end namespace camera
@@ -0,0 +1,147 @@
+/*
+ * \file    cam_hotplug.h
+ *
+ * \brief   Detects removal and re-arrival of a USB camera.
+ *
+ * \details Uses inotify on /dev, the physical camera is identified by
+ *          its v4l2 bus_info (the USB port), so a re-enumerated camera
+ *          is found again even if it gets another device node.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _CAM_HOTPLUG_H_
+#define _CAM_HOTPLUG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <base/Time.hpp>
+
+namespace camera
+{
+
+enum HotplugEventType {
+    HOTPLUG_DEVICE_REMOVED,   // Device vanished or the stream reported an error.
+    HOTPLUG_DEVICE_RECOVERED, // Device has been reopened and the stream resumed.
+    HOTPLUG_RECOVERY_FAILED   // Device did not come back within the maximal outage.
+};
+
+static const std::string HotplugEventTxt[] = { "HOTPLUG_DEVICE_REMOVED",
+        "HOTPLUG_DEVICE_RECOVERED", "HOTPLUG_RECOVERY_FAILED" };
+
+/**
+ * Passed to the hotplug callback of CamUsb.
+ */
+struct HotplugEvent {
+    HotplugEvent() : type(HOTPLUG_DEVICE_REMOVED), device(), bus_info(), outage() {}
+
+    HotplugEventType type;
+    std::string device; // Device node, e.g. /dev/video0.
+    std::string bus_info;
+    base::Time outage; // Time since the removal, zero for HOTPLUG_DEVICE_REMOVED.
+};
+
+/**
+ * Watches /dev using inotify in its own thread. The camera is identified
+ * by its bus_info, only video capture nodes are taken into account
+ * (UVC cameras may create an additional metadata node with the same bus_info).
+ * The monitor only observes, reopening the device is up to the caller.
+ */
+class CamHotplug {
+
+ public: // CONSTANTS
+    static const int32_t POLL_TIMEOUT_MS = 200;
+
+ public:
+    /**
+     * \param device Current device node of the camera.
+     * \param bus_info The bus_info of the camera (see CamConfig::getCapabilityBusInfo()).
+     */
+    CamHotplug(std::string const& device, std::string const& bus_info);
+
+    /**
+     * Stops the monitor thread.
+     */
+    ~CamHotplug();
+
+    /**
+     * Starts the monitor thread.
+     * \return false if inotify could not be initialized.
+     */
+    bool start();
+
+    void stop();
+
+    /**
+     * \param device Receives the current device node if the camera is present.
+     */
+    bool isDevicePresent(std::string* device = NULL);
+
+    /**
+     * Blocks until the camera is present again or 'timeout_ms' passed.
+     * \return true if the camera is present.
+     */
+    bool waitForDevice(int32_t timeout_ms, std::string* device = NULL);
+
+    /**
+     * Number of removals seen since start(). Allows to detect a reset
+     * which happened between two checks.
+     */
+    uint32_t getRemovalCount();
+
+    inline std::string getBusInfo() const {
+        return mBusInfo;
+    }
+
+    /**
+     * Opens 'device' and requests its bus_info.
+     * \return false if 'device' is not a video capture device or could not be queried.
+     */
+    static bool readBusInfo(std::string const& device, std::string* bus_info);
+
+ private:
+    CamHotplug();
+
+    /**
+     * Searches all /dev/video* nodes for the camera.
+     * \return true if the camera has been found, 'device' receives the node.
+     */
+    bool findDevice(std::string* device);
+
+    /**
+     * Handles a created, changed or deleted entry in /dev.
+     */
+    void handleEvent(uint32_t mask, std::string const& name);
+
+    void setPresent(std::string const& device);
+
+    void setRemoved();
+
+    bool isRunning();
+
+ private: // STATIC METHODS
+    static void* monitorLoop(void* ptr);
+
+ private:
+    std::string mDevice;
+    std::string mBusInfo;
+    int mInotifyFd;
+    int mWatchDescriptor;
+    bool mRunning; // Protected by mMutexState, written by start() and stop() only.
+    pthread_t* mMonitorThread;
+
+    pthread_mutex_t mMutexState;
+    pthread_cond_t mCondPresent;
+    bool mPresent;
+    uint32_t mRemovalCount;
+};
+
+} // end namespace camera
+
+#endif
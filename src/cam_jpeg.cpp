@@ -0,0 +1,351 @@
+#include "cam_jpeg.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base-logging/Logging.hpp>
+
+#include "helpers.h"
+
+namespace camera
+{
+
+struct jpeg_error_mgr* JpegErrorManager::init() {
+    jpeg_std_error(&pub);
+    pub.error_exit = errorExit;
+    pub.output_message = outputMessage;
+    return &pub;
+}
+
+void JpegErrorManager::errorExit(j_common_ptr cinfo) {
+    JpegErrorManager* error = (JpegErrorManager*)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, error->message);
+    longjmp(error->jump_buffer, 1);
+}
+
+void JpegErrorManager::outputMessage(j_common_ptr cinfo) {
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    LOG_DEBUG("libjpeg: %s", message);
+}
+
+JpegDecoder::JpegDecoder() : mDecompress(), mError(), mScaleDenominator(1) {
+    LOG_DEBUG("JpegDecoder: constructor");
+    mDecompress.err = mError.init();
+    jpeg_create_decompress(&mDecompress);
+}
+
+JpegDecoder::~JpegDecoder() {
+    LOG_DEBUG("JpegDecoder: destructor");
+    jpeg_destroy_decompress(&mDecompress);
+}
+
+bool JpegDecoder::setScale(uint32_t denominator) {
+    if(denominator != 1 && denominator != 2 && denominator != 4 && denominator != 8) {
+        LOG_ERROR("JPEG scale 1/%d is not supported, use 1, 2, 4 or 8", denominator);
+        return false;
+    }
+    mScaleDenominator = denominator;
+    return true;
+}
+
+bool JpegDecoder::isSupportedMode(base::samples::frame::frame_mode_t mode) {
+    using namespace base::samples::frame;
+    switch(mode) {
+        case MODE_RGB:
+        case MODE_GRAYSCALE:
+            return true;
+#ifdef JCS_EXTENSIONS
+        case MODE_BGR:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool JpegDecoder::decode(uint8_t const* data, size_t size, base::samples::frame::frame_mode_t mode,
+        base::samples::frame::Frame& frame) {
+    using namespace base::samples::frame;
+
+    if(!isSupportedMode(mode)) {
+        LOG_ERROR("JPEG images can not be decoded to frame mode %d", mode);
+        return false;
+    }
+
+    if(setjmp(mError.jump_buffer)) {
+        LOG_WARN("JPEG image could not be decoded: %s", mError.message);
+        jpeg_abort_decompress(&mDecompress);
+        return false;
+    }
+
+    jpeg_mem_src(&mDecompress, (unsigned char*)data, size);
+    jpeg_read_header(&mDecompress, TRUE);
+
+    switch(mode) {
+        case MODE_GRAYSCALE: mDecompress.out_color_space = JCS_GRAYSCALE; break;
+#ifdef JCS_EXTENSIONS
+        case MODE_BGR: mDecompress.out_color_space = JCS_EXT_BGR; break;
+#endif
+        default: mDecompress.out_color_space = JCS_RGB; break;
+    }
+    mDecompress.scale_num = 1;
+    mDecompress.scale_denom = mScaleDenominator;
+
+    jpeg_start_decompress(&mDecompress);
+
+    // Only reallocates if required.
+    frame.init(mDecompress.output_width, mDecompress.output_height, 8, mode, -1);
+
+    size_t row_size = mDecompress.output_width * mDecompress.output_components;
+    JSAMPROW rows[4];
+    while(mDecompress.output_scanline < mDecompress.output_height) {
+        // libjpeg may return more than one row per call (rec_outbuf_height).
+        JDIMENSION count = mDecompress.output_height - mDecompress.output_scanline;
+        if(count > 4) {
+            count = 4;
+        }
+        for(JDIMENSION i = 0; i < count; ++i) {
+            rows[i] = &frame.image[(mDecompress.output_scanline + i) * row_size];
+        }
+        jpeg_read_scanlines(&mDecompress, rows, count);
+    }
+
+    jpeg_finish_decompress(&mDecompress);
+    return true;
+}
+
+JpegEncoder::JpegEncoder() : mCompress(), mError(), mDestination(), 
+        mQuality(DEFAULT_QUALITY), mPlanes() {
+    LOG_DEBUG("JpegEncoder: constructor");
+    mCompress.err = mError.init();
+    jpeg_create_compress(&mCompress);
+
+    mDestination.pub.init_destination = initDestination;
+    mDestination.pub.empty_output_buffer = emptyOutputBuffer;
+    mDestination.pub.term_destination = termDestination;
+    mDestination.buffer = NULL;
+    mCompress.dest = &mDestination.pub;
+}
+
+JpegEncoder::~JpegEncoder() {
+    LOG_DEBUG("JpegEncoder: destructor");
+    jpeg_destroy_compress(&mCompress);
+}
+
+void JpegEncoder::setQuality(uint32_t quality) {
+    if(quality > 100) {
+        LOG_WARN("JPEG quality %d exceeds 100, 100 is used", quality);
+        quality = 100;
+    }
+    mQuality = quality;
+}
+
+bool JpegEncoder::isSupportedPixelformat(uint32_t pixelformat) {
+    switch(pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_GREY:
+            return true;
+#ifdef JCS_EXTENSIONS
+        case V4L2_PIX_FMT_BGR24:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool JpegEncoder::encode(uint8_t const* data, size_t size, uint32_t width, uint32_t height, 
+        uint32_t pixelformat, std::vector<uint8_t>& jpeg) {
+    if(!isSupportedPixelformat(pixelformat)) {
+        LOG_ERROR("Pixelformat %c%c%c%c can not be encoded to JPEG", pixelformat & 0xFF, 
+                (pixelformat >> 8) & 0xFF, (pixelformat >> 16) & 0xFF, (pixelformat >> 24) & 0xFF);
+        return false;
+    }
+
+    bool yuv422 = pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_UYVY;
+    int components = 3;
+    if(yuv422) {
+        components = 2;
+    } else if(pixelformat == V4L2_PIX_FMT_GREY) {
+        components = 1;
+    }
+    if(width == 0 || height == 0 || (yuv422 && width % 2 != 0)) {
+        LOG_ERROR("Image size %dx%d can not be encoded to JPEG", width, height);
+        return false;
+    }
+    if(size < (size_t)width * height * components) {
+        LOG_ERROR("Image data of %d bytes is too small for %dx%d", (int)size, width, height);
+        return false;
+    }
+
+    if(setjmp(mError.jump_buffer)) {
+        LOG_WARN("Image could not be encoded to JPEG: %s", mError.message);
+        jpeg_abort_compress(&mCompress);
+        mDestination.buffer = NULL;
+        return false;
+    }
+
+    mDestination.buffer = &jpeg;
+    mCompress.image_width = width;
+    mCompress.image_height = height;
+    mCompress.input_components = yuv422 ? 3 : components;
+    switch(pixelformat) {
+        case V4L2_PIX_FMT_GREY: mCompress.in_color_space = JCS_GRAYSCALE; break;
+#ifdef JCS_EXTENSIONS
+        case V4L2_PIX_FMT_BGR24: mCompress.in_color_space = JCS_EXT_BGR; break;
+#endif
+        case V4L2_PIX_FMT_RGB24: mCompress.in_color_space = JCS_RGB; break;
+        default: mCompress.in_color_space = JCS_YCbCr; break;
+    }
+    // Resets all parameters, so the compressor state does not depend on the previous image.
+    jpeg_set_defaults(&mCompress);
+    jpeg_set_quality(&mCompress, mQuality, TRUE);
+
+    if(yuv422) {
+        // Same subsampling as the camera: Y full, Cb and Cr half horizontal resolution.
+        mCompress.raw_data_in = TRUE;
+        mCompress.comp_info[0].h_samp_factor = 2;
+        mCompress.comp_info[0].v_samp_factor = 1;
+        for(int c = 1; c < 3; ++c) {
+            mCompress.comp_info[c].h_samp_factor = 1;
+            mCompress.comp_info[c].v_samp_factor = 1;
+        }
+    }
+
+    jpeg_start_compress(&mCompress, TRUE);
+
+    if(yuv422) {
+        writeRawData(data, width, height, pixelformat == V4L2_PIX_FMT_UYVY);
+    } else {
+        size_t row_size = width * components;
+        JSAMPROW row[1];
+        while(mCompress.next_scanline < mCompress.image_height) {
+            row[0] = (JSAMPROW)(data + mCompress.next_scanline * row_size);
+            jpeg_write_scanlines(&mCompress, row, 1);
+        }
+    }
+
+    jpeg_finish_compress(&mCompress);
+    mDestination.buffer = NULL;
+    return true;
+}
+
+bool JpegEncoder::encode(base::samples::frame::Frame const& frame, 
+        base::samples::frame::Frame& jpeg_frame) {
+    using namespace base::samples::frame;
+
+    uint32_t pixelformat = 0;
+    switch(frame.getFrameMode()) {
+        case MODE_UYVY: pixelformat = V4L2_PIX_FMT_UYVY; break;
+        case MODE_RGB: pixelformat = V4L2_PIX_FMT_RGB24; break;
+        case MODE_BGR: pixelformat = V4L2_PIX_FMT_BGR24; break;
+        case MODE_GRAYSCALE: pixelformat = V4L2_PIX_FMT_GREY; break;
+        default:
+            LOG_ERROR("Frame mode %d can not be encoded to JPEG", frame.getFrameMode());
+            return false;
+    }
+    // Frame::getChannelCount() returns 1 for UYVY, so its single channel has 16 bits.
+    uint32_t depth = frame.getFrameMode() == MODE_UYVY ? 16 : 8;
+    if(frame.getDataDepth() != depth) {
+        LOG_ERROR("Frame mode %d with data depth %d can not be encoded to JPEG, %d expected", 
+                frame.getFrameMode(), frame.getDataDepth(), depth);
+        return false;
+    }
+    if(frame.image.empty() || !encode(&frame.image[0], frame.image.size(), frame.getWidth(), 
+            frame.getHeight(), pixelformat, jpeg_frame.image)) {
+        return false;
+    }
+    Helpers::setFrameFormat(jpeg_frame, frame.getWidth(), frame.getHeight(), 8, MODE_JPEG);
+    jpeg_frame.attributes.clear();
+    jpeg_frame.time = frame.time;
+    jpeg_frame.received_time = frame.received_time;
+    jpeg_frame.frame_status = STATUS_VALID;
+    return true;
+}
+
+// PRIVATE
+void JpegEncoder::writeRawData(uint8_t const* data, uint32_t width, uint32_t height, bool uyvy) {
+    // libjpeg reads whole blocks, so the rows are padded to the MCU width (16 pixels).
+    size_t y_width = (width + 15) / 16 * 16;
+    size_t c_width = y_width / 2;
+    size_t plane_widths[3] = {y_width, c_width, c_width};
+    for(int p = 0; p < 3; ++p) {
+        if(mPlanes[p].size() < plane_widths[p] * DCTSIZE) {
+            mPlanes[p].resize(plane_widths[p] * DCTSIZE);
+        }
+    }
+
+    // Byte offsets of Y0, Cb, Y1 and Cr within a macropixel.
+    int y0 = uyvy ? 1 : 0;
+    int cb = uyvy ? 0 : 1;
+    int y1 = uyvy ? 3 : 2;
+    int cr = uyvy ? 2 : 3;
+
+    size_t row_size = width * 2;
+    JSAMPROW y_rows[DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = {y_rows, cb_rows, cr_rows};
+
+    while(mCompress.next_scanline < mCompress.image_height) {
+        uint32_t first = mCompress.next_scanline;
+        uint32_t count = std::min<uint32_t>(DCTSIZE, height - first);
+        for(uint32_t r = 0; r < DCTSIZE; ++r) {
+            if(r >= count) {
+                // Below the image: repeat the last row.
+                y_rows[r] = y_rows[count - 1];
+                cb_rows[r] = cb_rows[count - 1];
+                cr_rows[r] = cr_rows[count - 1];
+                continue;
+            }
+            uint8_t const* src = data + (first + r) * row_size;
+            uint8_t* y = &mPlanes[0][r * y_width];
+            uint8_t* u = &mPlanes[1][r * c_width];
+            uint8_t* v = &mPlanes[2][r * c_width];
+            for(uint32_t x = 0; x < width / 2; ++x, src += 4) {
+                y[2 * x] = src[y0];
+                y[2 * x + 1] = src[y1];
+                u[x] = src[cb];
+                v[x] = src[cr];
+            }
+            // Right of the image: repeat the last column.
+            memset(y + width, y[width - 1], y_width - width);
+            memset(u + width / 2, u[width / 2 - 1], c_width - width / 2);
+            memset(v + width / 2, v[width / 2 - 1], c_width - width / 2);
+            y_rows[r] = y;
+            cb_rows[r] = u;
+            cr_rows[r] = v;
+        }
+        jpeg_write_raw_data(&mCompress, planes, DCTSIZE);
+    }
+}
+
+// PRIVATE STATIC
+void JpegEncoder::initDestination(j_compress_ptr cinfo) {
+    VectorDestination* dest = (VectorDestination*)cinfo->dest;
+    std::vector<uint8_t>& buffer = *dest->buffer;
+    // The whole capacity is used, so images of similar size need no reallocation.
+    buffer.resize(std::max<size_t>(buffer.capacity(), 64 * 1024));
+    dest->pub.next_output_byte = &buffer[0];
+    dest->pub.free_in_buffer = buffer.size();
+}
+
+boolean JpegEncoder::emptyOutputBuffer(j_compress_ptr cinfo) {
+    VectorDestination* dest = (VectorDestination*)cinfo->dest;
+    std::vector<uint8_t>& buffer = *dest->buffer;
+    // Called if the buffer is full, free_in_buffer is not valid.
+    size_t used = buffer.size();
+    buffer.resize(used * 2);
+    dest->pub.next_output_byte = &buffer[used];
+    dest->pub.free_in_buffer = buffer.size() - used;
+    return TRUE;
+}
+
+void JpegEncoder::termDestination(j_compress_ptr cinfo) {
+    VectorDestination* dest = (VectorDestination*)cinfo->dest;
+    dest->buffer->resize(dest->buffer->size() - dest->pub.free_in_buffer);
+}
+
+} // end namespace camera
@@ -0,0 +1,181 @@
+/*
+ * \file    cam_jpeg.h
+ *
+ * \brief   Decodes and encodes the images of the camera using libjpeg(-turbo).
+ *
+ * \details High resolutions at full frame rate are usually only available
+ *          as MJPEG over USB 2.0. The decoder allows to request MJPEG from the
+ *          camera and to deliver RGB or grayscale frames nonetheless.
+ *          The encoder compresses raw images of cameras without MJPEG support.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _CAM_JPEG_H_
+#define _CAM_JPEG_H_
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h> // Required by jpeglib.h.
+
+#include <linux/videodev2.h>
+
+#include <jpeglib.h>
+
+#include <vector>
+
+#include <base/samples/Frame.hpp>
+
+namespace camera
+{
+
+/**
+ * libjpeg calls error_exit() on fatal errors and expects it not to return.
+ * It jumps back into JpegDecoder::decode() / JpegEncoder::encode() instead of exiting.
+ */
+struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump_buffer;
+    char message[JMSG_LENGTH_MAX];
+
+    /**
+     * Sets the handlers of 'pub' and returns it.
+     */
+    struct jpeg_error_mgr* init();
+
+    static void errorExit(j_common_ptr cinfo);
+
+    /**
+     * Warnings (e.g. corrupt data) are only logged as debug messages.
+     */
+    static void outputMessage(j_common_ptr cinfo);
+};
+
+/**
+ * Keeps one libjpeg decompressor which is reused for all images,
+ * so the decoder state is not allocated for each frame.
+ * Not thread safe, use one decoder per thread.
+ */
+class JpegDecoder {
+
+ public:
+    JpegDecoder();
+
+    ~JpegDecoder();
+
+    /**
+     * Scaling is done within the DCT, so a scaled image is decoded
+     * much faster than a full one.
+     * \param denominator 1, 2, 4 or 8, the image is scaled to 1/denominator.
+     * \return false if the denominator is not supported.
+     */
+    bool setScale(uint32_t denominator);
+
+    inline uint32_t getScale() const {
+        return mScaleDenominator;
+    }
+
+    /**
+     * Returns whether 'mode' can be decoded to. Supported are MODE_RGB,
+     * MODE_GRAYSCALE and, if libjpeg-turbo is used, MODE_BGR.
+     */
+    static bool isSupportedMode(base::samples::frame::frame_mode_t mode);
+
+    /**
+     * Decodes the JPEG image directly into 'frame', which is initialized with
+     * the (scaled) image size and 'mode'. The image buffer of the frame keeps
+     * its capacity, so usually nothing is allocated.
+     * \return false if the image is corrupted or 'mode' is not supported.
+     */
+    bool decode(uint8_t const* data, size_t size, base::samples::frame::frame_mode_t mode,
+            base::samples::frame::Frame& frame);
+
+ private:
+    JpegDecoder(JpegDecoder const&);
+    JpegDecoder& operator=(JpegDecoder const&);
+
+    struct jpeg_decompress_struct mDecompress;
+    struct JpegErrorManager mError;
+    uint32_t mScaleDenominator;
+};
+
+/**
+ * Keeps one libjpeg compressor which is reused for all images.
+ * Packed YUV 4:2:2 images (YUYV, UYVY) are passed to libjpeg as raw
+ * YCbCr planes, so they are neither converted to RGB nor subsampled again.
+ * Not thread safe, use one encoder per thread.
+ */
+class JpegEncoder {
+
+ public:
+    static const uint32_t DEFAULT_QUALITY = 85; // 0 to 100
+
+    JpegEncoder();
+
+    ~JpegEncoder();
+
+    /**
+     * \param quality 0 to 100, used for all following images.
+     */
+    void setQuality(uint32_t quality);
+
+    inline uint32_t getQuality() const {
+        return mQuality;
+    }
+
+    /**
+     * Returns whether images with the v4l2 'pixelformat' can be encoded. Supported are
+     * V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_BGR24 
+     * (libjpeg-turbo only) and V4L2_PIX_FMT_GREY.
+     */
+    static bool isSupportedPixelformat(uint32_t pixelformat);
+
+    /**
+     * Encodes the image with the v4l2 'pixelformat' to 'jpeg'. 
+     * 'jpeg' keeps its capacity, so usually nothing is allocated.
+     * \return false if the format is not supported or 'size' does not match the image size.
+     */
+    bool encode(uint8_t const* data, size_t size, uint32_t width, uint32_t height, 
+            uint32_t pixelformat, std::vector<uint8_t>& jpeg);
+
+    /**
+     * Encodes a MODE_UYVY, MODE_RGB, MODE_BGR or MODE_GRAYSCALE frame to a MODE_JPEG frame.
+     * The data depth has to be 8, or 16 for MODE_UYVY (like the frames of CamUsb).
+     */
+    bool encode(base::samples::frame::Frame const& frame, base::samples::frame::Frame& jpeg_frame);
+
+ private:
+    /**
+     * Writes the compressed data to a std::vector which grows if required.
+     */
+    struct VectorDestination {
+        struct jpeg_destination_mgr pub;
+        std::vector<uint8_t>* buffer;
+    };
+
+    static void initDestination(j_compress_ptr cinfo);
+    static boolean emptyOutputBuffer(j_compress_ptr cinfo);
+    static void termDestination(j_compress_ptr cinfo);
+
+    /**
+     * Splits packed 4:2:2 rows into the Y, Cb and Cr planes and writes them as raw data.
+     */
+    void writeRawData(uint8_t const* data, uint32_t width, uint32_t height, bool uyvy);
+
+    JpegEncoder(JpegEncoder const&);
+    JpegEncoder& operator=(JpegEncoder const&);
+
+    struct jpeg_compress_struct mCompress;
+    struct JpegErrorManager mError;
+    struct VectorDestination mDestination;
+    uint32_t mQuality;
+    // DCTSIZE rows of each plane, reused for all images.
+    std::vector<uint8_t> mPlanes[3];
+};
+
+} // end namespace camera
+
+#endif
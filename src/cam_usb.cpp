@@ -1,20 +1,67 @@
 #include "cam_usb.h"
 
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
 namespace camera 
 {
 
-CamUsb::CamUsb(std::string const& device) : CamInterface(), mCamGst(NULL), mCamConfig(NULL),
+CamUsb::CamUsb(std::string const& device) : CamInterface(), mCamMode(CAM_USB_NONE),
+        mCamGst(NULL), mCamConfig(NULL),
         mDevice(), mIsOpen(false), mCamInfo(), mMapAttrsCtrlsInt(), mFps(10),
         mBpp(24), mStartTimeGrabbing(), mReceivedFrameCounter(0),
-        mpCallbackFunction(NULL), mpPassThroughPointer(NULL) {
+        mpCallbackFunction(NULL), mpPassThroughPointer(NULL),
+        mpFrameCallbackFunction(NULL), mpFramePassThroughPointer(NULL), 
+        mCallbackRunning(false), mCallbackThread(), mCallbackFrame(), mDecodedCallbackFrame(),
+        mDeliveringDecodedFrames(false),
+        mInsertJpegHuffmanTables(false), mJpegDecoding(false), mJpegDecodingActive(false),
+        mJpegDecoder(), mCaptureBuffer(), mCallbackJpegDecoder(), mCallbackJpegBuffer(),
+        mDecodePool(NULL), mRetiredDecodePools(), mDroppedFramesOffset(0), mJpegCheck(JPEG_CHECK_FLAG), 
+        mConvertPool(NULL),
+        mSinkMaxBuffers(CamGst::DEFAULT_SINK_MAX_BUFFERS), mSinkDrop(true),
+        mSourceQueueMaxBuffers(0), mSourceQueueLeak(CamGst::QUEUE_LEAK_DOWNSTREAM),
+        mQueuePolicy(CamGst::QUEUE_DROP_OLDEST), mOverflowedFramesOffset(0),
+        mGstPipelineDescription(), mGstPipelineSinkName("sink"),
+        mRoi(), 
+        mSensorCrop(false), mSensorCropRequested(), mSensorCropActive(), 
+        mOutputScale(1), mOutputScaleActive(1), mScaleConverter(NULL),
+        mJpegEncoding(false), mJpegEncodingActive(false), 
+        mJpegQuality(CamGst::DEFAULT_JPEG_QUALITY), mRawPixelformat(0), 
+        mJpegEncoder(), mCallbackJpegEncoder(),
+        mNotificationFd(-1), mWatchedFd(-1),
+        mHotplugEnabled(false), mHotplug(NULL), mMaxOutageMs(DEFAULT_MAX_OUTAGE_MS),
+        mRemovalCount(0), mDeviceLost(false), mRecoveryFailureReported(false),
+        mDeviceLostTime(), mBufferLen(1), mFpsWritten(false), mWrittenControls(),
+        mpHotplugCallbackFunction(NULL), mpHotplugPassThroughPointer(NULL),
+        mWatchdogEnabled(false), mStallIntervals(DEFAULT_STALL_INTERVALS),
+        mWatchdogStep(WATCHDOG_NONE), mLastFrameTime(), mFrameRequested(false), 
+        mStatistics() {
     LOG_DEBUG("CamUsb: constructor");
+    pthread_mutex_init(&mMutexCallback, NULL);
+    pthread_cond_init(&mCondCallback, NULL);
+    pthread_mutex_init(&mMutexRoi, NULL);
+    pthread_mutex_init(&mMutexStatistics, NULL);
     mDevice = device;
     changeCameraMode(CAM_USB_NONE);
 }
 
 CamUsb::~CamUsb() {
     LOG_DEBUG("CamUsb: destructor");
+    delete mHotplug;
+    mHotplug = NULL;
     changeCameraMode(CAM_USB_NONE);
+    setJpegDecodeThreads(0, false);
+    delete mConvertPool;
+    mConvertPool = NULL;
+    if(mNotificationFd != -1) {
+        ::close(mNotificationFd);
+        mNotificationFd = -1;
+    }
+    pthread_mutex_destroy(&mMutexStatistics);
+    pthread_mutex_destroy(&mMutexRoi);
+    pthread_cond_destroy(&mCondCallback);
+    pthread_mutex_destroy(&mMutexCallback);
 }
 
 void CamUsb::fastInit(int width, int height) {
@@ -64,6 +111,10 @@ bool CamUsb::open(const CamInfo &cam,const AccessMode mode) {
 
     mIsOpen = true;
 
+    if(mHotplugEnabled) {
+        startHotplugMonitor();
+    }
+
     // Will be started in grab().
     return true;
 }
@@ -87,6 +138,9 @@ bool CamUsb::close() {
 
     if(mIsOpen) {
         mIsOpen = false;
+        delete mHotplug;
+        mHotplug = NULL;
+        mDeviceLost = false;
         changeCameraMode(CAM_USB_NONE);
     } else {
         LOG_INFO("Camera already closed");
@@ -108,6 +162,7 @@ bool CamUsb::grab(const GrabMode mode, const int buffer_len) {
     }
 
     bool image_request_started = false;
+    mBufferLen = buffer_len;
     switch(mode) {
         case Stop:
             if(mCamMode == CAM_USB_V4L2) {
@@ -121,19 +176,22 @@ bool CamUsb::grab(const GrabMode mode, const int buffer_len) {
             changeCameraMode(CAM_USB_V4L2);
             mCamConfig->initRequesting();
             image_request_started = true;
+            act_grab_mode_ = mode;
             break;
         }
         case MultiFrame:
         case Continuously: {
             changeCameraMode(CAM_USB_GST);
-             // If one of the parameters is 0, the current setting of the camera is used.
-            mCamGst->createDefaultPipeline(true,
-                    image_size_.width, image_size_.height,
-                    (uint32_t)mFps, (uint32_t)mBpp,
-                    image_mode_);
-            
-            image_request_started = mCamGst->startPipeline();
+            if(mode == MultiFrame) {
+                mCamGst->setBufferQueue(buffer_len > 0 ? buffer_len : 1, mQueuePolicy);
+            } else {
+                mCamGst->setBufferQueue(1, CamGst::QUEUE_DROP_OLDEST);
+            }
+            image_request_started = startDefaultPipeline();
+            warnIfNotChecked();
+            pthread_mutex_lock(&mMutexStatistics);
             mReceivedFrameCounter = 0;
+            pthread_mutex_unlock(&mMutexStatistics);
             act_grab_mode_ = mode;
             break;
         }
@@ -144,63 +202,339 @@ bool CamUsb::grab(const GrabMode mode, const int buffer_len) {
     
     if(image_request_started) {
         gettimeofday(&mStartTimeGrabbing, 0);
+        // Startup may take longer than a few frame intervals.
+        mWatchdogStep = WATCHDOG_NONE;
+        mLastFrameTime = base::Time::now() + 
+                base::Time::fromMicroseconds(CamGst::DEFAULT_PIPELINE_TIMEOUT);
+        mFrameRequested = false;
     }
+    updateNotificationFd();
 
     return true;
 }                  
 
 bool CamUsb::retrieveFrame(base::samples::frame::Frame &frame,const int timeout) {
     LOG_DEBUG("CamUsb: retrieveFrame");
+
+    // The time spent for the recovery is subtracted from the timeout.
+    base::Time start = base::Time::now();
+    if(!checkHotplug(timeout)) {
+        LOG_INFO("Frame can not be retrieved, camera is not available");
+        return false;
+    }
+    
+    requestFrame();
+    checkStall();
     
     if(mCamMode == CAM_USB_NONE) {
         LOG_INFO("Frame can not be retrieved, current camera mode is %d", mCamMode);
         return false;
     }
-    
-    // Buffer will be resized in getBuffer.
-    std::vector<uint8_t> buffer_tmp;
-    
-    // Either v4l2 calls are used to retrieve single images or the gstreamer pipeline.
-    // The initialization/cleanup for both methods happens in the grab() function.
-    if(mCamMode == CAM_USB_V4L2) {
-        try {
-            mCamConfig->getBuffer(buffer_tmp, true, timeout);
-        } catch(std::runtime_error& e) {
-            LOG_ERROR("v4l2: Buffer could not be requested: %s", e.what());
+
+    // The image is copied directly into the frame. Its buffer is only resized
+    // in getBuffer() and keeps its capacity, so usually nothing is reallocated.
+    // Images which have to be decoded, encoded or scaled are copied to mCaptureBuffer instead.
+    std::vector<uint8_t>& buffer = (mJpegDecodingActive || mJpegEncodingActive || 
+            isGstScalingActive()) ? mCaptureBuffer : frame.image;
+    bool decode_pool = isDecodePoolActive();
+
+    // Read once per frame, the region may be changed at any time.
+    ImageRegion region;
+    if(!mJpegDecodingActive && !mJpegEncodingActive) {
+        region = getRegionOfInterest();
+    }
+
+    // With an active watchdog the waiting is split into slices of the stall time.
+    bool watchdog = mWatchdogEnabled && act_grab_mode_ != Stop;
+    int32_t stall_ms = getStallTimeMs();
+    int32_t remaining_ms = timeout;
+    if(timeout > 0) {
+        remaining_ms = timeout - (int32_t)(base::Time::now() - start).toMilliseconds();
+        // At least a short look for a frame, < 1 would wait without timeout.
+        if(remaining_ms < 1) {
+            remaining_ms = 1;
+        }
+    }
+    bool success = false, error = false;
+    // JPEG images are inspected while copying, so the header is only parsed once.
+    JpegHeaderInfo info;
+    while(true) {
+        int32_t wait_ms = remaining_ms;
+        if(watchdog && (remaining_ms < 1 || remaining_ms > stall_ms)) {
+            wait_ms = stall_ms;
+        }
+        if(decode_pool) {
+            success = readDecodedFrame(frame, wait_ms, &error);
+        } else {
+            success = readBuffer(buffer, wait_ms, &error, region.isEmpty() ? NULL : &region, 
+                    &info);
+        }
+        if(success || !watchdog) {
+            break;
+        }
+        checkStall();
+        if(error || mCamMode == CAM_USB_NONE) {
+            break;
+        }
+        if(timeout > 0) {
+            // Includes the time of the watchdog step.
+            remaining_ms = timeout - (int32_t)(base::Time::now() - start).toMilliseconds();
+            if(remaining_ms <= 0) {
+                break;
+            }
+        }
+    }
+    if(!success) {
+        return false;
+    }
+    mLastFrameTime = base::Time::now();
+    mFrameRequested = false;
+    mWatchdogStep = WATCHDOG_NONE;
+
+    if(decode_pool) {
+        // Decoded, status and capture time are set by the pool.
+    } else if(mJpegDecodingActive) {
+        if(mCaptureBuffer.empty()) {
             return false;
-        }   
-    } else if(mCamMode == CAM_USB_GST) {
-        if(!mCamGst->isPipelineRunning()) {
-            LOG_WARN("Frame can not be retrieved, because pipeline is not running.");
+        }
+        if(!checkJpeg(info) ||
+                !mJpegDecoder.decode(&mCaptureBuffer[0], mCaptureBuffer.size(), image_mode_, frame)) {
             return false;
         }
-        bool success = mCamGst->getBuffer(buffer_tmp, true, timeout);
-        if(!success) {
-            LOG_ERROR("Gstreamer: Buffer could not retrieved.");
+        frame.frame_status = base::samples::frame::STATUS_VALID;
+        frame.time = base::Time::now();
+        applyJpegHeader(info, frame);
+    } else if(mJpegEncodingActive) {
+        if(!encodeFrame(mJpegEncoder, mCaptureBuffer.empty() ? NULL : &mCaptureBuffer[0], 
+                mCaptureBuffer.size(), frame)) {
+            return false;
+        }
+        frame.frame_status = base::samples::frame::STATUS_VALID;
+        frame.time = base::Time::now();
+    } else if(isGstScalingActive()) {
+        if(!scaleFrame(mCaptureBuffer.empty() ? NULL : &mCaptureBuffer[0], 
+                mCaptureBuffer.size(), region, frame)) {
             return false;
         }
+        frame.frame_status = base::samples::frame::STATUS_VALID;
+        frame.time = base::Time::now();
+    } else {
+        // Already matches the image size, so only the meta data is set.
+        // JPEG comment blocks have been skipped while copying the image.
+        initFrame(frame, region);
+        frame.frame_status = base::samples::frame::STATUS_VALID;
+        frame.time = base::Time::now();
+        if(image_mode_ == base::samples::frame::MODE_JPEG && mJpegCheck != JPEG_CHECK_NONE) {
+            if(!checkJpeg(info)) {
+                return false;
+            }
+            applyJpegHeader(info, frame);
+        }
     }
-    
-    // TODO In Frame.hpp getChannelCount() returns 1 for UYVY, should be 2?
-    int depth = 8;
-    if(image_mode_ == base::samples::frame::MODE_UYVY) {
-        depth = 16;
+
+    countFrame();
+    return true;
+}
+
+void CamUsb::setInsertJpegHuffmanTables(bool insert) {
+    mInsertJpegHuffmanTables = insert;
+    updateJpegNormalization();
+}
+
+bool CamUsb::setJpegDecoding(bool enable, uint32_t scale_denominator) {
+    if(!mJpegDecoder.setScale(scale_denominator)) {
+        return false;
     }
+    mCallbackJpegDecoder.setScale(scale_denominator);
+    pthread_mutex_lock(&mMutexCallback);
+    if(mDecodePool != NULL) {
+        mDecodePool->setScale(scale_denominator);
+    }
+    pthread_mutex_unlock(&mMutexCallback);
+    mJpegDecoding = enable;
+    return true;
+}
 
-    // Only reallocates if required.
-    frame.init(image_size_.width, image_size_.height, depth, image_mode_, -1, buffer_tmp.size());
-    // Can we directly write to the frame buffer?
-    frame.image = buffer_tmp;
-    frame.frame_status = base::samples::frame::STATUS_VALID;
-    frame.time = base::Time::now();
-    
-    // Removes the JPEG comment block if required.
-    Helpers::removeJpegCommentBlock(frame);
+void CamUsb::setJpegEncoding(bool enable, uint32_t quality) {
+    mJpegEncoder.setQuality(quality);
+    pthread_mutex_lock(&mMutexCallback);
+    mCallbackJpegEncoder.setQuality(quality);
+    pthread_mutex_unlock(&mMutexCallback);
+    mJpegQuality = mJpegEncoder.getQuality();
+    mJpegEncoding = enable;
+}
 
-    mReceivedFrameCounter++;
+void CamUsb::setGstSinkQueue(uint32_t max_buffers, bool drop) {
+    mSinkMaxBuffers = max_buffers;
+    mSinkDrop = drop;
+    if(mCamGst != NULL) {
+        mCamGst->setSinkQueue(max_buffers, drop);
+    }
+}
+
+void CamUsb::setGstSourceQueue(uint32_t max_buffers, enum CamGst::QUEUE_LEAK leak) {
+    mSourceQueueMaxBuffers = max_buffers;
+    mSourceQueueLeak = leak;
+    if(mCamGst != NULL) {
+        mCamGst->setSourceQueue(max_buffers, leak);
+    }
+}
+
+void CamUsb::setConversionThreads(uint32_t thread_count) {
+    if(mCamConfig != NULL) {
+        mCamConfig->setConvertPool(NULL);
+    }
+    delete mConvertPool;
+    mConvertPool = NULL;
+    if(thread_count > 1) {
+        mConvertPool = new ConvertPool(thread_count);
+    }
+    if(mCamConfig != NULL) {
+        mCamConfig->setConvertPool(mConvertPool);
+    }
+}
+
+bool CamUsb::setOutputScale(uint32_t denominator) {
+    if(denominator != 1 && denominator != 2 && denominator != 4) {
+        LOG_ERROR("Output scale 1/%d is not supported, use 1, 2 or 4", denominator);
+        return false;
+    }
+    mOutputScale = denominator;
+    return true;
+}
+
+void CamUsb::setRegionOfInterest(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    pthread_mutex_lock(&mMutexRoi);
+    mRoi = ImageRegion(x, y, width, height);
+    pthread_mutex_unlock(&mMutexRoi);
+}
+
+ImageRegion CamUsb::getRegionOfInterest() {
+    pthread_mutex_lock(&mMutexRoi);
+    ImageRegion region = mRoi;
+    pthread_mutex_unlock(&mMutexRoi);
+    return region;
+}
+
+bool CamUsb::setSensorCrop(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    if(mCamMode != CAM_USB_V4L2) {
+        LOG_INFO("Stop the device before cropping the sensor.");
+        return false;
+    }
+    mSensorCropRequested = ImageRegion(x, y, width, height);
+    mSensorCrop = !mSensorCropRequested.isEmpty();
+    try {
+        if(!writeSensorCrop()) {
+            mSensorCrop = false;
+            return false;
+        }
+    } catch(std::runtime_error& e) {
+        LOG_ERROR("Sensor crop could not be set: %s", e.what());
+        // Otherwise retried by setFrameSettings() and the recovery.
+        mSensorCrop = false;
+        return false;
+    }
+
+    // The driver may have changed the image size as well.
+    uint32_t image_width = 0, image_height = 0;
+    mCamConfig->getImageWidth(&image_width);
+    mCamConfig->getImageHeight(&image_height);
+    image_size_.width = (uint16_t)image_width;
+    image_size_.height = (uint16_t)image_height;
+    LOG_INFO("Sensor cropped to %dx%d+%d+%d, image size %dx%d", mSensorCropActive.width, 
+            mSensorCropActive.height, mSensorCropActive.x, mSensorCropActive.y, 
+            image_width, image_height);
     return true;
 }
 
+void CamUsb::setJpegDecodeThreads(uint32_t thread_count, bool drop_stale) {
+    unwatchNotificationFd();
+
+    // The pool is only used while mMutexCallback is locked.
+    pthread_mutex_lock(&mMutexCallback);
+    std::vector<JpegDecodePool*> old_pools;
+    if(mDecodePool != NULL) {
+        mDroppedFramesOffset -= mDecodePool->getDroppedCount();
+        old_pools.push_back(mDecodePool);
+        mDecodePool = NULL;
+    }
+    if(thread_count > 1) {
+        mDecodePool = new JpegDecodePool(thread_count, drop_stale);
+        mDecodePool->setScale(mJpegDecoder.getScale());
+        mDecodePool->setDoneCallback(deliverDecodedFramesStatic, (void*)this);
+    }
+    if(isFrameCallbackThread()) {
+        // The callback may run on a worker of the old pool, which can not join itself.
+        // Deleting it would also deadlock if a worker waits for this callback to return.
+        for(uint32_t i = 0; i < old_pools.size(); ++i) {
+            old_pools[i]->setDoneCallback(NULL, NULL);
+            old_pools[i]->clear();
+            mRetiredDecodePools.push_back(old_pools[i]);
+        }
+        old_pools.clear();
+    } else {
+        old_pools.insert(old_pools.end(), mRetiredDecodePools.begin(), mRetiredDecodePools.end());
+        mRetiredDecodePools.clear();
+    }
+    pthread_mutex_unlock(&mMutexCallback);
+    // Not locked, the workers may wait for mMutexCallback to deliver a frame.
+    for(uint32_t i = 0; i < old_pools.size(); ++i) {
+        delete old_pools[i];
+    }
+
+    updateNotificationFd();
+}
+
+CamUsbStatistics CamUsb::getStatistics() {
+    pthread_mutex_lock(&mMutexStatistics);
+    CamUsbStatistics statistics = mStatistics;
+    pthread_mutex_unlock(&mMutexStatistics);
+    pthread_mutex_lock(&mMutexCallback);
+    if(mDecodePool != NULL) {
+        statistics.frames_dropped = mDecodePool->getDroppedCount() - mDroppedFramesOffset;
+    }
+    pthread_mutex_unlock(&mMutexCallback);
+    statistics.frames_overflowed = (mCamGst != NULL ? mCamGst->getOverflowCount() : 0) - 
+            mOverflowedFramesOffset;
+    return statistics;
+}
+
+void CamUsb::resetStatistics() {
+    pthread_mutex_lock(&mMutexStatistics);
+    mStatistics = CamUsbStatistics();
+    pthread_mutex_unlock(&mMutexStatistics);
+    pthread_mutex_lock(&mMutexCallback);
+    mDroppedFramesOffset = mDecodePool != NULL ? mDecodePool->getDroppedCount() : 0;
+    pthread_mutex_unlock(&mMutexCallback);
+    mOverflowedFramesOffset = mCamGst != NULL ? mCamGst->getOverflowCount() : 0;
+}
+
+base::Time CamUsb::getTimeToFirstFrame() {
+    if(mCamMode != CAM_USB_GST || mCamGst == NULL) {
+        return base::Time();
+    }
+    return mCamGst->getTimeToFirstBuffer();
+}
+
+bool CamUsb::waitForFirstFrame(int32_t timeout_ms) {
+    if(mCamMode != CAM_USB_GST || mCamGst == NULL) {
+        return false;
+    }
+    return mCamGst->waitForFirstBuffer(timeout_ms);
+}
+
+void CamUsb::setFrameCallbackFcn(void (*pcallback_function)(const base::samples::frame::Frame& frame, void* p), 
+        void* p) {
+    pthread_mutex_lock(&mMutexCallback);
+    mpFrameCallbackFunction = pcallback_function;
+    mpFramePassThroughPointer = p;
+    // Waits for a running callback, unless called by it.
+    while(mCallbackRunning && !isFrameCallbackThread()) {
+        pthread_cond_wait(&mCondCallback, &mMutexCallback);
+    }
+    pthread_mutex_unlock(&mMutexCallback);
+}
+
 bool CamUsb::storeFrame(base::samples::frame::Frame& frame, std::string const& file_name) {
     return Helpers::storeImageToFile(frame.image, file_name);
 }
@@ -208,7 +542,15 @@ bool CamUsb::storeFrame(base::samples::frame::Frame& frame, std::string const& f
 bool CamUsb::isFrameAvailable() {
     LOG_DEBUG("CamUsb: isFrameAvailable");
 
-    if(mCamMode == CAM_USB_GST) {
+    if(!checkHotplug(0)) {
+        return false;
+    }
+    requestFrame();
+    checkStall();
+
+    if(isDecodePoolActive()) {
+        return mDecodePool->hasFrame();
+    } else if(mCamMode == CAM_USB_GST) {
        return mCamGst->hasNewBuffer();
     } else {
         return true;
@@ -216,10 +558,26 @@ bool CamUsb::isFrameAvailable() {
     }
 }
 
+bool CamUsb::checkCamera() {
+    LOG_DEBUG("CamUsb: checkCamera");
+
+    if(!checkHotplug(0)) {
+        return false;
+    }
+    // A frame callback awaits the frames all the time.
+    requestFrame();
+    checkStall();
+    return mCamMode != CAM_USB_NONE;
+}
+
 int CamUsb::skipFrames() {
     LOG_DEBUG("CamUsb: skipFrames");
 
-    if(mCamMode == CAM_USB_GST) {
+    if(isDecodePoolActive()) {
+        bool skipped = mDecodePool->hasFrame();
+        mDecodePool->clear();
+        return skipped ? 1 : 0;
+    } else if(mCamMode == CAM_USB_GST) {
         return mCamGst->skipBuffer() ? 1 : 0;
     } else if(mCamMode == CAM_USB_V4L2) {
         LOG_INFO("Frame skipping is not availabl in V4L2 mode.");
@@ -248,7 +606,7 @@ bool CamUsb::setAttrib(const int_attrib::CamAttrib attrib, const int value) {
         throw std::runtime_error("Unknown attribute!");
     else {
         try {
-            mCamConfig->writeControlValue(it->second, value);
+            writeControlValue(it->second, value);
         } catch(std::runtime_error& e) {
             LOG_ERROR("Set integer attribute %d to %d: %s", attrib, value, e.what());
         }
@@ -277,6 +635,7 @@ bool CamUsb::setAttrib(const double_attrib::CamAttrib attrib, const double value
                          1/(float)value, cam_fps_tmp);
             }
             mFps = cam_fps_tmp;
+            mFpsWritten = true;
             break;
         }
         default:
@@ -301,31 +660,31 @@ bool CamUsb::setAttrib(const enum_attrib::CamAttrib attrib) {
 
     switch(attrib) {
         case enum_attrib::WhitebalModeToManual: {
-            mCamConfig->writeControlValue(V4L2_CID_AUTO_WHITE_BALANCE, 0);
+            writeControlValue(V4L2_CID_AUTO_WHITE_BALANCE, 0);
             break;
         }
         case enum_attrib::WhitebalModeToAuto: {
-            mCamConfig->writeControlValue(V4L2_CID_AUTO_WHITE_BALANCE, 1);
+            writeControlValue(V4L2_CID_AUTO_WHITE_BALANCE, 1);
             break;
         }
         case enum_attrib::GainModeToManual: {
-            mCamConfig->writeControlValue(V4L2_CID_AUTOGAIN, 0);
+            writeControlValue(V4L2_CID_AUTOGAIN, 0);
             break;
         }
         case enum_attrib::GainModeToAuto: {
-            mCamConfig->writeControlValue(V4L2_CID_AUTOGAIN, 1);
+            writeControlValue(V4L2_CID_AUTOGAIN, 1);
             break;
         }
         case enum_attrib::PowerLineFrequencyDisabled: {
-            mCamConfig->writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_DISABLED);
+            writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_DISABLED);
             break;
         }
         case enum_attrib::PowerLineFrequencyTo50: {
-            mCamConfig->writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_50HZ);
+            writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_50HZ);
             break;
         }
         case enum_attrib::PowerLineFrequencyTo60: {
-            mCamConfig->writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_60HZ);
+            writeControlValue(V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_60HZ);
             break;
         }
         case enum_attrib::ExposureModeToAuto: {
@@ -333,7 +692,7 @@ bool CamUsb::setAttrib(const enum_attrib::CamAttrib attrib) {
             if(!mCamConfig->isControlIdValid(id)) {
                 id = V4L2_CID_EXPOSURE_AUTO_PRIORITY;
             }
-            mCamConfig->writeControlValue(id, V4L2_EXPOSURE_AUTO);
+            writeControlValue(id, V4L2_EXPOSURE_AUTO);
             break;
         }
         case enum_attrib::ExposureModeToManual: {
@@ -341,7 +700,7 @@ bool CamUsb::setAttrib(const enum_attrib::CamAttrib attrib) {
             if(!mCamConfig->isControlIdValid(id)) {
                 id = V4L2_CID_EXPOSURE_AUTO_PRIORITY;
             }
-            mCamConfig->writeControlValue(id, V4L2_EXPOSURE_MANUAL);
+            writeControlValue(id, V4L2_EXPOSURE_MANUAL);
             break;
         }
         // attribute unknown or not supported (yet)
@@ -562,7 +921,7 @@ bool CamUsb::setV4L2Attrib(const int control_id, const int value) {
         throw std::runtime_error("Stop image requesting before setting a v4l2 attribute.");
     }
  
-    mCamConfig->writeControlValue(control_id, value);
+    writeControlValue(control_id, value);
     return true;
 }
 
@@ -580,9 +939,49 @@ bool CamUsb::setFrameSettings(  const base::samples::frame::frame_size_t size,
 
     LOG_DEBUG("color_depth is set to %d", (int)color_depth);
 
+    // The crop has to be set before the image size, which may be smaller (scaling on the chip).
+    if(mSensorCrop) {
+        try {
+            writeSensorCrop();
+        } catch(std::runtime_error& e) {
+            LOG_WARN("Sensor crop could not be set: %s", e.what());
+        }
+    }
+
+    // If possible MJPEG is requested and decoded, see setJpegDecoding().
+    uint32_t v4l2_image_format = 0;
+    mJpegDecodingActive = false;
+    if(mJpegDecoding && JpegDecoder::isSupportedMode(mode)) {
+        v4l2_image_format = mCamConfig->toV4L2ImageFormat(base::samples::frame::MODE_JPEG);
+        mJpegDecodingActive = v4l2_image_format != 0;
+        if(!mJpegDecodingActive) {
+            LOG_INFO("MJPEG is not available on the camera, images will not be decoded");
+        }
+    }
+    updateJpegNormalization();
+
     // Hack: If RGB is requested and not available on the camera, YUYV will be 
-    // used and internally converted to RGB.
-    uint32_t v4l2_image_format = mCamConfig->toV4L2ImageFormat(mode);
+    // used and internally converted to RGB. This is also where the frames are downscaled.
+    mOutputScaleActive = 1;
+    if(v4l2_image_format == 0) {
+        mCamConfig->setOutputScale(mOutputScale);
+        v4l2_image_format = mCamConfig->toV4L2ImageFormat(mode);
+        mOutputScaleActive = mCamConfig->getActiveOutputScale();
+    }
+
+    // Without MJPEG support raw 4:2:2 images are requested and encoded, see setJpegEncoding().
+    mJpegEncodingActive = false;
+    if(v4l2_image_format == 0 && mJpegEncoding && mode == base::samples::frame::MODE_JPEG) {
+        if(mCamConfig->isPixelformatAvailable(V4L2_PIX_FMT_YUYV)) {
+            v4l2_image_format = V4L2_PIX_FMT_YUYV;
+        } else if(mCamConfig->isPixelformatAvailable(V4L2_PIX_FMT_UYVY)) {
+            v4l2_image_format = V4L2_PIX_FMT_UYVY;
+        } else {
+            LOG_INFO("Neither MJPEG nor YUYV/UYVY are available, images will not be encoded");
+        }
+        mJpegEncodingActive = v4l2_image_format != 0;
+    }
+
     if(v4l2_image_format == 0) {
         LOG_INFO("Frame mode not available on the camera, using default camera mode.");
         LOG_INFO("v4l2 image requesting will probably support an unexpeted format");
@@ -594,6 +993,26 @@ bool CamUsb::setFrameSettings(  const base::samples::frame::frame_size_t size,
     mCamConfig->getImageWidth(&width);
     mCamConfig->getImageHeight(&height);
 
+    mRawPixelformat = 0;
+    if(mJpegEncodingActive) {
+        mCamConfig->getImagePixelformat(&mRawPixelformat);
+        if(!JpegEncoder::isSupportedPixelformat(mRawPixelformat)) {
+            LOG_WARN("Camera has not accepted the raw pixelformat, images will not be encoded");
+            mJpegEncodingActive = false;
+        }
+    }
+
+    // Otherwise every conversion would fail.
+    if(!isScalableSize(width, height, mOutputScaleActive)) {
+        LOG_WARN("Image size %dx%d can not be reduced to 1/%d, the images are not reduced", 
+                width, height, mOutputScaleActive);
+        if(!mCamConfig->disableActiveOutputScale(mode)) {
+            LOG_ERROR("Frame mode %d can not be converted without reduction", mode);
+            return false;
+        }
+        mOutputScaleActive = 1;
+    }
+
     base::samples::frame::frame_size_t size_tmp;
     size_tmp.width = (uint16_t)width;
     size_tmp.height = (uint16_t)height;
@@ -630,6 +1049,8 @@ bool CamUsb::setToDefault() {
     }
 
     mCamConfig->setControlValuesToDefault();
+    // A reconnected camera starts with its defaults as well.
+    mWrittenControls.clear();
     return true;
 }
 
@@ -679,6 +1100,65 @@ int CamUsb::getFileDescriptor() const {
     return fd;
 }
 
+int CamUsb::getNotificationFd() {
+    LOG_DEBUG("CamUsb: getNotificationFd");
+
+    if(mNotificationFd != -1) {
+        return mNotificationFd;
+    }
+
+    mNotificationFd = epoll_create1(EPOLL_CLOEXEC);
+    if(mNotificationFd == -1) {
+        LOG_ERROR("Notification fd could not be created: %s", strerror(errno));
+        return -1;
+    }
+    if(mCamConfig != NULL) {
+        mCamConfig->setKeepBufferQueued(true);
+    }
+    updateNotificationFd();
+    return mNotificationFd;
+}
+
+void CamUsb::updateNotificationFd() {
+    if(mNotificationFd == -1) {
+        return;
+    }
+    unwatchNotificationFd();
+
+    int fd = -1;
+    if(isDecodePoolActive()) {
+        fd = mDecodePool->getEventFd();
+    } else if(mCamMode == CAM_USB_GST) {
+        fd = mCamGst->getEventFd();
+    } else if(mCamMode == CAM_USB_V4L2 && act_grab_mode_ != Stop) {
+        fd = mCamConfig->getFd();
+    }
+    if(fd == -1) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(mNotificationFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOG_ERROR("fd %d could not be added to the notification fd: %s", fd, strerror(errno));
+        return;
+    }
+    mWatchedFd = fd;
+}
+
+void CamUsb::unwatchNotificationFd() {
+    if(mNotificationFd == -1 || mWatchedFd == -1) {
+        return;
+    }
+    // Closed fds are removed automatically, so ENOENT is not an error.
+    if(epoll_ctl(mNotificationFd, EPOLL_CTL_DEL, mWatchedFd, NULL) == -1 && errno != ENOENT) {
+        LOG_WARN("fd %d could not be removed from the notification fd: %s", mWatchedFd, strerror(errno));
+    }
+    mWatchedFd = -1;
+}
+
 void CamUsb::createAttrsCtrlMaps(CamConfig* cam_config) {
     LOG_DEBUG("CamUsb: createAttrsCtrlMaps");
     
@@ -697,6 +1177,660 @@ void CamUsb::createAttrsCtrlMaps(CamConfig* cam_config) {
     mMapAttrsCtrlsInt.insert(ac_int(int_attrib::ExposureValue,valid_exposure_id));
 }
 
+bool CamUsb::setHotplugRecovery(bool enable, uint32_t max_outage_ms) {
+    LOG_DEBUG("CamUsb: setHotplugRecovery %s", enable ? "true" : "false");
+
+    mHotplugEnabled = enable;
+    mMaxOutageMs = max_outage_ms;
+
+    if(!enable) {
+        delete mHotplug;
+        mHotplug = NULL;
+        mDeviceLost = false;
+        return true;
+    }
+
+    // Otherwise the monitor is started in open().
+    if(mIsOpen && mHotplug == NULL) {
+        return startHotplugMonitor();
+    }
+    return true;
+}
+
+void CamUsb::writeControlValue(uint32_t const id, int32_t value) {
+    mCamConfig->writeControlValue(id, value);
+    mWrittenControls[id] = value;
+}
+
+bool CamUsb::startHotplugMonitor() {
+    LOG_DEBUG("CamUsb: startHotplugMonitor");
+
+    std::string bus_info;
+    if(mCamConfig != NULL) {
+        bus_info = mCamConfig->getCapabilityBusInfo();
+    } else if(!CamHotplug::readBusInfo(mDevice, &bus_info)) {
+        bus_info.clear();
+    }
+    if(bus_info.empty()) {
+        LOG_ERROR("Bus info of %s is unknown, hotplug monitor can not be started", mDevice.c_str());
+        return false;
+    }
+
+    mHotplug = new CamHotplug(mDevice, bus_info);
+    if(!mHotplug->start()) {
+        delete mHotplug;
+        mHotplug = NULL;
+        return false;
+    }
+    mRemovalCount = mHotplug->getRemovalCount();
+    mDeviceLost = false;
+    return true;
+}
+
+bool CamUsb::checkHotplug(int32_t timeout_ms) {
+    if(mHotplug == NULL) {
+        return true;
+    }
+
+    if(!mDeviceLost) {
+        // Also catches a reset which happened completely between two calls.
+        bool removed = mHotplug->getRemovalCount() != mRemovalCount;
+        bool stream_error = mCamMode == CAM_USB_GST && mCamGst->hasPipelineError();
+        if(!removed && !stream_error) {
+            return true;
+        }
+
+        LOG_WARN("Camera %s lost (%s), waiting for the device to come back", mDevice.c_str(), 
+                removed ? "removed" : "pipeline error");
+        mRemovalCount = mHotplug->getRemovalCount();
+        mDeviceLost = true;
+        mRecoveryFailureReported = false;
+        mDeviceLostTime = base::Time::now();
+        countEvent(&CamUsbStatistics::hotplug_removals);
+        releaseDevice();
+        reportHotplugEvent(HOTPLUG_DEVICE_REMOVED, base::Time());
+    }
+
+    std::string device;
+    if(mHotplug->waitForDevice(timeout_ms, &device)) {
+        try {
+            recoverDevice(device);
+            mDeviceLost = false;
+            mRemovalCount = mHotplug->getRemovalCount();
+            base::Time outage = base::Time::now() - mDeviceLostTime;
+            LOG_INFO("Camera recovered as %s after %d ms", device.c_str(), (int)outage.toMilliseconds());
+            countEvent(&CamUsbStatistics::hotplug_recoveries);
+            reportHotplugEvent(HOTPLUG_DEVICE_RECOVERED, outage);
+            return true;
+        } catch(std::runtime_error& e) {
+            // E.g. the node has not been removed yet or is not accessible, try again later.
+            LOG_WARN("Camera %s could not be recovered: %s", device.c_str(), e.what());
+            releaseDevice();
+        }
+    }
+
+    base::Time outage = base::Time::now() - mDeviceLostTime;
+    if(!mRecoveryFailureReported && outage.toMilliseconds() > (int64_t)mMaxOutageMs) {
+        LOG_ERROR("Camera %s has not been recovered within %d ms", 
+                mHotplug->getBusInfo().c_str(), mMaxOutageMs);
+        mRecoveryFailureReported = true;
+        reportHotplugEvent(HOTPLUG_RECOVERY_FAILED, outage);
+    }
+    return false;
+}
+
+void CamUsb::releaseDevice() {
+    LOG_DEBUG("CamUsb: releaseDevice");
+    if(mCamMode == CAM_USB_V4L2) {
+        try {
+            mCamConfig->cleanupRequesting();
+        } catch(std::runtime_error& e) {
+            LOG_WARN("v4l2 cleanup of the removed device: %s", e.what());
+        }
+    }
+    changeCameraMode(CAM_USB_NONE);
+}
+
+void CamUsb::recoverDevice(std::string const& device) {
+    LOG_DEBUG("CamUsb: recoverDevice %s", device.c_str());
+
+    mDevice = device;
+    mCamInfo.device = device;
+
+    // grab() refuses to start if a grab mode is still set.
+    GrabMode grab_mode = act_grab_mode_;
+    act_grab_mode_ = Stop;
+
+    try {
+        changeCameraMode(CAM_USB_NONE);
+        changeCameraMode(CAM_USB_V4L2);
+
+        setFrameSettings(image_size_, image_mode_, image_color_depth_);
+        if(mFpsWritten) {
+            mCamConfig->writeFPS((uint32_t)mFps);
+        }
+
+        std::map<uint32_t, int32_t>::iterator it = mWrittenControls.begin();
+        for(; it != mWrittenControls.end(); ++it) {
+            try {
+                mCamConfig->writeControlValue(it->first, it->second);
+            } catch(std::runtime_error& e) {
+                LOG_WARN("Control %d could not be reapplied: %s", it->first, e.what());
+            }
+        }
+
+        if(grab_mode != Stop) {
+            grab(grab_mode, mBufferLen);
+            if(mCamMode == CAM_USB_GST && !mCamGst->isPipelineRunning()) {
+                throw std::runtime_error("Pipeline could not be restarted");
+            }
+        }
+    } catch(std::runtime_error& e) {
+        // Keep the grab mode for the next attempt.
+        act_grab_mode_ = grab_mode;
+        throw;
+    }
+    act_grab_mode_ = grab_mode;
+}
+
+void CamUsb::reportHotplugEvent(enum HotplugEventType type, base::Time const& outage) {
+    if(mpHotplugCallbackFunction == NULL) {
+        return;
+    }
+    HotplugEvent event;
+    event.type = type;
+    event.device = mDevice;
+    event.bus_info = mHotplug->getBusInfo();
+    event.outage = outage;
+    mpHotplugCallbackFunction(event, mpHotplugPassThroughPointer);
+}
+
+void CamUsb::warnIfNotChecked() {
+    if(!mHotplugEnabled && !mWatchdogEnabled) {
+        return;
+    }
+    pthread_mutex_lock(&mMutexCallback);
+    bool frame_callback = mpFrameCallbackFunction != NULL;
+    pthread_mutex_unlock(&mMutexCallback);
+    if(frame_callback) {
+        LOG_WARN("Frames are received with a frame callback, hotplug recovery and watchdog "
+                "are only executed if checkCamera() is called periodically");
+    }
+}
+
+void CamUsb::setWatchdog(bool enable, uint32_t stall_intervals) {
+    LOG_DEBUG("CamUsb: setWatchdog %s, stall intervals %d", enable ? "true" : "false", stall_intervals);
+    mWatchdogEnabled = enable;
+    mStallIntervals = stall_intervals;
+    mWatchdogStep = WATCHDOG_NONE;
+}
+
+bool CamUsb::checkJpeg(JpegHeaderInfo const& info) {
+    if(mJpegCheck == JPEG_CHECK_NONE || info.isComplete()) {
+        return true;
+    }
+    LOG_DEBUG("Incomplete JPEG image (frame header %d, scan %d, EOI %d)", 
+            info.sof_found, info.sos_found, info.eoi_found);
+    countEvent(&CamUsbStatistics::frames_corrupt);
+    return mJpegCheck != JPEG_CHECK_REJECT;
+}
+
+void CamUsb::applyJpegHeader(JpegHeaderInfo const& info, base::samples::frame::Frame& frame) {
+    using namespace base::samples::frame;
+    if(mJpegCheck == JPEG_CHECK_NONE) {
+        return;
+    }
+    // The camera may not deliver the configured size.
+    if(frame.getFrameMode() == MODE_JPEG && info.sof_found && 
+            (frame.getWidth() != info.width || frame.getHeight() != info.height)) {
+        Helpers::setFrameFormat(frame, info.width, info.height, 8, MODE_JPEG);
+    }
+    if(!info.isComplete()) {
+        frame.frame_status = STATUS_INVALID;
+    }
+}
+
+bool CamUsb::encodeFrame(JpegEncoder& encoder, uint8_t const* data, size_t size, 
+        base::samples::frame::Frame& frame) {
+    if(data == NULL) {
+        return false;
+    }
+    // The default pipeline converts to UYVY, V4L2 delivers the format of the camera.
+    uint32_t pixelformat = mCamMode == CAM_USB_GST ? V4L2_PIX_FMT_UYVY : mRawPixelformat;
+    if(mCamMode == CAM_USB_GST) {
+        encoder.setQuality(mCamGst->getJpegQuality());
+    }
+    if(!encoder.encode(data, size, image_size_.width, image_size_.height, pixelformat, frame.image)) {
+        return false;
+    }
+    initFrame(frame);
+    return true;
+}
+
+bool CamUsb::writeSensorCrop() {
+    if(!mCamConfig->readCropcap()) {
+        return false;
+    }
+    struct v4l2_rect rect = mCamConfig->getCropcap().defrect;
+    if(mSensorCrop) {
+        // Relative to the bounds, which do not have to start at 0.
+        rect.left = mCamConfig->getCropcap().bounds.left + (int32_t)mSensorCropRequested.x;
+        rect.top = mCamConfig->getCropcap().bounds.top + (int32_t)mSensorCropRequested.y;
+        rect.width = mSensorCropRequested.width;
+        rect.height = mSensorCropRequested.height;
+    }
+    if(!mCamConfig->writeCrop(&rect)) {
+        return false;
+    }
+    mSensorCropActive = ImageRegion();
+    if(mSensorCrop) {
+        mSensorCropActive = ImageRegion(rect.left - mCamConfig->getCropcap().bounds.left, 
+                rect.top - mCamConfig->getCropcap().bounds.top, rect.width, rect.height);
+    }
+    return true;
+}
+
+bool CamUsb::scaleFrame(uint8_t const* data, size_t size, ImageRegion const& region,
+        base::samples::frame::Frame& frame) {
+    // CamGst::getBuffer() has copied only the region.
+    uint32_t width = region.isEmpty() ? image_size_.width : region.width;
+    uint32_t height = region.isEmpty() ? image_size_.height : region.height;
+    if(data == NULL || !mScaleConverter(data, size, width, height, 0, frame.image, mConvertPool)) {
+        return false;
+    }
+    initFrame(frame, region);
+    return true;
+}
+
+bool CamUsb::extractGstRegion(uint8_t const* data, size_t size, ImageRegion& region,
+        base::samples::frame::Frame& frame) {
+    bool scaling = isGstScalingActive();
+    uint32_t fourcc = scaling ? (uint32_t)V4L2_PIX_FMT_UYVY : getPackedFourcc(image_mode_);
+    // GStreamer 0.10 pads the rows of raw video to multiples of 4 bytes.
+    uint32_t stride = (image_size_.width * getPackedPixelSize(fourcc) + 3) & ~3u;
+    if(!clipRegion(fourcc, image_size_.width, image_size_.height, mOutputScaleActive, region) ||
+            !extractRegion(data, size, image_size_.width, stride, fourcc, 
+            scaling ? mScaleConverter : NULL, region, frame.image, mConvertPool)) {
+        region = ImageRegion();
+        return false;
+    }
+    initFrame(frame, region);
+    return true;
+}
+
+void CamUsb::updateJpegNormalization() {
+    // Not every libjpeg version accepts MJPEG images without Huffman tables.
+    bool insert = mInsertJpegHuffmanTables || mJpegDecodingActive;
+    if(mCamConfig != NULL) {
+        mCamConfig->setInsertJpegHuffmanTables(insert);
+    }
+    if(mCamGst != NULL) {
+        mCamGst->setInsertJpegHuffmanTables(insert);
+    }
+}
+
+bool CamUsb::startDefaultPipeline(bool recreate) {
+    // If one of the parameters is 0, the current setting of the camera is used.
+    // With active decoding the camera delivers MJPEG, with active encoding 
+    // or downscaling UYVY.
+    base::samples::frame::frame_mode_t mode = image_mode_;
+    mScaleConverter = NULL;
+    mOutputScaleActive = 1;
+    if(mJpegDecodingActive) {
+        mode = base::samples::frame::MODE_JPEG;
+    } else if(mJpegEncodingActive) {
+        mode = base::samples::frame::MODE_UYVY;
+    } else if(mOutputScale > 1) {
+        if(isScalableSize(image_size_.width, image_size_.height, mOutputScale)) {
+            mScaleConverter = getScaledPixelConverter(V4L2_PIX_FMT_UYVY, image_mode_, mOutputScale);
+        } else {
+            LOG_WARN("Image size %dx%d can not be reduced to 1/%d, the images are not reduced", 
+                    image_size_.width, image_size_.height, mOutputScale);
+        }
+        if(mScaleConverter != NULL) {
+            mode = base::samples::frame::MODE_UYVY;
+            mOutputScaleActive = mOutputScale;
+        }
+    }
+    if(!mGstPipelineDescription.empty()) {
+        if(recreate || !mCamGst->isPipeline(mGstPipelineDescription, mGstPipelineSinkName)) {
+            mCamGst->createPipeline(mGstPipelineDescription, mGstPipelineSinkName, mode, 
+                    image_size_.width, image_size_.height);
+        } else {
+            LOG_INFO("Restarting the custom pipeline");
+        }
+    } else if(recreate || !mCamGst->isDefaultPipeline(image_size_.width, image_size_.height,
+            (uint32_t)mFps, (uint32_t)mBpp, mode, mJpegQuality)) {
+        mCamGst->createDefaultPipeline(true,
+                image_size_.width, image_size_.height,
+                (uint32_t)mFps, (uint32_t)mBpp, mode, mJpegQuality);
+    } else {
+        LOG_INFO("Restarting the pipeline with unchanged settings");
+    }
+
+    if(mDecodePool != NULL) {
+        mDecodePool->clear();
+    }
+    return mCamGst->startPipeline();
+}
+
+bool CamUsb::readDecodedFrame(base::samples::frame::Frame& frame, int32_t timeout_ms, bool* error) {
+    *error = false;
+    // Like CamGst::getBuffer() a timeout <= 0 waits until the pipeline stops.
+    do {
+        if(!mCamGst->isPipelineRunning()) {
+            LOG_WARN("Frame can not be retrieved, because pipeline is not running.");
+            *error = true;
+            return false;
+        }
+        if(mDecodePool->pop(frame, timeout_ms > 0 ? timeout_ms : 1000)) {
+            return true;
+        }
+    } while(timeout_ms <= 0);
+    return false;
+}
+
+bool CamUsb::readBuffer(std::vector<uint8_t>& buffer, int32_t timeout_ms, bool* error,
+        ImageRegion* region, JpegHeaderInfo* info) {
+    *error = false;
+    // Either v4l2 calls are used to retrieve single images or the gstreamer pipeline.
+    // The initialization/cleanup for both methods happens in the grab() function.
+    if(mCamMode == CAM_USB_V4L2) {
+        try {
+            return mCamConfig->getBuffer(buffer, true, timeout_ms, region, info);
+        } catch(std::runtime_error& e) {
+            LOG_ERROR("v4l2: Buffer could not be requested: %s", e.what());
+            *error = true;
+            return false;
+        }   
+    } else if(mCamMode == CAM_USB_GST) {
+        if(!mCamGst->isPipelineRunning()) {
+            LOG_WARN("Frame can not be retrieved, because pipeline is not running.");
+            *error = true;
+            return false;
+        }
+        // The UYVY images are reduced afterwards, so the region has to fit the scale.
+        bool success = mCamGst->getBuffer(buffer, true, timeout_ms, region, mOutputScaleActive, 
+                info);
+        if(!success) {
+            LOG_ERROR("Gstreamer: Buffer could not retrieved.");
+        }
+        return success;
+    }
+    *error = true;
+    return false;
+}
+
+int32_t CamUsb::getStallTimeMs() {
+    float fps = mFps > 0 ? mFps : 1;
+    int32_t stall_ms = (int32_t)(mStallIntervals * 1000 / fps);
+    return stall_ms < MIN_STALL_TIME_MS ? MIN_STALL_TIME_MS : stall_ms;
+}
+
+bool CamUsb::checkStall() {
+    // A removed device is handled by checkHotplug().
+    if(!mWatchdogEnabled || act_grab_mode_ == Stop || mDeviceLost) {
+        return false;
+    }
+
+    // The consumer is slower than the camera, the stream is not stalled.
+    if(isFramePending()) {
+        return false;
+    }
+
+    base::Time last_frame = mLastFrameTime;
+    if(mCamMode == CAM_USB_GST) {
+        // Buffers may be received without being retrieved.
+        base::Time last_buffer = mCamGst->getLastBufferTime();
+        if(last_buffer > last_frame) {
+            last_frame = last_buffer;
+        }
+    }
+    int64_t since_last_frame_ms = (base::Time::now() - last_frame).toMilliseconds();
+    if(since_last_frame_ms < getStallTimeMs()) {
+        return false;
+    }
+
+    if(mWatchdogStep == WATCHDOG_NONE) {
+        countEvent(&CamUsbStatistics::stalls);
+    }
+    if(mWatchdogStep != WATCHDOG_RECREATE_DEVICE) {
+        mWatchdogStep = (enum WATCHDOG_STEP)(mWatchdogStep + 1);
+    }
+    LOG_WARN("No frame received for %d ms, watchdog step %d", (int)since_last_frame_ms, mWatchdogStep);
+
+    try {
+        executeWatchdogStep(mWatchdogStep);
+    } catch(std::runtime_error& e) {
+        LOG_ERROR("Watchdog step %d failed: %s", mWatchdogStep, e.what());
+    }
+
+    // Each step gets one stall time to take effect.
+    mLastFrameTime = base::Time::now();
+    return true;
+}
+
+void CamUsb::requestFrame() {
+    if(mFrameRequested) {
+        return;
+    }
+    // The time since the last frame in which no frame has been requested is not counted.
+    // Keeps the startup time set by grab().
+    base::Time now = base::Time::now();
+    if(now > mLastFrameTime) {
+        mLastFrameTime = now;
+    }
+    mFrameRequested = true;
+}
+
+bool CamUsb::isFramePending() {
+    if(isDecodePoolActive()) {
+        return mDecodePool->hasFrame();
+    } else if(mCamMode == CAM_USB_GST && mCamGst != NULL) {
+        return mCamGst->hasNewBuffer();
+    } else if(mCamMode == CAM_USB_V4L2 && mCamConfig != NULL) {
+        try {
+            return mCamConfig->isImageAvailable(0);
+        } catch(std::runtime_error&) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void CamUsb::executeWatchdogStep(enum WATCHDOG_STEP step) {
+    switch(step) {
+        case WATCHDOG_REQUEUE: {
+            countEvent(&CamUsbStatistics::requeues);
+            if(mCamMode == CAM_USB_V4L2) {
+                mCamConfig->requeueBuffers();
+            } else if(mCamMode == CAM_USB_GST) {
+                mCamGst->flushPipeline();
+            }
+            break;
+        }
+        case WATCHDOG_RESTART_STREAM: {
+            countEvent(&CamUsbStatistics::stream_restarts);
+            if(mCamMode == CAM_USB_V4L2) {
+                mCamConfig->cleanupRequesting();
+                mCamConfig->initRequesting();
+            } else if(mCamMode == CAM_USB_GST) {
+                if(!startDefaultPipeline(true)) {
+                    throw std::runtime_error("Pipeline could not be restarted");
+                }
+            }
+            break;
+        }
+        case WATCHDOG_RECREATE_DEVICE: {
+            countEvent(&CamUsbStatistics::device_recreations);
+            releaseDevice();
+            recoverDevice(mDevice);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void CamUsb::initFrame(base::samples::frame::Frame& frame, ImageRegion const& region) {
+    // TODO In Frame.hpp getChannelCount() returns 1 for UYVY, should be 2?
+    int depth = 8;
+    if(image_mode_ == base::samples::frame::MODE_UYVY) {
+        depth = 16;
+    }
+
+    uint32_t width = region.isEmpty() ? image_size_.width : region.width;
+    uint32_t height = region.isEmpty() ? image_size_.height : region.height;
+    // The image has been written directly into the frame, Frame::init() would reset it.
+    Helpers::setFrameFormat(frame, width / mOutputScaleActive, height / mOutputScaleActive, 
+            depth, image_mode_);
+    frame.attributes.clear();
+    frame.setAttribute<uint32_t>("roi_x", region.x);
+    frame.setAttribute<uint32_t>("roi_y", region.y);
+}
+
+bool CamUsb::callbackNewBuffer(uint8_t const* data, uint32_t size) {
+    if(mpCallbackFunction != NULL) {
+        mpCallbackFunction(mpPassThroughPointer);
+    }
+
+    pthread_mutex_lock(&mMutexCallback);
+    if(isDecodePoolActive()) {
+        // Retrieved with retrieveFrame() or passed to the frame callback as soon as decoded.
+        // The header is read while the pool copies the image.
+        JpegHeaderInfo info;
+        mDecodePool->push(data, size, image_mode_, base::Time::now(), &info, 
+                mJpegCheck == JPEG_CHECK_REJECT);
+        if(mJpegCheck != JPEG_CHECK_NONE) {
+            checkJpeg(info); // Counts incomplete images.
+        }
+        pthread_mutex_unlock(&mMutexCallback);
+        return true;
+    }
+
+    if(mpFrameCallbackFunction == NULL) {
+        pthread_mutex_unlock(&mMutexCallback);
+        return false;
+    }
+
+    // The JPEG header is inspected while copying.
+    JpegHeaderInfo info;
+    bool jpeg = false;
+    ImageRegion region = getRegionOfInterest();
+    if(mJpegDecodingActive) {
+        Helpers::normalizeJpeg(data, size, mCallbackJpegBuffer, true, &info);
+        jpeg = true;
+        if(!checkJpeg(info) || mCallbackJpegBuffer.empty() || 
+                !mCallbackJpegDecoder.decode(&mCallbackJpegBuffer[0], 
+                mCallbackJpegBuffer.size(), image_mode_, mCallbackFrame)) {
+            pthread_mutex_unlock(&mMutexCallback);
+            return true; // Corrupted images are dropped.
+        }
+    } else if(mJpegEncodingActive) {
+        if(!encodeFrame(mCallbackJpegEncoder, data, size, mCallbackFrame)) {
+            pthread_mutex_unlock(&mMutexCallback);
+            return true;
+        }
+    } else if(extractGstRegion(data, size, region, mCallbackFrame)) {
+        // Only the region of interest has been copied.
+    } else if(isGstScalingActive()) {
+        if(!scaleFrame(data, size, region, mCallbackFrame)) {
+            pthread_mutex_unlock(&mMutexCallback);
+            return true;
+        }
+    } else {
+        if(image_mode_ == base::samples::frame::MODE_JPEG) {
+            Helpers::normalizeJpeg(data, size, mCallbackFrame.image, mInsertJpegHuffmanTables, 
+                    &info);
+            jpeg = true;
+            if(!checkJpeg(info)) {
+                pthread_mutex_unlock(&mMutexCallback);
+                return true;
+            }
+        } else {
+            mCallbackFrame.image.resize(size);
+            if(size > 0) {
+                memcpy(&mCallbackFrame.image[0], data, size);
+            }
+        }
+        initFrame(mCallbackFrame);
+    }
+    mCallbackFrame.frame_status = base::samples::frame::STATUS_VALID;
+    mCallbackFrame.time = base::Time::now();
+    if(jpeg) {
+        applyJpegHeader(info, mCallbackFrame);
+    }
+
+    // mCallbackFrame is only used within the streaming thread.
+    bool called = invokeFrameCallback(mCallbackFrame);
+    pthread_mutex_unlock(&mMutexCallback);
+    return called;
+}
+
+bool CamUsb::callbackNewBufferStatic(uint8_t const* data, uint32_t size, void* p) {
+    return ((CamUsb*)p)->callbackNewBuffer(data, size);
+}
+
+void CamUsb::deliverDecodedFrames() {
+    pthread_mutex_lock(&mMutexCallback);
+    // The delivering worker pops the frames which are finished during its callback as well,
+    // so the order is kept and mDecodedCallbackFrame is not overwritten.
+    if(!mDeliveringDecodedFrames) {
+        mDeliveringDecodedFrames = true;
+        // Frames which are decoded while no frame callback is set are left for retrieveFrame().
+        while(isDecodePoolActive() && mpFrameCallbackFunction != NULL && 
+                mDecodePool->pop(mDecodedCallbackFrame, 0)) {
+            invokeFrameCallback(mDecodedCallbackFrame);
+        }
+        mDeliveringDecodedFrames = false;
+    }
+    pthread_mutex_unlock(&mMutexCallback);
+}
+
+void CamUsb::deliverDecodedFramesStatic(void* p) {
+    ((CamUsb*)p)->deliverDecodedFrames();
+}
+
+bool CamUsb::invokeFrameCallback(base::samples::frame::Frame const& frame) {
+    // E.g. the streaming thread while a decoded frame is delivered after a mode change.
+    while(mCallbackRunning) {
+        pthread_cond_wait(&mCondCallback, &mMutexCallback);
+    }
+    void (*callback)(const base::samples::frame::Frame& frame, void* p) = mpFrameCallbackFunction;
+    void* p = mpFramePassThroughPointer;
+    if(callback == NULL) {
+        return false;
+    }
+    countFrame();
+    mCallbackRunning = true;
+    mCallbackThread = pthread_self();
+    pthread_mutex_unlock(&mMutexCallback);
+
+    callback(frame, p);
+
+    pthread_mutex_lock(&mMutexCallback);
+    mCallbackRunning = false;
+    pthread_cond_broadcast(&mCondCallback);
+    return true;
+}
+
+bool CamUsb::isFrameCallbackThread() {
+    return mCallbackRunning && pthread_equal(mCallbackThread, pthread_self());
+}
+
+void CamUsb::countFrame() {
+    pthread_mutex_lock(&mMutexStatistics);
+    mReceivedFrameCounter++;
+    mStatistics.frames_received++;
+    pthread_mutex_unlock(&mMutexStatistics);
+}
+
+void CamUsb::countEvent(uint32_t CamUsbStatistics::* counter) {
+    pthread_mutex_lock(&mMutexStatistics);
+    mStatistics.*counter += 1;
+    pthread_mutex_unlock(&mMutexStatistics);
+}
+
 void CamUsb::changeCameraMode(enum CAM_USB_MODE cam_usb_mode) {
 
     LOG_DEBUG("Will change camera mode to: %s", camera::ModeTxt[cam_usb_mode].c_str());
@@ -706,7 +1840,14 @@ void CamUsb::changeCameraMode(enum CAM_USB_MODE cam_usb_mode) {
         return;
     }
 
-    if(mCamGst != NULL) {
+    unwatchNotificationFd();
+
+    // Stopping the stream (grab(Stop) switches to v4l2) keeps the pipeline in READY, 
+    // so the next start is a state change instead of a new negotiation.
+    if(mCamGst != NULL && cam_usb_mode == CAM_USB_V4L2) {
+        mCamGst->pausePipeline();
+    } else if(mCamGst != NULL && cam_usb_mode != CAM_USB_GST) {
+        mOverflowedFramesOffset -= mCamGst->getOverflowCount();
         delete mCamGst;
         mCamGst = NULL;
     }
@@ -724,12 +1865,19 @@ void CamUsb::changeCameraMode(enum CAM_USB_MODE cam_usb_mode) {
         case CAM_USB_V4L2:
             LOG_INFO("Camera configuration mode via v4l2 activated");
             mCamConfig = new CamConfig(mDevice);
+            mCamConfig->setKeepBufferQueued(mNotificationFd != -1);
+            mCamConfig->setConvertPool(mConvertPool);
             mCamMode = CAM_USB_V4L2;
             createAttrsCtrlMaps(mCamConfig);
             break;
         case CAM_USB_GST:
             LOG_INFO("Camera image transfer mode via gst activated");
-            mCamGst = new CamGst(mDevice);
+            if(mCamGst == NULL) {
+                mCamGst = new CamGst(mDevice);
+                mCamGst->setNewBufferCallback(callbackNewBufferStatic, (void*)this);
+                mCamGst->setSinkQueue(mSinkMaxBuffers, mSinkDrop);
+                mCamGst->setSourceQueue(mSourceQueueMaxBuffers, mSourceQueueLeak);
+            }
             mCamMode = CAM_USB_GST;
             break;
         default:
@@ -737,6 +1885,8 @@ void CamUsb::changeCameraMode(enum CAM_USB_MODE cam_usb_mode) {
             mCamMode = CAM_USB_NONE;
             break;
     }
+    updateJpegNormalization();
+    updateNotificationFd();
 }
 
 } // end namespace camera
@@ -23,6 +23,9 @@
 
 #include "cam_gst.h"
 #include "cam_config.h"
+#include "cam_hotplug.h"
+#include "cam_decode_pool.h"
+#include "cam_jpeg.h"
 
 namespace camera 
 {
@@ -34,6 +37,46 @@ namespace camera
     };
 
     static const std::string ModeTxt[] = { "CAM_USB_NONE", "CAM_USB_V4L2", "CAM_USB_GST" };
+
+    /**
+     * Escalation steps of the stall watchdog.
+     */
+    enum WATCHDOG_STEP {
+        WATCHDOG_NONE,
+        WATCHDOG_REQUEUE,        // Requeue the capture buffers / flush the pipeline.
+        WATCHDOG_RESTART_STREAM, // Restart streaming / recreate the pipeline.
+        WATCHDOG_RECREATE_DEVICE // Close and reopen the device.
+    };
+
+    /**
+     * Handling of incomplete JPEG images (e.g. truncated USB transfers), see CamUsb::setJpegCheck().
+     */
+    enum JPEG_CHECK {
+        JPEG_CHECK_NONE,   // Frames are passed unchecked.
+        JPEG_CHECK_FLAG,   // Frames are passed with STATUS_INVALID.
+        JPEG_CHECK_REJECT  // Frames are dropped.
+    };
+
+    /**
+     * Counters of CamUsb, see CamUsb::getStatistics().
+     */
+    struct CamUsbStatistics {
+        CamUsbStatistics() : frames_received(0), stalls(0), requeues(0), 
+                stream_restarts(0), device_recreations(0), 
+                hotplug_removals(0), hotplug_recoveries(0), frames_dropped(0), frames_corrupt(0), 
+                frames_overflowed(0) {}
+
+        uint32_t frames_received;
+        uint32_t stalls; // Number of detected stalls, each may cause several actions.
+        uint32_t requeues;
+        uint32_t stream_restarts;
+        uint32_t device_recreations;
+        uint32_t hotplug_removals;
+        uint32_t hotplug_recoveries;
+        uint32_t frames_dropped; // By the decode pool, see CamUsb::setJpegDecodeThreads().
+        uint32_t frames_corrupt; // Incomplete JPEG images, see CamUsb::setJpegCheck().
+        uint32_t frames_overflowed; // By the GStreamer buffer queue, see CamUsb::setGstQueuePolicy().
+    };
 /**
  * 
  * Allows configuration and image-requesting of cameras supported by Video4Linux.
@@ -51,11 +94,27 @@ namespace camera
  * 7. Use 'retrieveFrame()' to get a Frame.
  *
  * You can use 'fastInit(width, height)' for the steps 2, 3 and 4.
+ *
+ * If 'setHotplugRecovery()' is activated a removed and reconnected camera (e.g. after a
+ * USB reset) is reopened, the last frame settings and controls are reapplied and 
+ * the image requesting is restarted. The recovery is executed within retrieveFrame(),
+ * isFrameAvailable() and checkCamera(), never within the streaming thread. So if the 
+ * frames are received with a frame callback, checkCamera() has to be called periodically.
+ *
+ * The stall watchdog ('setWatchdog()') escalates if no frame has been received for 
+ * a few frame intervals: the buffers are requeued, then the stream is restarted and 
+ * finally the device is recreated. It is executed within the same methods as the recovery,
+ * retrieveFrame() splits its timeout to check for a stall while waiting.
+ * Only the time in which a frame is awaited counts, so a slow consumer is not taken for
+ * a stalled camera.
  */
 class CamUsb : public CamInterface {
 
  public: // STATICS
     static const uint32_t CAM_ID = 0;
+    static const uint32_t DEFAULT_MAX_OUTAGE_MS = 5000;
+    static const uint32_t DEFAULT_STALL_INTERVALS = 5;
+    static const int32_t MIN_STALL_TIME_MS = 100;
 
  public: // CAM USB
     CamUsb(std::string const& device);
@@ -125,6 +184,14 @@ class CamUsb : public CamInterface {
      */
     virtual bool isFrameAvailable();
 
+    /**
+     * Executes the hotplug recovery and the stall watchdog without retrieving a frame.
+     * Has to be called periodically (e.g. every MIN_STALL_TIME_MS) by the thread 
+     * controlling the camera if the frames are received with a frame callback.
+     * \return false if the camera is not available at the moment.
+     */
+    bool checkCamera();
+
     /**
      * Skips the current image if available.
      * \return true if an image has been skipped.
@@ -277,6 +344,22 @@ class CamUsb : public CamInterface {
         return true;
     }
 
+    /**
+     * In GStreamer mode the callback is called within the streaming thread as soon as
+     * a frame has been received. The frame is only valid during the call
+     * and will be reused for the next one, copy it if it is required afterwards.
+     * A frame passed to the callback can not be received with retrieveFrame() anymore.
+     * In V4L2 (single frame) mode there is no capture thread, the frames have to be
+     * requested with retrieveFrame().
+     * Pass NULL to unregister the callback, afterwards the callback will not be called anymore.
+     * A callback set with setCallbackFcn() is called as well, before this one.
+     * Only one frame callback runs at a time. It is called without any lock held, so it may
+     * call the methods of CamUsb, including this one.
+     * Called from another thread this method waits until a running callback has returned.
+     */
+    void setFrameCallbackFcn(void (*pcallback_function)(const base::samples::frame::Frame& frame, void* p), 
+            void* p);
+
     virtual void synchronizeWithSystemTime(uint32_t time_interval)
     {
     throw std::runtime_error("This camerea does not support synchronizeWithSystemTime. "
@@ -303,9 +386,232 @@ class CamUsb : public CamInterface {
      */
     virtual int getFileDescriptor() const;
 
+    /**
+     * Returns an fd which can be added to an external select/poll/epoll loop.
+     * It is readable exactly if retrieveFrame() would return a frame without blocking,
+     * in GStreamer and in V4L2 (SingleFrame) mode. Do not read from it, it is reset by 
+     * retrieveFrame() and skipFrames(). The fd stays the same during mode changes and
+     * device recoveries and is closed in the destructor.
+     * In V4L2 mode the image buffer is kept queued from now on, so the returned frame
+     * can be up to one frame interval older than without the notification fd.
+     * Internally this is an epoll fd which watches an eventfd of the GStreamer
+     * part or the v4l2 device itself.
+     * \return -1 if an error occurred.
+     */
+    int getNotificationFd();
+
     inline enum CAM_USB_MODE getCamMode() {
         return mCamMode;
     }
+
+    /**
+     * Activates the detection of a removed and reconnected camera. The camera is 
+     * identified by its bus_info, so it is found again even if it gets another device node.
+     * Can be called before or after open().
+     * \param max_outage_ms If the camera is not back after this time
+     * HOTPLUG_RECOVERY_FAILED is reported. The recovery is still tried afterwards.
+     * \return false if the hotplug monitor could not be started.
+     */
+    bool setHotplugRecovery(bool enable, uint32_t max_outage_ms = DEFAULT_MAX_OUTAGE_MS);
+
+    /**
+     * The callback is called with HOTPLUG_DEVICE_REMOVED, HOTPLUG_DEVICE_RECOVERED
+     * or HOTPLUG_RECOVERY_FAILED, in the thread executing the recovery.
+     */
+    void setHotplugCallback(void (*pcallback_function)(const HotplugEvent& event, void* p), void* p) {
+        mpHotplugCallbackFunction = pcallback_function;
+        mpHotplugPassThroughPointer = p;
+    }
+
+    /**
+     * Activates the stall watchdog. A stall is detected if no frame has been 
+     * received for 'stall_intervals' frame intervals (at least MIN_STALL_TIME_MS).
+     * The first frame after grab() may take CamGst::DEFAULT_PIPELINE_TIMEOUT.
+     */
+    void setWatchdog(bool enable, uint32_t stall_intervals = DEFAULT_STALL_INTERVALS);
+
+    /**
+     * Many MJPEG cameras do not send Huffman tables. If activated, the standard tables
+     * are inserted into JPEG frames without tables while the comment blocks are removed,
+     * so the frames can be decoded by any JPEG decoder.
+     */
+    void setInsertJpegHuffmanTables(bool insert);
+
+    /**
+     * High resolutions at full frame rate are usually only available as MJPEG.
+     * If activated and MODE_RGB, MODE_GRAYSCALE or MODE_BGR is passed to setFrameSettings(),
+     * MJPEG is requested from the camera (if available) and decoded to the requested mode.
+     * Has to be called before setFrameSettings().
+     * \param scale_denominator 1, 2, 4 or 8, the frames are scaled to 1/scale_denominator
+     * of the image size while decoding (e.g. for previews). getFrameSettings() still returns 
+     * the image size of the camera.
+     * \return false if the scale is not supported.
+     */
+    bool setJpegDecoding(bool enable, uint32_t scale_denominator = 1);
+
+    /**
+     * Decoding of large MJPEG images may take longer than a frame interval.
+     * With more than one thread the images are decoded by a pool of worker threads
+     * and delivered in capture order. Only used in GStreamer mode, in V4L2 (SingleFrame) 
+     * mode the images are decoded within retrieveFrame().
+     * \param drop_stale If the pool falls behind, the oldest image which has not been
+     * decoded or retrieved yet is dropped. Otherwise the newest image is dropped.
+     * The frame callback is called by the worker threads as soon as the next frame
+     * in capture order has been decoded. Called within the frame callback, the replaced
+     * pool is only stopped by the next call outside of it or by the destructor.
+     */
+    void setJpegDecodeThreads(uint32_t thread_count, bool drop_stale = true);
+
+    /**
+     * For cameras without MJPEG support. If activated and MODE_JPEG is passed to 
+     * setFrameSettings(), YUYV or UYVY images are requested from the camera and encoded 
+     * to JPEG by a persistent encoder without a conversion to RGB.
+     * Has to be called before setFrameSettings().
+     * \param quality 0 to 100, in GStreamer mode passed to CamGst::createDefaultPipeline().
+     */
+    void setJpegEncoding(bool enable, uint32_t quality = CamGst::DEFAULT_JPEG_QUALITY);
+
+    /**
+     * Returns true if the current frame settings are realized by encoding raw images.
+     */
+    inline bool isJpegEncodingActive() const {
+        return mJpegEncodingActive;
+    }
+
+    /**
+     * JPEG frames (and MJPEG images which are decoded) are checked by reading their header
+     * only: The frame header has to be valid and the image has to end with EOI.
+     * The frame size is taken from the header. Frames of the decode pool can only be 
+     * rejected, not flagged. Default is JPEG_CHECK_FLAG.
+     */
+    inline void setJpegCheck(enum JPEG_CHECK check) {
+        mJpegCheck = check;
+    }
+
+    /**
+     * Queue of the GStreamer appsink, see CamGst::setSinkQueue(). By default only the 
+     * newest image is queued.
+     */
+    void setGstSinkQueue(uint32_t max_buffers, bool drop);
+
+    /**
+     * Leaky queue between the source and the conversion of the default pipeline, 
+     * see CamGst::setSourceQueue(). Disabled (0) by default.
+     */
+    void setGstSourceQueue(uint32_t max_buffers, 
+            enum CamGst::QUEUE_LEAK leak = CamGst::QUEUE_LEAK_DOWNSTREAM);
+
+    /**
+     * grab(MultiFrame, buffer_len) queues up to 'buffer_len' images which are returned 
+     * oldest first, 'policy' defines what happens if the queue is full 
+     * (see CamGst::setBufferQueue()). Continuously only keeps the newest image. 
+     * Default is CamGst::QUEUE_DROP_OLDEST, takes effect with the next grab().
+     */
+    inline void setGstQueuePolicy(enum CamGst::QUEUE_POLICY policy) {
+        mQueuePolicy = policy;
+    }
+
+    /**
+     * Uses the gst-launch 'description' instead of the default pipeline for 
+     * grab(MultiFrame/Continuously), see CamGst::createPipeline(). The pipeline has to 
+     * open the device of this object and its appsink 'sink_name' has to receive the format
+     * the default pipeline would request: JPEG if MJPEG decoding is active, UYVY if 
+     * JPEG encoding or output scaling is active, otherwise the frame mode and size 
+     * of setFrameSettings(). An empty description restores the default pipeline.
+     * Takes effect with the next grab().
+     */
+    inline void setGstPipeline(std::string const& description, 
+            std::string const& sink_name = "sink") {
+        mGstPipelineDescription = description;
+        mGstPipelineSinkName = sink_name;
+    }
+
+    /**
+     * Conversions of large raw images (e.g. 4K YUYV to RGB, see CamConfig::toV4L2ImageFormat())
+     * are split into row bands and processed by 'thread_count' threads, including the
+     * thread calling retrieveFrame(). Small images are always converted by a single thread.
+     * Used in V4L2 (SingleFrame) mode.
+     */
+    void setConversionThreads(uint32_t thread_count);
+
+    /**
+     * Reduces RGB, BGR and grayscale frames (e.g. for previews) by a box filter which is 
+     * applied while converting YUYV/UYVY images, so the full image is never written. 
+     * In V4L2 mode YUYV or UYVY is requested from the camera (see CamConfig::setOutputScale()),
+     * in GStreamer mode the pipeline delivers UYVY. Not used while MJPEG is decoded 
+     * (see the scale of setJpegDecoding()) or raw images are encoded.
+     * Has to be called before setFrameSettings(). getFrameSettings() still returns 
+     * the image size of the camera.
+     * \param denominator 1, 2 or 4, the frames are reduced to 1/denominator.
+     * \return false if the scale is not supported.
+     */
+    bool setOutputScale(uint32_t denominator);
+
+    /**
+     * Returns the scale the frames are currently reduced by, 1 if they are not.
+     */
+    inline uint32_t getActiveOutputScale() const {
+        return mOutputScaleActive;
+    }
+
+    /**
+     * Only the region of interest is copied (or converted) out of the capture buffer,
+     * so the bytes touched are proportional to the region and not to the image.
+     * Can be changed for each frame without a restart, also from within the frame callback.
+     * The region is clipped to the image, YUYV/UYVY images are only cut between macropixels.
+     * The origin of the delivered region (in pixels of the camera image) is stored in the 
+     * frame attributes "roi_x" and "roi_y", both are 0 for whole images.
+     * Not used for JPEG frames and while MJPEG is decoded or raw images are encoded, 
+     * in V4L2 mode neither for NV12 and YU12 images.
+     * \param width, height 0 delivers the whole image.
+     */
+    void setRegionOfInterest(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+    ImageRegion getRegionOfInterest();
+
+    /**
+     * Crops the sensor on the camera (V4L2 selection API or VIDIOC_S_CROP), so only this
+     * area is read out and transferred. A frame size passed to setFrameSettings() which is
+     * smaller than the crop is realized by binning or scaling on the chip, if the driver
+     * supports it. Applied immediately and again by each following setFrameSettings(), 
+     * the frame size (getFrameSettings()) is updated with the geometry chosen by the driver.
+     * Has to be called in V4L2 mode.
+     * \param width, height 0 resets the crop to the default rectangle of the driver.
+     * \return false if the camera does not support cropping.
+     */
+    bool setSensorCrop(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+    /**
+     * Returns the crop rectangle chosen by the driver, empty if the sensor is not cropped.
+     */
+    inline ImageRegion getSensorCrop() const {
+        return mSensorCropActive;
+    }
+
+    /**
+     * Returns true if the current frame settings are realized by decoding MJPEG images.
+     */
+    inline bool isJpegDecodingActive() const {
+        return mJpegDecodingActive;
+    }
+
+    CamUsbStatistics getStatistics();
+
+    void resetStatistics();
+
+    /**
+     * Time from starting the pipeline within grab(MultiFrame/Continuously) until the
+     * first image has been received. Null if none has been received yet or 
+     * if the GStreamer mode is not active.
+     */
+    base::Time getTimeToFirstFrame();
+
+    /**
+     * Waits until the first image after grab(MultiFrame/Continuously) has been received,
+     * so retrieveFrame() does not have to wait for the startup of the camera.
+     * \return False on timeout or if the GStreamer mode is not active.
+     */
+    bool waitForFirstFrame(int32_t timeout_ms);
     
     double calculateFPS() {
         if(act_grab_mode_ == Stop) {
@@ -316,8 +622,10 @@ class CamUsb : public CamInterface {
         double sec = stop_time_grabbing.tv_sec - mStartTimeGrabbing.tv_sec;
         if(sec == 0)
             return 0;
-        else
-            return mReceivedFrameCounter / sec;
+        pthread_mutex_lock(&mMutexStatistics);
+        int frames = mReceivedFrameCounter;
+        pthread_mutex_unlock(&mMutexStatistics);
+        return frames / sec;
     }
 
  private:
@@ -349,13 +657,299 @@ class CamUsb : public CamInterface {
     float mFps;
     int mBpp;
     timeval mStartTimeGrabbing;
-    int mReceivedFrameCounter;
+    int mReceivedFrameCounter; // Protected by mMutexStatistics.
     
-    // FD driven image receiving (?).
+    // Called within the GStreamer streaming thread for each new buffer.
     void (*mpCallbackFunction)(const void* p);
     void* mpPassThroughPointer;
+    void (*mpFrameCallbackFunction)(const base::samples::frame::Frame& frame, void* p);
+    void* mpFramePassThroughPointer;
+    pthread_mutex_t mMutexCallback;
+    pthread_cond_t mCondCallback; // Signalled when a frame callback has returned.
+    bool mCallbackRunning; // The frame callback is called without mMutexCallback held.
+    pthread_t mCallbackThread;
+    base::samples::frame::Frame mCallbackFrame; // Reused for each callback.
+    base::samples::frame::Frame mDecodedCallbackFrame; // Popped from the decode pool.
+    bool mDeliveringDecodedFrames; // By one of the workers, the others return immediately.
+
+    bool mInsertJpegHuffmanTables;
+
+    // MJPEG decoding, see setJpegDecoding().
+    bool mJpegDecoding;
+    bool mJpegDecodingActive;
+    JpegDecoder mJpegDecoder;
+    std::vector<uint8_t> mCaptureBuffer; // Image which has to be decoded or encoded.
+    JpegDecoder mCallbackJpegDecoder; // Used within the GStreamer streaming thread.
+    std::vector<uint8_t> mCallbackJpegBuffer;
+    JpegDecodePool* mDecodePool; // Protected by mMutexCallback.
+    // Replaced within the frame callback, which may run on one of their workers.
+    std::vector<JpegDecodePool*> mRetiredDecodePools;
+    uint32_t mDroppedFramesOffset; // Drop count of the pool at the last reset.
+
+    enum JPEG_CHECK mJpegCheck;
+
+    ConvertPool* mConvertPool; // NULL if conversions are single-threaded.
+
+    uint32_t mSinkMaxBuffers; // See setGstSinkQueue().
+    bool mSinkDrop;
+    uint32_t mSourceQueueMaxBuffers; // See setGstSourceQueue().
+    enum CamGst::QUEUE_LEAK mSourceQueueLeak;
+    enum CamGst::QUEUE_POLICY mQueuePolicy;
+    uint32_t mOverflowedFramesOffset; // Overflow count of mCamGst at the last reset.
+    std::string mGstPipelineDescription; // See setGstPipeline(), empty for the default one.
+    std::string mGstPipelineSinkName;
+
+    pthread_mutex_t mMutexRoi; // Read within the streaming thread.
+    ImageRegion mRoi;
+
+    // Cropping on the camera, see setSensorCrop().
+    bool mSensorCrop;
+    ImageRegion mSensorCropRequested;
+    ImageRegion mSensorCropActive;
+
+    // Downscaling while converting, see setOutputScale().
+    uint32_t mOutputScale;
+    uint32_t mOutputScaleActive;
+    PixelConvertFunction mScaleConverter; // From the UYVY images of the pipeline.
+
+    // Encoding of raw images, see setJpegEncoding().
+    bool mJpegEncoding;
+    bool mJpegEncodingActive;
+    uint32_t mJpegQuality;
+    uint32_t mRawPixelformat; // Of the camera (V4L2 mode), GStreamer delivers UYVY.
+    JpegEncoder mJpegEncoder;
+    JpegEncoder mCallbackJpegEncoder; // Used within the GStreamer streaming thread.
+
+    int mNotificationFd; // epoll fd, -1 until requested.
+    int mWatchedFd; // eventfd of CamGst or fd of CamConfig.
 
     void createAttrsCtrlMaps(CamConfig* cam_config);
+
+    /**
+     * Removes the fd of the current mode from the notification fd and adds 
+     * the fd of the new mode. V4L2 is only watched while the image requesting is active.
+     */
+    void updateNotificationFd();
+
+    /**
+     * Has to be called before the watched fd is closed.
+     */
+    void unwatchNotificationFd();
+
+    /**
+     * Sets size, mode, depth and the region attributes of 'frame', whose image
+     * has already been written. The image itself is not touched.
+     */
+    void initFrame(base::samples::frame::Frame& frame, 
+            ImageRegion const& region = ImageRegion());
+
+    /**
+     * Writes the requested crop (or the default rectangle) to the camera and 
+     * updates mSensorCropActive. Throws a std::runtime_error if the driver refuses it.
+     * \return false if cropping is not supported.
+     */
+    bool writeSensorCrop();
+
+    /**
+     * Returns true if the UYVY images of the pipeline are reduced by mScaleConverter.
+     */
+    inline bool isGstScalingActive() const {
+        return mCamMode == CAM_USB_GST && mScaleConverter != NULL;
+    }
+
+    /**
+     * Reduces the UYVY image of the pipeline (or only 'region' of it) to 'frame', 
+     * see setOutputScale().
+     */
+    bool scaleFrame(uint8_t const* data, size_t size, ImageRegion const& region, 
+            base::samples::frame::Frame& frame);
+
+    /**
+     * Copies the region of interest of a pipeline image to 'frame', reduced if
+     * isGstScalingActive(). 'region' is clipped to the image.
+     * \return false if 'region' is empty or can not be extracted, 'region' is empty then.
+     */
+    bool extractGstRegion(uint8_t const* data, size_t size, ImageRegion& region,
+            base::samples::frame::Frame& frame);
+
+    /**
+     * Registered as new buffer callback of CamGst, calls the user callbacks.
+     * \return true if the buffer has been passed to the frame callback.
+     */
+    bool callbackNewBuffer(uint8_t const* data, uint32_t size);
+
+    static bool callbackNewBufferStatic(uint8_t const* data, uint32_t size, void* p);
+
+    /**
+     * Passes 'frame' to the frame callback, if set. mMutexCallback has to be locked,
+     * it is released during the call.
+     * \return false if no frame callback has been set.
+     */
+    bool invokeFrameCallback(base::samples::frame::Frame const& frame);
+
+    /**
+     * Returns true if the calling thread is executing the frame callback.
+     * mMutexCallback has to be locked.
+     */
+    bool isFrameCallbackThread();
+
+    /**
+     * Increments the received frame counters.
+     */
+    void countFrame();
+
+    /**
+     * Increments one of the counters of mStatistics, e.g. &CamUsbStatistics::stalls.
+     */
+    void countEvent(uint32_t CamUsbStatistics::* counter);
+
+    /**
+     * Registered as done callback of the decode pool, passes the decoded frames
+     * to the frame callback in capture order.
+     */
+    void deliverDecodedFrames();
+
+    static void deliverDecodedFramesStatic(void* p);
+
+    /**
+     * Writes the control value and remembers it to be able
+     * to reapply it after a device reset.
+     */
+    void writeControlValue(uint32_t const id, int32_t value);
+
+    bool startHotplugMonitor();
+
+    /**
+     * Checks whether the camera has been removed or the pipeline reported an error.
+     * In this case the device is released and, as soon as the camera is back, reopened.
+     * \param timeout_ms Max. time to wait for a removed camera.
+     * \return true if the camera can be used.
+     */
+    bool checkHotplug(int32_t timeout_ms);
+
+    /**
+     * Releases GStreamer and v4l2, errors of the removed device are ignored.
+     */
+    void releaseDevice();
+
+    /**
+     * Reopens 'device', reapplies frame settings, fps and the written controls
+     * and restarts the last grab mode.
+     * Throws std::runtime_error if the device could not be reopened.
+     */
+    void recoverDevice(std::string const& device);
+
+    void reportHotplugEvent(enum HotplugEventType type, base::Time const& outage);
+
+    /**
+     * Returns true if the images are decoded by the decode pool.
+     */
+    inline bool isDecodePoolActive() const {
+        return mDecodePool != NULL && mJpegDecodingActive && mCamMode == CAM_USB_GST;
+    }
+
+    /**
+     * Returns the next frame of the decode pool.
+     * \param error Set to true if the pipeline is not running.
+     */
+    bool readDecodedFrame(base::samples::frame::Frame& frame, int32_t timeout_ms, bool* error);
+
+    /**
+     * Counts incomplete images, see setJpegCheck().
+     * \param info Has to be filled by Helpers::inspectJpeg() or Helpers::normalizeJpeg().
+     * \return false if the image has to be dropped.
+     */
+    bool checkJpeg(JpegHeaderInfo const& info);
+
+    /**
+     * Takes the size of JPEG frames from the header and flags incomplete images.
+     * Has to be called after the status of the frame has been set.
+     */
+    void applyJpegHeader(JpegHeaderInfo const& info, base::samples::frame::Frame& frame);
+
+    /**
+     * Encodes the raw image to 'frame' using the pixelformat of the current camera mode.
+     */
+    bool encodeFrame(JpegEncoder& encoder, uint8_t const* data, size_t size, 
+            base::samples::frame::Frame& frame);
+
+    /**
+     * The Huffman tables are inserted if requested or required by the decoder.
+     */
+    void updateJpegNormalization();
+
+    /**
+     * Starts the default pipeline (or the one of setGstPipeline()) using the current 
+     * frame settings. A pipeline kept in READY by grab(Stop) is only restarted if it 
+     * has been created with the same settings.
+     * \param recreate Always creates a new pipeline, e.g. to recover a stalled stream.
+     */
+    bool startDefaultPipeline(bool recreate = false);
+
+    /**
+     * Copies the next image to 'buffer' using v4l2 or GStreamer.
+     * \param error Set to true if the image could not be requested because of an error
+     * (in contrast to a timeout).
+     * \param region If set only this part is copied, see CamConfig::getBuffer().
+     * \param info If set, receives the header of a JPEG image, read while copying.
+     */
+    bool readBuffer(std::vector<uint8_t>& buffer, int32_t timeout_ms, bool* error,
+            ImageRegion* region = NULL, JpegHeaderInfo* info = NULL);
+
+    int32_t getStallTimeMs();
+
+    /**
+     * Executes the next watchdog step if no frame has been received within the stall time.
+     * Only the time in which a frame has been requested counts, a received but not yet
+     * retrieved frame (see isFramePending()) suspends the check.
+     * \return true if a watchdog step has been executed.
+     */
+    bool checkStall();
+
+    /**
+     * Warns on grab() if recovery or watchdog are active while the frames are 
+     * received with a frame callback, see checkCamera().
+     */
+    void warnIfNotChecked();
+
+    /**
+     * Marks that the consumer waits for a frame. The stall time starts now unless
+     * a frame has already been requested and not delivered since.
+     */
+    void requestFrame();
+
+    /**
+     * True if a received frame waits to be retrieved (decode pool, GStreamer queue or
+     * a filled v4l2 buffer).
+     */
+    bool isFramePending();
+
+    void executeWatchdogStep(enum WATCHDOG_STEP step);
+
+    // Hotplug recovery.
+    bool mHotplugEnabled;
+    CamHotplug* mHotplug;
+    uint32_t mMaxOutageMs;
+    uint32_t mRemovalCount;
+    bool mDeviceLost;
+    bool mRecoveryFailureReported;
+    base::Time mDeviceLostTime;
+    int mBufferLen;
+    bool mFpsWritten;
+    std::map<uint32_t, int32_t> mWrittenControls; // Reapplied after a device reset.
+    void (*mpHotplugCallbackFunction)(const HotplugEvent& event, void* p);
+    void* mpHotplugPassThroughPointer;
+
+    // Stall watchdog.
+    bool mWatchdogEnabled;
+    uint32_t mStallIntervals;
+    enum WATCHDOG_STEP mWatchdogStep;
+    base::Time mLastFrameTime; // Or the time of the last watchdog step or frame request.
+    bool mFrameRequested; // Requested by retrieveFrame() or isFrameAvailable() and not delivered.
+
+    // Written by the streaming thread and the decode pool as well.
+    pthread_mutex_t mMutexStatistics;
+    CamUsbStatistics mStatistics;
 };
 
 } // end namespace camera
@@ -15,12 +15,79 @@
 #define _CAM_V4L2_HELPERS_H_
 
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <base/samples/Frame.hpp>
 
 namespace camera 
 {
 
+/**
+ * Huffman tables of the JPEG standard (ITU T.81, Annex K.3) as a single DHT segment.
+ * MJPEG cameras which do not send any tables expect these (AVI1 / USB video class).
+ */
+static const uint8_t JPEG_STANDARD_DHT[] = {
+        0xFF, 0xC4, 0x01, 0xA2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+        0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x10, 0x00, 0x02,
+        0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00,
+        0x01, 0x7D, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31,
+        0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+        0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33,
+        0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26,
+        0x27, 0x28, 0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43,
+        0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57,
+        0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73,
+        0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+        0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+        0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+        0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+        0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2,
+        0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0x01, 0x00, 0x03, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+        0x0B, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05,
+        0x04, 0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04,
+        0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+        0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33,
+        0x52, 0xF0, 0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25,
+        0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x35, 0x36,
+        0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
+        0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66,
+        0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A,
+        0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x92, 0x93, 0x94,
+        0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+        0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
+        0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+        0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7,
+        0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA };
+
+/**
+ * Image properties read from the JPEG header, see Helpers::inspectJpeg().
+ */
+struct JpegHeaderInfo {
+    JpegHeaderInfo() : width(0), height(0), components(0), progressive(false),
+            sof_found(false), sos_found(false), eoi_found(false) {}
+
+    /**
+     * True if the header describes an image, the scan starts and the image ends with EOI.
+     * A truncated transfer lacks the EOI marker.
+     */
+    bool isComplete() const {
+        return sof_found && sos_found && eoi_found && width > 0 && height > 0;
+    }
+
+    uint16_t width;
+    uint16_t height;
+    uint8_t components; // 1 (grayscale) or 3 (YCbCr)
+    bool progressive; // SOF2
+    bool sof_found; // SOF0, SOF1 or SOF2
+    bool sos_found;
+    bool eoi_found;
+};
+
 class Helpers {
  public:
     /**
@@ -43,32 +110,144 @@ class Helpers {
 
     }
 
+    /**
+     * Sets size, mode and depth of a frame whose image has already been written, 
+     * e.g. a JPEG whose size is only known after encoding. Frame::init() would reset 
+     * the image and clear attributes, status and time, so it can only be used before writing.
+     */
+    static void setFrameFormat(base::samples::frame::Frame& frame, uint16_t width, 
+            uint16_t height, uint8_t depth, base::samples::frame::frame_mode_t mode) {
+        frame.frame_mode = mode;
+        frame.size = base::samples::frame::frame_size_t(width, height);
+        frame.setDataDepth(depth); // Also sets the pixel and row size.
+    }
+
     /**
      * Someone (OpenCV?) does not understand JPEG comment-blocks.
      * Removes comment block to avoid getting 
      * 'Corrupt JPEG data: x extraneous bytes before marker 0xe0.'
+     * Works in place, prefer copyJpegWithoutComments() if the image has to be copied anyway.
      */
     static void removeJpegCommentBlock( base::samples::frame::Frame& frame) {
 
-        if(frame.getFrameMode() == base::samples::frame::MODE_JPEG) {
-            std::vector<uint8_t>::iterator it = frame.image.begin();
-            std::vector<uint8_t>::iterator it_n = frame.image.begin() + 1;
-            for(; it_n != frame.image.end(); it++, it_n++) {
-                if(*it == 0xFF && *it_n == 0xFE) {
-                    size_t old_length = *(it+2)<<8 | *(it_n+2);
-                    // e.g. empty comment block: FF FE 00 02 XX
-                    //                           it          it+4
-                    frame.image.erase(it, it + (2 + old_length)); 
+        if(frame.getFrameMode() == base::samples::frame::MODE_JPEG && !frame.image.empty()) {
+            frame.image.resize(copyJpegWithoutComments(&frame.image[0], frame.image.size(), 
+                    &frame.image[0]));
+        }
+    } 
+
+    /**
+     * Copies a JPEG image without the comment segments (COM) in front of the start of scan.
+     * See normalizeJpeg().
+     */
+    static size_t copyJpegWithoutComments(uint8_t const* src, size_t size, uint8_t* dst) {
+        return normalizeJpeg(src, size, dst, false);
+    }
+
+    static void copyJpegWithoutComments(uint8_t const* src, size_t size, std::vector<uint8_t>& dst) {
+        normalizeJpeg(src, size, dst, false);
+    }
+
+    /**
+     * Copies a JPEG image without the comment segments (COM) in front of the start of scan
+     * and optionally inserts the standard Huffman tables if the image does not contain any.
+     * The segments are skipped using their length fields, so the header is not
+     * scanned byte by byte and the comments are never copied. If the data does not start
+     * with SOI or a segment length exceeds the data, the remaining bytes are copied unchanged.
+     * \param dst Has to provide 'size' bytes (plus sizeof(JPEG_STANDARD_DHT) if 'insert_dht'
+     * is set). May be equal to 'src' if 'insert_dht' is not set. If NULL nothing is 
+     * copied, only 'info' is collected.
+     * \param insert_dht Inserts JPEG_STANDARD_DHT in front of the start of scan if
+     * no DHT segment has been found.
+     * \param info If passed, the header information is collected within the same walk.
+     * \return Number of bytes written to 'dst'.
+     */
+    static size_t normalizeJpeg(uint8_t const* src, size_t size, uint8_t* dst, bool insert_dht,
+            JpegHeaderInfo* info = NULL) {
+        assert(!insert_dht || src != dst);
+        if(info != NULL) {
+            *info = JpegHeaderInfo();
+        }
+        size_t pos = 0;
+        size_t written = 0;
+
+        if(size >= 2 && src[0] == 0xFF && src[1] == 0xD8) { // SOI
+            copyBytes(src, &pos, 2, dst, &written);
+            bool dht_found = false;
+
+            // Each marker is at least followed by a two byte length or another marker.
+            while(pos + 4 <= size && src[pos] == 0xFF) {
+                uint8_t marker = src[pos+1];
+                if(marker == 0xFF) { // Fill byte.
+                    copyBytes(src, &pos, 1, dst, &written);
+                    continue;
+                }
+                if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { // TEM, RSTn
+                    copyBytes(src, &pos, 2, dst, &written);
+                    continue;
+                }
+                if(marker == 0xDA) { // SOS: Insert the tables and copy the rest.
+                    if(info != NULL) {
+                        info->sos_found = true;
+                    }
+                    if(dst != NULL && insert_dht && !dht_found) {
+                        memcpy(dst + written, JPEG_STANDARD_DHT, sizeof(JPEG_STANDARD_DHT));
+                        written += sizeof(JPEG_STANDARD_DHT);
+                    }
+                    break;
+                }
+                if(marker == 0xD9) { // EOI
                     break;
                 }
-                
-                // Start of scan, no comment block found.
-                if(*it == 0xFF && *it_n == 0XDA) {
+                size_t segment_length = 2 + (src[pos+2] << 8 | src[pos+3]);
+                if(segment_length < 4 || pos + segment_length > size) {
+                    LOG_DEBUG("Invalid length of JPEG segment 0x%X", marker);
                     break;
                 }
+                if(info != NULL && marker >= 0xC0 && marker <= 0xC2) { // SOF0, SOF1, SOF2
+                    readFrameHeader(src + pos, segment_length, info);
+                    info->progressive = marker == 0xC2;
+                }
+                if(marker == 0xFE) { // COM
+                    pos += segment_length;
+                } else {
+                    dht_found |= marker == 0xC4;
+                    copyBytes(src, &pos, segment_length, dst, &written);
+                }
             }
         }
-    } 
+
+        if(info != NULL && info->sos_found) {
+            info->eoi_found = endsWithEoi(src, size);
+        }
+        copyBytes(src, &pos, size - pos, dst, &written);
+        return written;
+    }
+
+    /**
+     * See normalizeJpeg() above, 'dst' is resized. It keeps its capacity,
+     * so usually nothing is reallocated.
+     */
+    static void normalizeJpeg(uint8_t const* src, size_t size, std::vector<uint8_t>& dst, 
+            bool insert_dht, JpegHeaderInfo* info = NULL) {
+        dst.resize(size + (insert_dht ? sizeof(JPEG_STANDARD_DHT) : 0));
+        if(!dst.empty()) {
+            dst.resize(normalizeJpeg(src, size, &dst[0], insert_dht, info));
+        } else if(info != NULL) {
+            *info = JpegHeaderInfo();
+        }
+    }
+
+    /**
+     * Reads the image size and the number of components from the frame header (SOF0 to SOF2)
+     * and checks whether the image ends with EOI. Only the segments in front of the start 
+     * of scan and the end of the data are read, the entropy-coded data is skipped.
+     * \return info.isComplete()
+     */
+    static bool inspectJpeg(uint8_t const* data, size_t size, JpegHeaderInfo* info) {
+        normalizeJpeg(data, size, NULL, false, info);
+        return info->isComplete();
+    }
     
     static bool storeImageToFile(std::vector<uint8_t> const& buffer, std::string const& file_name) {
         LOG_DEBUG("storeImageToFile, buffer contains %d bytes, stores to %s", 
@@ -165,6 +344,50 @@ class Helpers {
     }
 
  private:
+    /**
+     * Copies 'len' bytes from src + *pos to dst + *written and moves both positions.
+     * Used in place as well, so the ranges may overlap.
+     */
+    static inline void copyBytes(uint8_t const* src, size_t* pos, size_t len, 
+            uint8_t* dst, size_t* written) {
+        if(len > 0 && dst != NULL && dst + *written != src + *pos) {
+            memmove(dst + *written, src + *pos, len);
+        }
+        *pos += len;
+        *written += len;
+    }
+
+    /**
+     * Parses the SOFn segment starting with its marker. The length of the segment
+     * has to match the number of components.
+     */
+    static void readFrameHeader(uint8_t const* segment, size_t segment_length, 
+            JpegHeaderInfo* info) {
+        // Marker, length, precision, height, width, components, 3 bytes per component.
+        if(segment_length < 10) {
+            return;
+        }
+        uint8_t components = segment[9];
+        if(components == 0 || segment_length != 10 + 3 * (size_t)components) {
+            LOG_DEBUG("Invalid JPEG frame header with %d components", components);
+            return;
+        }
+        info->height = segment[5] << 8 | segment[6];
+        info->width = segment[7] << 8 | segment[8];
+        info->components = components;
+        info->sof_found = true;
+    }
+
+    /**
+     * Some cameras pad the image with zeros after EOI.
+     */
+    static bool endsWithEoi(uint8_t const* data, size_t size) {
+        while(size > 2 && data[size-1] == 0x00) {
+            size--;
+        }
+        return size >= 2 && data[size-2] == 0xFF && data[size-1] == 0xD9;
+    }
+
     int lookup_v2r[256];
     int lookup_uv2g[256][256];
     int lookup_u2b[256];
@@ -0,0 +1,747 @@
+/*
+ * \file    pixel_converter.h
+ *
+ * \brief   Pixel format conversions specialized at compile time.
+ *
+ * \details A converter is selected by the v4l2 fourcc of the source, the frame mode
+ *          of the destination, the color matrix and the range. Source, destination and
+ *          coefficients are template parameters, so each pair gets its own loop without
+ *          any format dependent branches per pixel. Adding a format means adding a
+ *          PixelSource or PixelWriter specialization.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _PIXEL_CONVERTER_H_
+#define _PIXEL_CONVERTER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PIXEL_CONVERTER_NEON
+#endif
+
+#include <base-logging/Logging.hpp>
+#include <base/samples/Frame.hpp>
+
+#include "cam_convert_pool.h"
+
+namespace camera
+{
+
+enum ColorMatrix {
+    COLOR_MATRIX_BT601, // SD, used by most USB cameras.
+    COLOR_MATRIX_BT709  // HD
+};
+
+enum ColorRange {
+    COLOR_RANGE_LIMITED, // Y [16,235], UV [16,240]
+    COLOR_RANGE_FULL     // [0,255], e.g. JPEG
+};
+
+/**
+ * YCbCr to RGB coefficients in 16 bit fixed point:
+ * R = Y_SCALE * (Y - Y_OFFSET) + V_R * (V - 128)
+ * G = Y_SCALE * (Y - Y_OFFSET) - U_G * (U - 128) - V_G * (V - 128)
+ * B = Y_SCALE * (Y - Y_OFFSET) + U_B * (U - 128)
+ */
+template<enum ColorMatrix M, enum ColorRange R> struct YuvCoefficients;
+
+template<> struct YuvCoefficients<COLOR_MATRIX_BT601, COLOR_RANGE_LIMITED> {
+    enum { Y_OFFSET = 16, Y_SCALE = 76309, V_R = 104597, U_G = 25675, V_G = 53279, U_B = 132201 };
+};
+
+template<> struct YuvCoefficients<COLOR_MATRIX_BT601, COLOR_RANGE_FULL> {
+    enum { Y_OFFSET = 0, Y_SCALE = 65536, V_R = 91881, U_G = 22553, V_G = 46802, U_B = 116130 };
+};
+
+template<> struct YuvCoefficients<COLOR_MATRIX_BT709, COLOR_RANGE_LIMITED> {
+    enum { Y_OFFSET = 16, Y_SCALE = 76309, V_R = 117489, U_G = 13975, V_G = 34925, U_B = 138438 };
+};
+
+template<> struct YuvCoefficients<COLOR_MATRIX_BT709, COLOR_RANGE_FULL> {
+    enum { Y_OFFSET = 0, Y_SCALE = 65536, V_R = 103206, U_G = 12276, V_G = 30679, U_B = 121609 };
+};
+
+namespace pixel
+{
+
+inline uint8_t clip(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/**
+ * Converts two pixels sharing their chroma to RGB, 'R', 'G' and 'B' are the byte offsets.
+ */
+template<class C, int R, int G, int B, int BYTES_PER_PIXEL>
+inline void writeRgbPair(uint8_t* dst, int y0, int y1, int u, int v) {
+    u -= 128;
+    v -= 128;
+    const int r = C::V_R * v + (1 << 15); // Rounding
+    const int g = -C::U_G * u - C::V_G * v + (1 << 15);
+    const int b = C::U_B * u + (1 << 15);
+    y0 = (y0 - C::Y_OFFSET) * C::Y_SCALE;
+    y1 = (y1 - C::Y_OFFSET) * C::Y_SCALE;
+    dst[R] = clip((y0 + r) >> 16);
+    dst[G] = clip((y0 + g) >> 16);
+    dst[B] = clip((y0 + b) >> 16);
+    dst[BYTES_PER_PIXEL + R] = clip((y1 + r) >> 16);
+    dst[BYTES_PER_PIXEL + G] = clip((y1 + g) >> 16);
+    dst[BYTES_PER_PIXEL + B] = clip((y1 + b) >> 16);
+}
+
+/**
+ * Writes two pixels sharing their chroma in the frame mode 'Mode'.
+ */
+template<base::samples::frame::frame_mode_t Mode, class C> struct PixelWriter;
+
+template<class C> struct PixelWriter<base::samples::frame::MODE_RGB, C> {
+    enum { BYTES_PER_PIXEL = 3 };
+    static inline void write(uint8_t* dst, int y0, int y1, int u, int v) {
+        writeRgbPair<C, 0, 1, 2, BYTES_PER_PIXEL>(dst, y0, y1, u, v);
+    }
+};
+
+template<class C> struct PixelWriter<base::samples::frame::MODE_BGR, C> {
+    enum { BYTES_PER_PIXEL = 3 };
+    static inline void write(uint8_t* dst, int y0, int y1, int u, int v) {
+        writeRgbPair<C, 2, 1, 0, BYTES_PER_PIXEL>(dst, y0, y1, u, v);
+    }
+};
+
+template<class C> struct PixelWriter<base::samples::frame::MODE_GRAYSCALE, C> {
+    enum { BYTES_PER_PIXEL = 1 };
+    static inline void write(uint8_t* dst, int y0, int y1, int, int) {
+        if(C::Y_OFFSET == 0 && C::Y_SCALE == 65536) { // Resolved at compile time.
+            dst[0] = y0;
+            dst[1] = y1;
+        } else {
+            dst[0] = clip(((y0 - C::Y_OFFSET) * C::Y_SCALE + (1 << 15)) >> 16);
+            dst[1] = clip(((y1 - C::Y_OFFSET) * C::Y_SCALE + (1 << 15)) >> 16);
+        }
+    }
+};
+
+// Only reorders the bytes, independent of matrix and range.
+template<class C> struct PixelWriter<base::samples::frame::MODE_UYVY, C> {
+    enum { BYTES_PER_PIXEL = 2 };
+    static inline void write(uint8_t* dst, int y0, int y1, int u, int v) {
+        dst[0] = u;
+        dst[1] = y0;
+        dst[2] = v;
+        dst[3] = y1;
+    }
+};
+
+/**
+ * Reads the rows of the v4l2 format 'Fourcc' and passes pixel pairs to a PixelWriter.
+ * 'stride' is the number of bytes per row of the first plane (bytesperline).
+ */
+template<uint32_t Fourcc> struct PixelSource;
+
+/**
+ * Packed 4:2:2, the template parameters are the byte offsets within a macropixel.
+ */
+template<int Y0, int U, int Y1, int V> struct Packed422Source {
+    static uint32_t getMinStride(uint32_t width) {
+        return width * 2;
+    }
+
+    // The last row does not have to be padded, e.g. within a region of a larger image.
+    static size_t getSize(uint32_t width, uint32_t stride, uint32_t height) {
+        return (size_t)stride * (height - 1) + getMinStride(width);
+    }
+
+    template<class W>
+    static void convertRows(uint8_t const* src, uint32_t stride, uint32_t width, uint32_t height,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        dst += (size_t)first_row * width * W::BYTES_PER_PIXEL;
+        for(uint32_t y = first_row; y < end_row; ++y) {
+            uint8_t const* s = src + (size_t)y * stride;
+            for(uint32_t x = 0; x < width; x += 2, s += 4, dst += 2 * W::BYTES_PER_PIXEL) {
+                W::write(dst, s[Y0], s[Y1], s[U], s[V]);
+            }
+        }
+    }
+
+    /**
+     * Box filter: Each output pixel is the mean of S x S source pixels, so only the
+     * reduced image is written. Each pair of output pixels covers S macropixels per row,
+     * their chroma is the mean of all of them. [first_row, end_row) are output rows.
+     */
+    template<class W, int S>
+    static void convertRowsScaled(uint8_t const* src, uint32_t stride, uint32_t width,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        const int SHIFT = S == 2 ? 2 : 4; // log2(S * S)
+        const int ROUND = (S * S) / 2;
+        uint32_t pairs = width / (2 * S);
+        dst += (size_t)first_row * pairs * 2 * W::BYTES_PER_PIXEL;
+        for(uint32_t y = first_row; y < end_row; ++y) {
+            uint8_t const* rows = src + (size_t)y * S * stride;
+            for(uint32_t p = 0; p < pairs; ++p, dst += 2 * W::BYTES_PER_PIXEL) {
+                int y0 = ROUND, y1 = ROUND, u = ROUND, v = ROUND;
+                for(int r = 0; r < S; ++r) {
+                    uint8_t const* s = rows + (size_t)r * stride + p * 4 * S;
+                    for(int m = 0; m < S; ++m, s += 4) {
+                        // The first half of the macropixels belongs to the first output pixel.
+                        if(m < S / 2) {
+                            y0 += s[Y0] + s[Y1];
+                        } else {
+                            y1 += s[Y0] + s[Y1];
+                        }
+                        u += s[U];
+                        v += s[V];
+                    }
+                }
+                W::write(dst, y0 >> SHIFT, y1 >> SHIFT, u >> SHIFT, v >> SHIFT);
+            }
+        }
+    }
+};
+
+template<> struct PixelSource<V4L2_PIX_FMT_YUYV> : Packed422Source<0, 1, 2, 3> {
+    enum { EVEN_WIDTH = true };
+};
+
+template<> struct PixelSource<V4L2_PIX_FMT_UYVY> : Packed422Source<1, 0, 3, 2> {
+    enum { EVEN_WIDTH = true };
+};
+
+/**
+ * Planar 4:2:0, full Y plane followed by the chroma of each 2x2 block.
+ * \tparam INTERLEAVED_UV NV12 (one plane UVUV...) or YU12 (U plane, V plane).
+ */
+template<bool INTERLEAVED_UV> struct Planar420Source {
+    static uint32_t getMinStride(uint32_t width) {
+        return width;
+    }
+
+    static size_t getSize(uint32_t /*width*/, uint32_t stride, uint32_t height) {
+        return (size_t)stride * height + (size_t)stride * ((height + 1) / 2);
+    }
+
+    template<class W>
+    static void convertRows(uint8_t const* src, uint32_t stride, uint32_t width, uint32_t height,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        uint8_t const* chroma = src + (size_t)stride * height;
+        // YU12: each chroma plane has half the stride and half the height.
+        uint32_t chroma_stride = INTERLEAVED_UV ? stride : stride / 2;
+        size_t v_offset = INTERLEAVED_UV ? 1 : (size_t)chroma_stride * ((height + 1) / 2);
+        dst += (size_t)first_row * width * W::BYTES_PER_PIXEL;
+        for(uint32_t y = first_row; y < end_row; ++y) {
+            uint8_t const* s = src + (size_t)y * stride;
+            uint8_t const* c = chroma + (size_t)(y / 2) * chroma_stride;
+            for(uint32_t x = 0; x < width; x += 2, s += 2, dst += 2 * W::BYTES_PER_PIXEL) {
+                W::write(dst, s[0], s[1], c[0], c[v_offset]);
+                c += INTERLEAVED_UV ? 2 : 1;
+            }
+        }
+    }
+};
+
+template<> struct PixelSource<V4L2_PIX_FMT_NV12> : Planar420Source<true> {
+    enum { EVEN_WIDTH = true };
+};
+
+template<> struct PixelSource<V4L2_PIX_FMT_YUV420> : Planar420Source<false> {
+    enum { EVEN_WIDTH = true };
+};
+
+/**
+ * 8 bit grayscale, passed as luma with neutral chroma.
+ */
+template<> struct PixelSource<V4L2_PIX_FMT_GREY> {
+    enum { EVEN_WIDTH = false };
+
+    static uint32_t getMinStride(uint32_t width) {
+        return width;
+    }
+
+    static size_t getSize(uint32_t width, uint32_t stride, uint32_t height) {
+        return (size_t)stride * (height - 1) + width;
+    }
+
+    template<class W>
+    static void convertRows(uint8_t const* src, uint32_t stride, uint32_t width, uint32_t height,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        dst += (size_t)first_row * width * W::BYTES_PER_PIXEL;
+        for(uint32_t y = first_row; y < end_row; ++y) {
+            uint8_t const* s = src + (size_t)y * stride;
+            uint32_t x = 0;
+            for(; x + 1 < width; x += 2, s += 2, dst += 2 * W::BYTES_PER_PIXEL) {
+                W::write(dst, s[0], s[1], 128, 128);
+            }
+            if(x < width) { // Odd width
+                uint8_t pair[2 * W::BYTES_PER_PIXEL];
+                W::write(pair, s[0], s[0], 128, 128);
+                memcpy(dst, pair, W::BYTES_PER_PIXEL);
+                dst += W::BYTES_PER_PIXEL;
+            }
+        }
+    }
+};
+
+/**
+ * Copies the Y bytes of packed 4:2:2 rows, 'Y0' is the offset of the first Y (0 for YUYV,
+ * 1 for UYVY). 16 pixels per step using SSE2 or NEON, scalar otherwise and for the rest.
+ */
+template<int Y0>
+inline void extractLuma422(uint8_t const* src, uint8_t* dst, uint32_t width) {
+    uint32_t x = 0;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    for(; x + 16 <= width; x += 16, src += 32, dst += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const*)src);
+        __m128i b = _mm_loadu_si128((__m128i const*)(src + 16));
+        // Moves the Y bytes into the lower byte of each 16 bit lane, then packs the lanes.
+        if(Y0 == 0) {
+            a = _mm_and_si128(a, mask);
+            b = _mm_and_si128(b, mask);
+        } else {
+            a = _mm_srli_epi16(a, 8);
+            b = _mm_srli_epi16(b, 8);
+        }
+        _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(a, b));
+    }
+#elif defined(PIXEL_CONVERTER_NEON)
+    for(; x + 16 <= width; x += 16, src += 32, dst += 16) {
+        // Deinterleaves even and odd bytes.
+        uint8x16x2_t pixels = vld2q_u8(src);
+        vst1q_u8(dst, pixels.val[Y0]);
+    }
+#endif
+    for(; x < width; ++x, src += 2, ++dst) {
+        *dst = src[Y0];
+    }
+}
+
+/**
+ * Grayscale output of YUV sources: The Y channel is copied unchanged,
+ * no colorspace conversion and no range expansion.
+ */
+template<uint32_t Fourcc> struct LumaSource;
+
+template<> struct LumaSource<V4L2_PIX_FMT_YUYV> {
+    static void copyRow(uint8_t const* src, uint8_t* dst, uint32_t width) {
+        extractLuma422<0>(src, dst, width);
+    }
+};
+
+template<> struct LumaSource<V4L2_PIX_FMT_UYVY> {
+    static void copyRow(uint8_t const* src, uint8_t* dst, uint32_t width) {
+        extractLuma422<1>(src, dst, width);
+    }
+};
+
+// Planar formats start with the Y plane.
+template<> struct LumaSource<V4L2_PIX_FMT_NV12> {
+    static void copyRow(uint8_t const* src, uint8_t* dst, uint32_t width) {
+        memcpy(dst, src, width);
+    }
+};
+
+template<> struct LumaSource<V4L2_PIX_FMT_YUV420> : LumaSource<V4L2_PIX_FMT_NV12> {};
+
+/**
+ * Passes the image to Converter::convertRows() within the band function of a ConvertPool.
+ */
+template<class Converter> struct BandJob {
+    uint8_t const* src;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint8_t* dst;
+
+    static void process(void* context, uint32_t first_row, uint32_t end_row) {
+        BandJob* job = (BandJob*)context;
+        Converter::convertRows(job->src, job->width, job->height, job->stride,
+                first_row, end_row, job->dst);
+    }
+};
+
+/**
+ * Checks the parameters, resizes 'dst' and converts the image, on the pool if passed.
+ */
+template<class Converter>
+bool convertImage(uint8_t const* src, size_t size, uint32_t width, uint32_t height,
+        uint32_t stride, std::vector<uint8_t>& dst, ConvertPool* pool) {
+    typedef typename Converter::Source Source;
+    const uint32_t scale = Converter::SCALE;
+    if(stride == 0) {
+        stride = Source::getMinStride(width);
+    }
+    // Downscaled 4:2:2 images are written in pairs of pixels.
+    uint32_t width_multiple = (Source::EVEN_WIDTH || scale > 1) ? 2 * scale : 1;
+    if(width == 0 || height < scale || width % width_multiple != 0 ||
+            stride < Source::getMinStride(width) || size < Source::getSize(width, stride, height)) {
+        LOG_ERROR("Image of %d bytes can not be converted (%dx%d, stride %d, scale 1/%d)",
+                (int)size, width, height, stride, scale);
+        return false;
+    }
+    dst.resize(Converter::getDestinationSize(width, height));
+    // Rows of the destination.
+    uint32_t rows = height / scale;
+    if(pool == NULL) {
+        Converter::convertRows(src, width, height, stride, 0, rows, &dst[0]);
+        return true;
+    }
+    BandJob<Converter> job = {src, width, height, stride, &dst[0]};
+    size_t row_bytes = (size_t)stride * scale + Converter::getDestinationSize(width, scale);
+    pool->run(BandJob<Converter>::process, &job, rows, row_bytes);
+    return true;
+}
+
+} // end namespace pixel
+
+/**
+ * Extracts the Y channel of YUYV, UYVY, NV12 or YU12 images to MODE_GRAYSCALE frames.
+ * Same interface as PixelConverter.
+ */
+template<uint32_t Fourcc>
+struct LumaExtractor {
+    typedef pixel::PixelSource<Fourcc> Source;
+    enum { SCALE = 1 };
+
+    static size_t getDestinationSize(uint32_t width, uint32_t height) {
+        return (size_t)width * height;
+    }
+
+    static bool convert(uint8_t const* src, size_t size, uint32_t width, uint32_t height,
+            uint32_t stride, std::vector<uint8_t>& dst, ConvertPool* pool = NULL) {
+        return pixel::convertImage<LumaExtractor>(src, size, width, height, stride, dst, pool);
+    }
+
+    static void convertRows(uint8_t const* src, uint32_t width, uint32_t height, uint32_t stride,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        for(uint32_t y = first_row; y < end_row; ++y) {
+            pixel::LumaSource<Fourcc>::copyRow(src + (size_t)y * stride, dst + (size_t)y * width, width);
+        }
+    }
+};
+
+/**
+ * Converts images of the v4l2 format 'Fourcc' to frames of mode 'Mode'.
+ * E.g. PixelConverter<V4L2_PIX_FMT_YUYV, MODE_RGB>::convert(...).
+ */
+template<uint32_t Fourcc, base::samples::frame::frame_mode_t Mode,
+        enum ColorMatrix M = COLOR_MATRIX_BT601, enum ColorRange R = COLOR_RANGE_LIMITED>
+struct PixelConverter {
+    typedef pixel::PixelSource<Fourcc> Source;
+    typedef pixel::PixelWriter<Mode, YuvCoefficients<M, R> > Writer;
+    enum { SCALE = 1 };
+
+    static size_t getDestinationSize(uint32_t width, uint32_t height) {
+        return (size_t)width * height * Writer::BYTES_PER_PIXEL;
+    }
+
+    /**
+     * Checks the parameters and converts the whole image, 'dst' is resized.
+     * \param stride Bytes per row of the first plane, 0 if the rows are not padded.
+     * \param pool If passed, large images are converted in row bands by several threads.
+     * \return false if the size of the image does not match.
+     */
+    static bool convert(uint8_t const* src, size_t size, uint32_t width, uint32_t height,
+            uint32_t stride, std::vector<uint8_t>& dst, ConvertPool* pool = NULL) {
+        return pixel::convertImage<PixelConverter>(src, size, width, height, stride, dst, pool);
+    }
+
+    /**
+     * Converts the rows [first_row, end_row) without any checks, e.g. to distribute
+     * an image to several threads. 'dst' points to the first row of the whole image.
+     */
+    static void convertRows(uint8_t const* src, uint32_t width, uint32_t height, uint32_t stride,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        Source::template convertRows<Writer>(src, stride, width, height, first_row, end_row, dst);
+    }
+};
+
+/**
+ * Like PixelConverter but writes an image reduced to 1/Scale (2 or 4) in both directions,
+ * see Packed422Source::convertRowsScaled(). Only for packed 4:2:2 sources (YUYV, UYVY).
+ * The width has to be a multiple of 2 * Scale, remaining rows are dropped.
+ */
+template<uint32_t Fourcc, base::samples::frame::frame_mode_t Mode, int Scale,
+        enum ColorMatrix M = COLOR_MATRIX_BT601, enum ColorRange R = COLOR_RANGE_LIMITED>
+struct ScaledPixelConverter {
+    typedef pixel::PixelSource<Fourcc> Source;
+    typedef pixel::PixelWriter<Mode, YuvCoefficients<M, R> > Writer;
+    enum { SCALE = Scale };
+
+    /**
+     * \param width, height Size of the source image.
+     */
+    static size_t getDestinationSize(uint32_t width, uint32_t height) {
+        return (size_t)(width / Scale) * (height / Scale) * Writer::BYTES_PER_PIXEL;
+    }
+
+    static bool convert(uint8_t const* src, size_t size, uint32_t width, uint32_t height,
+            uint32_t stride, std::vector<uint8_t>& dst, ConvertPool* pool = NULL) {
+        return pixel::convertImage<ScaledPixelConverter>(src, size, width, height, stride, dst, pool);
+    }
+
+    /**
+     * [first_row, end_row) are rows of the reduced image.
+     */
+    static void convertRows(uint8_t const* src, uint32_t width, uint32_t height, uint32_t stride,
+            uint32_t first_row, uint32_t end_row, uint8_t* dst) {
+        Source::template convertRowsScaled<Writer, Scale>(src, stride, width, first_row, end_row, dst);
+    }
+};
+
+/**
+ * Runtime selection of the converters above, see PixelConverter::convert().
+ */
+typedef bool (*PixelConvertFunction)(uint8_t const* src, size_t size, uint32_t width,
+        uint32_t height, uint32_t stride, std::vector<uint8_t>& dst, ConvertPool* pool);
+
+namespace pixel
+{
+
+template<uint32_t Fourcc, base::samples::frame::frame_mode_t Mode>
+inline PixelConvertFunction selectConverter(enum ColorMatrix matrix, enum ColorRange range) {
+    if(matrix == COLOR_MATRIX_BT709) {
+        return range == COLOR_RANGE_FULL ?
+                PixelConverter<Fourcc, Mode, COLOR_MATRIX_BT709, COLOR_RANGE_FULL>::convert :
+                PixelConverter<Fourcc, Mode, COLOR_MATRIX_BT709, COLOR_RANGE_LIMITED>::convert;
+    }
+    return range == COLOR_RANGE_FULL ?
+            PixelConverter<Fourcc, Mode, COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert :
+            PixelConverter<Fourcc, Mode, COLOR_MATRIX_BT601, COLOR_RANGE_LIMITED>::convert;
+}
+
+template<uint32_t Fourcc>
+inline PixelConvertFunction selectYuvConverter(base::samples::frame::frame_mode_t mode,
+        enum ColorMatrix matrix, enum ColorRange range) {
+    using namespace base::samples::frame;
+    switch(mode) {
+        case MODE_RGB: return selectConverter<Fourcc, MODE_RGB>(matrix, range);
+        case MODE_BGR: return selectConverter<Fourcc, MODE_BGR>(matrix, range);
+        case MODE_GRAYSCALE: return LumaExtractor<Fourcc>::convert;
+        default: return NULL;
+    }
+}
+
+template<uint32_t Fourcc, int Scale>
+inline PixelConvertFunction selectScaledConverter(base::samples::frame::frame_mode_t mode,
+        enum ColorMatrix matrix, enum ColorRange range) {
+    using namespace base::samples::frame;
+    switch(mode) {
+        case MODE_RGB:
+            if(matrix == COLOR_MATRIX_BT709) {
+                return range == COLOR_RANGE_FULL ?
+                        ScaledPixelConverter<Fourcc, MODE_RGB, Scale, COLOR_MATRIX_BT709, COLOR_RANGE_FULL>::convert :
+                        ScaledPixelConverter<Fourcc, MODE_RGB, Scale, COLOR_MATRIX_BT709, COLOR_RANGE_LIMITED>::convert;
+            }
+            return range == COLOR_RANGE_FULL ?
+                    ScaledPixelConverter<Fourcc, MODE_RGB, Scale, COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert :
+                    ScaledPixelConverter<Fourcc, MODE_RGB, Scale, COLOR_MATRIX_BT601, COLOR_RANGE_LIMITED>::convert;
+        case MODE_BGR:
+            if(matrix == COLOR_MATRIX_BT709) {
+                return range == COLOR_RANGE_FULL ?
+                        ScaledPixelConverter<Fourcc, MODE_BGR, Scale, COLOR_MATRIX_BT709, COLOR_RANGE_FULL>::convert :
+                        ScaledPixelConverter<Fourcc, MODE_BGR, Scale, COLOR_MATRIX_BT709, COLOR_RANGE_LIMITED>::convert;
+            }
+            return range == COLOR_RANGE_FULL ?
+                    ScaledPixelConverter<Fourcc, MODE_BGR, Scale, COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert :
+                    ScaledPixelConverter<Fourcc, MODE_BGR, Scale, COLOR_MATRIX_BT601, COLOR_RANGE_LIMITED>::convert;
+        case MODE_GRAYSCALE:
+            // Mean of the unchanged luma, like LumaExtractor.
+            return ScaledPixelConverter<Fourcc, MODE_GRAYSCALE, Scale,
+                    COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert;
+        default:
+            return NULL;
+    }
+}
+
+} // end namespace pixel
+
+/**
+ * Returns the converter from the v4l2 'fourcc' to 'mode' or NULL if there is none.
+ * Supported are YUYV, UYVY, NV12 and YU12 (V4L2_PIX_FMT_YUV420) to RGB, BGR and grayscale,
+ * YUYV to UYVY and GREY to RGB and BGR. 'matrix' and 'range' describe the YUV source.
+ * Grayscale is the unchanged Y channel (see LumaExtractor), use
+ * PixelConverter<..., MODE_GRAYSCALE> to expand limited range luma.
+ */
+inline PixelConvertFunction getPixelConverter(uint32_t fourcc, base::samples::frame::frame_mode_t mode,
+        enum ColorMatrix matrix = COLOR_MATRIX_BT601, enum ColorRange range = COLOR_RANGE_LIMITED) {
+    using namespace base::samples::frame;
+    switch(fourcc) {
+        case V4L2_PIX_FMT_YUYV:
+            if(mode == MODE_UYVY) {
+                return PixelConverter<V4L2_PIX_FMT_YUYV, MODE_UYVY>::convert;
+            }
+            return pixel::selectYuvConverter<V4L2_PIX_FMT_YUYV>(mode, matrix, range);
+        case V4L2_PIX_FMT_UYVY:
+            return pixel::selectYuvConverter<V4L2_PIX_FMT_UYVY>(mode, matrix, range);
+        case V4L2_PIX_FMT_NV12:
+            return pixel::selectYuvConverter<V4L2_PIX_FMT_NV12>(mode, matrix, range);
+        case V4L2_PIX_FMT_YUV420:
+            return pixel::selectYuvConverter<V4L2_PIX_FMT_YUV420>(mode, matrix, range);
+        case V4L2_PIX_FMT_GREY:
+            // Gray values are passed unchanged.
+            if(mode == MODE_RGB) {
+                return PixelConverter<V4L2_PIX_FMT_GREY, MODE_RGB,
+                        COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert;
+            }
+            if(mode == MODE_BGR) {
+                return PixelConverter<V4L2_PIX_FMT_GREY, MODE_BGR,
+                        COLOR_MATRIX_BT601, COLOR_RANGE_FULL>::convert;
+            }
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Returns a converter which reduces the image to 1/'scale' (1, 2 or 4) while converting,
+ * see ScaledPixelConverter. Scale 1 is getPixelConverter(). Downscaling is supported from
+ * YUYV and UYVY to RGB, BGR and grayscale.
+ */
+inline PixelConvertFunction getScaledPixelConverter(uint32_t fourcc,
+        base::samples::frame::frame_mode_t mode, uint32_t scale,
+        enum ColorMatrix matrix = COLOR_MATRIX_BT601, enum ColorRange range = COLOR_RANGE_LIMITED) {
+    if(scale == 1) {
+        return getPixelConverter(fourcc, mode, matrix, range);
+    }
+    if(scale != 2 && scale != 4) {
+        return NULL;
+    }
+    switch(fourcc) {
+        case V4L2_PIX_FMT_YUYV:
+            return scale == 2 ?
+                    pixel::selectScaledConverter<V4L2_PIX_FMT_YUYV, 2>(mode, matrix, range) :
+                    pixel::selectScaledConverter<V4L2_PIX_FMT_YUYV, 4>(mode, matrix, range);
+        case V4L2_PIX_FMT_UYVY:
+            return scale == 2 ?
+                    pixel::selectScaledConverter<V4L2_PIX_FMT_UYVY, 2>(mode, matrix, range) :
+                    pixel::selectScaledConverter<V4L2_PIX_FMT_UYVY, 4>(mode, matrix, range);
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Returns true if a YUYV or UYVY image of 'width'x'height' can be reduced to 1/'scale'
+ * by the converters of getScaledPixelConverter(), see pixel::convertImage().
+ */
+inline bool isScalableSize(uint32_t width, uint32_t height, uint32_t scale) {
+    return scale == 1 || (width > 0 && width % (2 * scale) == 0 && height >= scale);
+}
+
+/**
+ * Part of an image in pixels, e.g. the region of interest of a tracker.
+ */
+struct ImageRegion {
+    ImageRegion() : x(0), y(0), width(0), height(0) {}
+
+    ImageRegion(uint32_t x_, uint32_t y_, uint32_t width_, uint32_t height_) : 
+            x(x_), y(y_), width(width_), height(height_) {}
+
+    inline bool isEmpty() const {
+        return width == 0 || height == 0;
+    }
+
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/**
+ * Returns the bytes per pixel of the packed v4l2 formats whose rows can be cut,
+ * 0 for planar and compressed formats.
+ */
+inline uint32_t getPackedPixelSize(uint32_t fourcc) {
+    switch(fourcc) {
+        case V4L2_PIX_FMT_GREY: return 1;
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY: return 2;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24: return 3;
+        case V4L2_PIX_FMT_RGB32:
+        case V4L2_PIX_FMT_BGR32: return 4;
+        default: return 0;
+    }
+}
+
+/**
+ * Returns the packed v4l2 format of an uncompressed frame mode, 0 if there is none.
+ */
+inline uint32_t getPackedFourcc(base::samples::frame::frame_mode_t mode) {
+    using namespace base::samples::frame;
+    switch(mode) {
+        case MODE_GRAYSCALE: return V4L2_PIX_FMT_GREY;
+        case MODE_RGB: return V4L2_PIX_FMT_RGB24;
+        case MODE_BGR: return V4L2_PIX_FMT_BGR24;
+        case MODE_RGB32: return V4L2_PIX_FMT_RGB32;
+        case MODE_UYVY: return V4L2_PIX_FMT_UYVY;
+        default: return 0;
+    }
+}
+
+/**
+ * Clips 'region' to the image. 4:2:2 images are only cut between macropixels 
+ * and the size is reduced to a multiple of 'scale' (see getScaledPixelConverter()).
+ * \return false if the remaining region is empty or the format can not be cut.
+ */
+inline bool clipRegion(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t scale,
+        ImageRegion& region) {
+    if(getPackedPixelSize(fourcc) == 0 || region.x >= width || region.y >= height) {
+        return false;
+    }
+    uint32_t align = (fourcc == V4L2_PIX_FMT_YUYV || fourcc == V4L2_PIX_FMT_UYVY) ? 2 : 1;
+    region.x -= region.x % align;
+    region.width = std::min(region.width, width - region.x);
+    region.height = std::min(region.height, height - region.y);
+    region.width -= region.width % (align * scale);
+    region.height -= region.height % scale;
+    return !region.isEmpty();
+}
+
+/**
+ * Copies only the rows and columns of the clipped 'region' (see clipRegion()) of the 
+ * packed image, converted if 'convert' is set. So the bytes touched are proportional
+ * to the region and not to the image.
+ * \param stride Bytes per row of the source, 0 if the rows are not padded.
+ */
+inline bool extractRegion(uint8_t const* src, size_t size, uint32_t width, uint32_t stride, 
+        uint32_t fourcc, PixelConvertFunction convert, ImageRegion const& region,
+        std::vector<uint8_t>& dst, ConvertPool* pool = NULL) {
+    uint32_t pixel_size = getPackedPixelSize(fourcc);
+    if(stride == 0) {
+        stride = width * pixel_size;
+    }
+    size_t offset = (size_t)region.y * stride + (size_t)region.x * pixel_size;
+    size_t row_bytes = (size_t)region.width * pixel_size;
+    if(pixel_size == 0 || region.isEmpty() || 
+            size < offset + (size_t)stride * (region.height - 1) + row_bytes) {
+        LOG_ERROR("Region %dx%d at (%d,%d) can not be extracted from an image of %d bytes",
+                region.width, region.height, region.x, region.y, (int)size);
+        return false;
+    }
+    if(convert != NULL) {
+        return convert(src + offset, size - offset, region.width, region.height, stride, dst, pool);
+    }
+    dst.resize(row_bytes * region.height);
+    for(uint32_t y = 0; y < region.height; ++y) {
+        memcpy(&dst[y * row_bytes], src + offset + (size_t)y * stride, row_bytes);
+    }
+    return true;
+}
+
+} // end namespace camera
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * \file    helpers_test.h
+ *
+ * \brief   Boost tests for class Helpers, no camera required.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _HELPERS_TEST_H_
+#define _HELPERS_TEST_H_
+
+#include <camera_usb/helpers.h>
+
+namespace helpers_test
+{
+
+// SOI, COM, APP0 (JFIF), COM (empty), SOS header, entropy data with RST0, EOI.
+static const uint8_t JPEG_WITH_COMMENTS[] = {
+        0xFF, 0xD8,
+        0xFF, 0xFE, 0x00, 0x05, 'a', 'b', 'c',
+        0xFF, 0xE0, 0x00, 0x07, 'J', 'F', 'I', 'F', 0x00,
+        0xFF, 0xFE, 0x00, 0x02,
+        0xFF, 0xDA, 0x00, 0x04, 0x01, 0x02,
+        0x11, 0xFF, 0x00, 0xFF, 0xD0, 0x22, 0xFF, 0xFE,
+        0xFF, 0xD9 };
+
+static const uint8_t JPEG_WITHOUT_COMMENTS[] = {
+        0xFF, 0xD8,
+        0xFF, 0xE0, 0x00, 0x07, 'J', 'F', 'I', 'F', 0x00,
+        0xFF, 0xDA, 0x00, 0x04, 0x01, 0x02,
+        0x11, 0xFF, 0x00, 0xFF, 0xD0, 0x22, 0xFF, 0xFE,
+        0xFF, 0xD9 };
+
+} // end namespace helpers_test
+
+BOOST_AUTO_TEST_CASE(frame_format_test) {
+    using namespace base::samples::frame;
+
+    // The image is written before the format is set, e.g. a JPEG of unknown size.
+    Frame frame;
+    const uint8_t data[] = {0xFF, 0xD8, 0x01, 0x02, 0x03, 0xFF, 0xD9};
+    frame.image.assign(data, data + sizeof(data));
+    frame.setAttribute<uint32_t>("roi_x", 4);
+    frame.frame_status = STATUS_VALID;
+    camera::Helpers::setFrameFormat(frame, 640, 480, 8, MODE_JPEG);
+    BOOST_CHECK_EQUAL(frame.getWidth(), 640);
+    BOOST_CHECK_EQUAL(frame.getHeight(), 480);
+    BOOST_CHECK_EQUAL(frame.getFrameMode(), MODE_JPEG);
+    BOOST_CHECK_EQUAL(frame.getDataDepth(), 8u);
+    BOOST_CHECK(frame.image == std::vector<uint8_t>(data, data + sizeof(data)));
+    BOOST_CHECK_EQUAL(frame.getAttribute<uint32_t>("roi_x"), 4u);
+    BOOST_CHECK_EQUAL(frame.frame_status, STATUS_VALID);
+
+    // Raw pixels are kept as well.
+    std::vector<uint8_t> pixels(4 * 2 * 3);
+    for(size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (uint8_t)(10 + i);
+    }
+    frame.image = pixels;
+    camera::Helpers::setFrameFormat(frame, 4, 2, 8, MODE_RGB);
+    BOOST_CHECK(frame.image == pixels);
+    BOOST_CHECK_EQUAL(frame.getWidth(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_comment_copy_test) {
+    using namespace helpers_test;
+
+    std::vector<uint8_t> buffer;
+    camera::Helpers::copyJpegWithoutComments(JPEG_WITH_COMMENTS, sizeof(JPEG_WITH_COMMENTS), buffer);
+    BOOST_REQUIRE_EQUAL(buffer.size(), sizeof(JPEG_WITHOUT_COMMENTS));
+    BOOST_CHECK(memcmp(&buffer[0], JPEG_WITHOUT_COMMENTS, buffer.size()) == 0);
+
+    // In place.
+    base::samples::frame::Frame frame;
+    frame.init(4, 4, 8, base::samples::frame::MODE_JPEG, -1, sizeof(JPEG_WITH_COMMENTS));
+    memcpy(&frame.image[0], JPEG_WITH_COMMENTS, sizeof(JPEG_WITH_COMMENTS));
+    camera::Helpers::removeJpegCommentBlock(frame);
+    BOOST_REQUIRE_EQUAL(frame.image.size(), sizeof(JPEG_WITHOUT_COMMENTS));
+    BOOST_CHECK(memcmp(&frame.image[0], JPEG_WITHOUT_COMMENTS, frame.image.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_comment_copy_invalid_test) {
+    using namespace helpers_test;
+    std::vector<uint8_t> buffer;
+
+    // No JPEG: copied unchanged.
+    uint8_t raw[] = {0x10, 0x80, 0xFF, 0xFE, 0x00, 0x02, 0x10, 0x80};
+    camera::Helpers::copyJpegWithoutComments(raw, sizeof(raw), buffer);
+    BOOST_REQUIRE_EQUAL(buffer.size(), sizeof(raw));
+    BOOST_CHECK(memcmp(&buffer[0], raw, sizeof(raw)) == 0);
+
+    // Comment length exceeds the data: copied unchanged instead of reading past the end.
+    uint8_t truncated[] = {0xFF, 0xD8, 0xFF, 0xFE, 0x40, 0x00, 'a', 'b'};
+    camera::Helpers::copyJpegWithoutComments(truncated, sizeof(truncated), buffer);
+    BOOST_REQUIRE_EQUAL(buffer.size(), sizeof(truncated));
+    BOOST_CHECK(memcmp(&buffer[0], truncated, sizeof(truncated)) == 0);
+
+    // Truncated after a complete comment.
+    camera::Helpers::copyJpegWithoutComments(JPEG_WITH_COMMENTS, 10, buffer);
+    BOOST_REQUIRE_EQUAL(buffer.size(), 3u);
+    BOOST_CHECK(buffer[0] == 0xFF && buffer[1] == 0xD8 && buffer[2] == 0xFF);
+
+    camera::Helpers::copyJpegWithoutComments(JPEG_WITH_COMMENTS, 0, buffer);
+    BOOST_CHECK(buffer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_huffman_table_insert_test) {
+    using namespace helpers_test;
+    std::vector<uint8_t> buffer;
+
+    // Tables are inserted in front of SOS, comments are removed in the same pass.
+    camera::Helpers::normalizeJpeg(JPEG_WITH_COMMENTS, sizeof(JPEG_WITH_COMMENTS), buffer, true);
+    size_t header_size = 11; // SOI, APP0
+    BOOST_REQUIRE_EQUAL(buffer.size(), sizeof(JPEG_WITHOUT_COMMENTS) + sizeof(camera::JPEG_STANDARD_DHT));
+    BOOST_CHECK(memcmp(&buffer[0], JPEG_WITHOUT_COMMENTS, header_size) == 0);
+    BOOST_CHECK(memcmp(&buffer[header_size], camera::JPEG_STANDARD_DHT, 
+            sizeof(camera::JPEG_STANDARD_DHT)) == 0);
+    BOOST_CHECK(memcmp(&buffer[header_size + sizeof(camera::JPEG_STANDARD_DHT)], 
+            JPEG_WITHOUT_COMMENTS + header_size, sizeof(JPEG_WITHOUT_COMMENTS) - header_size) == 0);
+
+    // Already contains tables: nothing is inserted.
+    std::vector<uint8_t> with_tables(buffer);
+    camera::Helpers::normalizeJpeg(&with_tables[0], with_tables.size(), buffer, true);
+    BOOST_CHECK(buffer == with_tables);
+}
+
+#endif
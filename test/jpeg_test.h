@@ -0,0 +1,290 @@
+/*
+ * \file    jpeg_test.h
+ *
+ * \brief   Boost tests for the JPEG encoder and decoder, no camera required.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _JPEG_TEST_H_
+#define _JPEG_TEST_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <camera_usb/cam_decode_pool.h>
+#include <camera_usb/cam_jpeg.h>
+#include <camera_usb/helpers.h>
+
+namespace jpeg_test
+{
+
+// Smooth image, so the JPEG error stays small.
+static uint8_t pattern(uint32_t x, uint32_t y, uint32_t channel) {
+    return (uint8_t)(16 + 3 * x + 2 * y + 40 * channel);
+}
+
+static double meanError(std::vector<uint8_t> const& a, std::vector<uint8_t> const& b) {
+    double sum = 0;
+    for(size_t i = 0; i < a.size(); ++i) {
+        sum += abs((int)a[i] - (int)b[i]);
+    }
+    return sum / a.size();
+}
+
+// Pops the frames within the done callback of the pool, like CamUsb.
+struct PoolReceiver {
+    PoolReceiver() : pool(NULL), frame(), times() {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    ~PoolReceiver() {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    static void done(void* p) {
+        PoolReceiver* receiver = (PoolReceiver*)p;
+        pthread_mutex_lock(&receiver->mutex);
+        while(receiver->pool->pop(receiver->frame, 0)) {
+            receiver->times.push_back(receiver->frame.time);
+        }
+        pthread_cond_broadcast(&receiver->cond);
+        pthread_mutex_unlock(&receiver->mutex);
+    }
+
+    bool waitFor(size_t count, int timeout_sec) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_sec;
+        pthread_mutex_lock(&mutex);
+        while(times.size() < count && 
+                pthread_cond_timedwait(&cond, &mutex, &deadline) == 0) {
+        }
+        bool received = times.size() >= count;
+        pthread_mutex_unlock(&mutex);
+        return received;
+    }
+
+    camera::JpegDecodePool* pool;
+    base::samples::frame::Frame frame;
+    std::vector<base::Time> times;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+} // end namespace jpeg_test
+
+BOOST_AUTO_TEST_CASE(jpeg_encode_yuv422_test) {
+    using namespace jpeg_test;
+    using namespace base::samples::frame;
+
+    // Neither a multiple of the MCU width nor of the MCU height.
+    const uint32_t width = 38, height = 21;
+    std::vector<uint8_t> yuyv(width * height * 2), uyvy(width * height * 2), luma(width * height);
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            size_t i = (y * width + x) * 2;
+            luma[y * width + x] = pattern(x, y, 0);
+            yuyv[i] = uyvy[i + 1] = pattern(x, y, 0);
+            yuyv[i + 1] = uyvy[i] = x % 2 == 0 ? 110 : 150; // Cb / Cr
+        }
+    }
+
+    camera::JpegEncoder encoder;
+    camera::JpegDecoder decoder;
+    encoder.setQuality(95);
+    std::vector<uint8_t> jpeg;
+    Frame decoded;
+
+    // The luma is stored unchanged, so the decoded grayscale image has to match it.
+    BOOST_REQUIRE(encoder.encode(&yuyv[0], yuyv.size(), width, height, V4L2_PIX_FMT_YUYV, jpeg));
+    BOOST_REQUIRE(decoder.decode(&jpeg[0], jpeg.size(), MODE_GRAYSCALE, decoded));
+    BOOST_REQUIRE_EQUAL(decoded.getWidth(), width);
+    BOOST_REQUIRE_EQUAL(decoded.getHeight(), height);
+    BOOST_CHECK_LT(meanError(decoded.image, luma), 2.0);
+
+    std::vector<uint8_t> jpeg_uyvy;
+    BOOST_REQUIRE(encoder.encode(&uyvy[0], uyvy.size(), width, height, V4L2_PIX_FMT_UYVY, jpeg_uyvy));
+    BOOST_CHECK(jpeg_uyvy == jpeg);
+
+    // Too small, odd width.
+    BOOST_CHECK(!encoder.encode(&yuyv[0], yuyv.size() - 1, width, height, V4L2_PIX_FMT_YUYV, jpeg));
+    BOOST_CHECK(!encoder.encode(&yuyv[0], yuyv.size(), width - 1, height, V4L2_PIX_FMT_YUYV, jpeg));
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_encode_frame_test) {
+    using namespace jpeg_test;
+    using namespace base::samples::frame;
+
+    const uint32_t width = 40, height = 24;
+    Frame rgb(width, height, 8, MODE_RGB);
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                rgb.image[(y * width + x) * 3 + c] = pattern(x, y, c);
+            }
+        }
+    }
+
+    camera::JpegEncoder encoder;
+    camera::JpegDecoder decoder;
+    Frame jpeg, decoded;
+    BOOST_REQUIRE(encoder.encode(rgb, jpeg));
+    BOOST_CHECK_EQUAL(jpeg.getFrameMode(), MODE_JPEG);
+    BOOST_CHECK_EQUAL(jpeg.getWidth(), width);
+    BOOST_REQUIRE(jpeg.image.size() > 4);
+    BOOST_CHECK(jpeg.image[0] == 0xFF && jpeg.image[1] == 0xD8);
+    BOOST_CHECK(jpeg.image[jpeg.image.size() - 2] == 0xFF && jpeg.image[jpeg.image.size() - 1] == 0xD9);
+
+    BOOST_REQUIRE(decoder.decode(&jpeg.image[0], jpeg.image.size(), MODE_RGB, decoded));
+    BOOST_CHECK_LT(meanError(decoded.image, rgb.image), 4.0);
+
+    // Same image again, the buffer of the previous image is reused.
+    std::vector<uint8_t> first(jpeg.image);
+    BOOST_REQUIRE(encoder.encode(rgb, jpeg));
+    BOOST_CHECK(jpeg.image == first);
+
+    // UYVY frames are created with a data depth of 16, like in CamUsb.
+    Frame uyvy(width, height, 16, MODE_UYVY);
+    BOOST_REQUIRE_EQUAL(uyvy.image.size(), width * height * 2);
+    for(uint32_t i = 0; i < uyvy.image.size(); i += 2) {
+        uyvy.image[i] = 128; // U or V, gray.
+        uyvy.image[i + 1] = pattern((i / 2) % width, (i / 2) / width, 0); // Y
+    }
+    BOOST_REQUIRE(encoder.encode(uyvy, jpeg));
+    BOOST_CHECK_EQUAL(jpeg.getFrameMode(), MODE_JPEG);
+    BOOST_CHECK_EQUAL(jpeg.getWidth(), width);
+    BOOST_CHECK_EQUAL(jpeg.getHeight(), height);
+    BOOST_REQUIRE(decoder.decode(&jpeg.image[0], jpeg.image.size(), MODE_GRAYSCALE, decoded));
+    std::vector<uint8_t> luma(width * height);
+    for(uint32_t i = 0; i < luma.size(); ++i) {
+        luma[i] = uyvy.image[i * 2 + 1];
+    }
+    BOOST_CHECK_LT(meanError(decoded.image, luma), 4.0);
+
+    // With a depth of 8 the image would be too small for UYVY.
+    Frame uyvy8(width, height, 8, MODE_UYVY);
+    BOOST_CHECK(!encoder.encode(uyvy8, jpeg));
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_decode_pool_test) {
+    using namespace jpeg_test;
+    using namespace base::samples::frame;
+
+    const uint32_t width = 40, height = 24;
+    Frame rgb(width, height, 8, MODE_RGB), jpeg;
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            for(uint32_t c = 0; c < 3; ++c) {
+                rgb.image[(y * width + x) * 3 + c] = pattern(x, y, c);
+            }
+        }
+    }
+    camera::JpegEncoder encoder;
+    BOOST_REQUIRE(encoder.encode(rgb, jpeg));
+
+    camera::JpegDecodePool pool(2, false);
+    base::Time first = base::Time::fromSeconds(1), second = base::Time::fromSeconds(2);
+    BOOST_REQUIRE(pool.push(&jpeg.image[0], jpeg.image.size(), MODE_RGB, first));
+    BOOST_REQUIRE(pool.push(&jpeg.image[0], jpeg.image.size(), MODE_RGB, second));
+
+    // The delivered frames have to contain the decoded pixels, not a reset buffer.
+    Frame decoded;
+    BOOST_REQUIRE(pool.pop(decoded, 2000));
+    BOOST_CHECK_EQUAL(decoded.getWidth(), width);
+    BOOST_CHECK_EQUAL(decoded.getHeight(), height);
+    BOOST_CHECK_EQUAL(decoded.getFrameMode(), MODE_RGB);
+    BOOST_CHECK_EQUAL(decoded.frame_status, STATUS_VALID);
+    BOOST_CHECK(decoded.time.toMicroseconds() == first.toMicroseconds());
+    BOOST_REQUIRE_EQUAL(decoded.image.size(), rgb.image.size());
+    BOOST_CHECK_LT(meanError(decoded.image, rgb.image), 4.0);
+
+    // Same frame again, its buffer has been passed back to the pool.
+    BOOST_REQUIRE(pool.pop(decoded, 2000));
+    BOOST_CHECK(decoded.time.toMicroseconds() == second.toMicroseconds());
+    BOOST_REQUIRE_EQUAL(decoded.image.size(), rgb.image.size());
+    BOOST_CHECK_LT(meanError(decoded.image, rgb.image), 4.0);
+    // The header is read while copying, incomplete images can be dropped.
+    camera::JpegHeaderInfo info;
+    BOOST_CHECK(pool.push(&jpeg.image[0], jpeg.image.size(), MODE_RGB, first, &info, true));
+    BOOST_CHECK(info.isComplete());
+    BOOST_CHECK_EQUAL(info.width, width);
+    BOOST_CHECK_EQUAL(info.height, height);
+    BOOST_CHECK(!pool.push(&jpeg.image[0], jpeg.image.size() - 10, MODE_RGB, second, &info, true));
+    BOOST_CHECK(!info.isComplete());
+    BOOST_REQUIRE(pool.pop(decoded, 2000));
+    BOOST_CHECK(decoded.time.toMicroseconds() == first.toMicroseconds());
+    BOOST_CHECK(!pool.pop(decoded, 100));
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_decode_pool_done_callback_test) {
+    using namespace jpeg_test;
+    using namespace base::samples::frame;
+
+    Frame gray(64, 48, 8, MODE_GRAYSCALE), jpeg;
+    camera::JpegEncoder encoder;
+    BOOST_REQUIRE(encoder.encode(gray, jpeg));
+
+    // Each pushed frame is delivered by the workers, without a further push or pop.
+    PoolReceiver receiver;
+    camera::JpegDecodePool pool(3, false);
+    receiver.pool = &pool;
+    pool.setDoneCallback(PoolReceiver::done, &receiver);
+    for(int i = 1; i <= 5; ++i) {
+        BOOST_REQUIRE(pool.push(&jpeg.image[0], jpeg.image.size(), MODE_GRAYSCALE, 
+                base::Time::fromSeconds(i)));
+    }
+    BOOST_REQUIRE(receiver.waitFor(5, 5));
+    pool.setDoneCallback(NULL, NULL);
+
+    // In capture order, no matter which worker finished first.
+    for(int i = 0; i < 5; ++i) {
+        BOOST_CHECK(receiver.times[i].toSeconds() == i + 1);
+    }
+    BOOST_CHECK(!pool.hasFrame());
+}
+
+BOOST_AUTO_TEST_CASE(jpeg_inspect_test) {
+    using namespace jpeg_test;
+    using namespace base::samples::frame;
+
+    Frame gray(40, 24, 8, MODE_GRAYSCALE), jpeg;
+    camera::JpegEncoder encoder;
+    BOOST_REQUIRE(encoder.encode(gray, jpeg));
+
+    camera::JpegHeaderInfo info;
+    BOOST_CHECK(camera::Helpers::inspectJpeg(&jpeg.image[0], jpeg.image.size(), &info));
+    BOOST_CHECK_EQUAL(info.width, 40);
+    BOOST_CHECK_EQUAL(info.height, 24);
+    BOOST_CHECK_EQUAL(info.components, 1);
+    BOOST_CHECK(!info.progressive);
+
+    // Zero padding after EOI is accepted.
+    std::vector<uint8_t> padded(jpeg.image);
+    padded.resize(padded.size() + 16, 0);
+    BOOST_CHECK(camera::Helpers::inspectJpeg(&padded[0], padded.size(), &info));
+
+    // Truncated transfer: header is valid, EOI is missing.
+    BOOST_CHECK(!camera::Helpers::inspectJpeg(&jpeg.image[0], jpeg.image.size() - 10, &info));
+    BOOST_CHECK(info.sof_found && info.sos_found && !info.eoi_found);
+    BOOST_CHECK_EQUAL(info.width, 40);
+
+    // Collected while copying as well.
+    std::vector<uint8_t> copy;
+    camera::Helpers::normalizeJpeg(&jpeg.image[0], jpeg.image.size(), copy, false, &info);
+    BOOST_CHECK(info.isComplete());
+    BOOST_CHECK(copy == jpeg.image);
+
+    // No JPEG.
+    uint8_t raw[] = {0x10, 0x80, 0x10, 0x80, 0xFF, 0xD9};
+    BOOST_CHECK(!camera::Helpers::inspectJpeg(raw, sizeof(raw), &info));
+    BOOST_CHECK(!info.sof_found);
+}
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * \file    pixel_converter_test.h
+ *
+ * \brief   Boost tests for the pixel format converters, no camera required.
+ *
+ *          German Research Center for Artificial Intelligence\n
+ *          Project: Rimres
+ *
+ * \date    18.10.26
+ */
+
+#ifndef _PIXEL_CONVERTER_TEST_H_
+#define _PIXEL_CONVERTER_TEST_H_
+
+#include <camera_usb/pixel_converter.h>
+
+namespace pixel_converter_test
+{
+
+// 4x2 image: luma of each pixel and chroma of each 2x2 block.
+static const uint8_t Y[2][4] = {{16, 60, 128, 235}, {40, 90, 200, 220}};
+static const uint8_t U[2] = {90, 160};
+static const uint8_t V[2] = {200, 70};
+
+static std::vector<uint8_t> createYuyv() {
+    std::vector<uint8_t> yuyv;
+    for(int y = 0; y < 2; ++y) {
+        for(int x = 0; x < 4; x += 2) {
+            yuyv.push_back(Y[y][x]);
+            yuyv.push_back(U[x / 2]);
+            yuyv.push_back(Y[y][x + 1]);
+            yuyv.push_back(V[x / 2]);
+        }
+    }
+    return yuyv;
+}
+
+} // end namespace pixel_converter_test
+
+BOOST_AUTO_TEST_CASE(pixel_converter_yuv_test) {
+    using namespace pixel_converter_test;
+    using namespace base::samples::frame;
+    using camera::PixelConverter;
+
+    std::vector<uint8_t> yuyv = createYuyv();
+    std::vector<uint8_t> rgb, bgr, gray, uyvy, rgb_uyvy;
+
+    BOOST_REQUIRE((PixelConverter<V4L2_PIX_FMT_YUYV, MODE_RGB>::convert(&yuyv[0], yuyv.size(), 4, 2, 0, rgb)));
+    BOOST_REQUIRE_EQUAL(rgb.size(), 4u * 2u * 3u);
+    // Y 16 and 235 are black and white in limited range, chroma is applied on top.
+    // Pixel (0,0): Y 16, U 90, V 200 -> R 1.596 * 72 = 115, G, B clipped to 0.
+    BOOST_CHECK_EQUAL((int)rgb[0], 115);
+    BOOST_CHECK_EQUAL((int)rgb[2], 0);
+
+    BOOST_REQUIRE((PixelConverter<V4L2_PIX_FMT_YUYV, MODE_BGR>::convert(&yuyv[0], yuyv.size(), 4, 2, 0, bgr)));
+    for(size_t i = 0; i < rgb.size(); i += 3) {
+        BOOST_CHECK(rgb[i] == bgr[i + 2] && rgb[i + 1] == bgr[i + 1] && rgb[i + 2] == bgr[i]);
+    }
+
+    BOOST_REQUIRE((PixelConverter<V4L2_PIX_FMT_YUYV, MODE_GRAYSCALE, camera::COLOR_MATRIX_BT601, 
+            camera::COLOR_RANGE_FULL>::convert(&yuyv[0], yuyv.size(), 4, 2, 0, gray)));
+    BOOST_CHECK(memcmp(&gray[0], Y, sizeof(Y)) == 0);
+
+    // UYVY only swaps the bytes, converting it to RGB yields the same image.
+    BOOST_REQUIRE((PixelConverter<V4L2_PIX_FMT_YUYV, MODE_UYVY>::convert(&yuyv[0], yuyv.size(), 4, 2, 0, uyvy)));
+    BOOST_CHECK(uyvy[0] == U[0] && uyvy[1] == Y[0][0] && uyvy[2] == V[0] && uyvy[3] == Y[0][1]);
+    BOOST_REQUIRE((PixelConverter<V4L2_PIX_FMT_UYVY, MODE_RGB>::convert(&uyvy[0], uyvy.size(), 4, 2, 0, rgb_uyvy)));
+    BOOST_CHECK(rgb_uyvy == rgb);
+
+    // 4:2:0 with the same chroma for both rows.
+    std::vector<uint8_t> nv12(&Y[0][0], &Y[0][0] + sizeof(Y)), yu12(nv12), rgb_planar;
+    nv12.push_back(U[0]); nv12.push_back(V[0]); nv12.push_back(U[1]); nv12.push_back(V[1]);
+    yu12.push_back(U[0]); yu12.push_back(U[1]); yu12.push_back(V[0]); yu12.push_back(V[1]);
+    camera::PixelConvertFunction nv12_rgb = camera::getPixelConverter(V4L2_PIX_FMT_NV12, MODE_RGB);
+    BOOST_REQUIRE(nv12_rgb != NULL);
+    BOOST_REQUIRE(nv12_rgb(&nv12[0], nv12.size(), 4, 2, 0, rgb_planar, NULL));
+    BOOST_CHECK(rgb_planar == rgb);
+    camera::PixelConvertFunction yu12_rgb = camera::getPixelConverter(V4L2_PIX_FMT_YUV420, MODE_RGB);
+    BOOST_REQUIRE(yu12_rgb != NULL);
+    BOOST_REQUIRE(yu12_rgb(&yu12[0], yu12.size(), 4, 2, 0, rgb_planar, NULL));
+    BOOST_CHECK(rgb_planar == rgb);
+}
+
+BOOST_AUTO_TEST_CASE(pixel_converter_stride_test) {
+    using namespace pixel_converter_test;
+    using namespace base::samples::frame;
+
+    std::vector<uint8_t> yuyv = createYuyv(), padded, rgb, rgb_padded;
+    // Rows padded to 12 bytes.
+    padded.insert(padded.end(), yuyv.begin(), yuyv.begin() + 8);
+    padded.resize(12, 0xAA);
+    padded.insert(padded.end(), yuyv.begin() + 8, yuyv.end());
+    padded.resize(24, 0xAA);
+
+    camera::PixelConvertFunction convert = camera::getPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB);
+    BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), 4, 2, 0, rgb, NULL));
+    BOOST_REQUIRE(convert(&padded[0], padded.size(), 4, 2, 12, rgb_padded, NULL));
+    BOOST_CHECK(rgb_padded == rgb);
+
+    // Too small, odd width, stride smaller than a row.
+    BOOST_CHECK(!convert(&yuyv[0], yuyv.size() - 1, 4, 2, 0, rgb, NULL));
+    BOOST_CHECK(!convert(&yuyv[0], yuyv.size(), 3, 2, 0, rgb, NULL));
+    BOOST_CHECK(!convert(&yuyv[0], yuyv.size(), 4, 2, 6, rgb, NULL));
+
+    // Gray values are passed unchanged, odd widths are supported.
+    uint8_t grey[] = {0, 77, 255};
+    std::vector<uint8_t> grey_rgb;
+    convert = camera::getPixelConverter(V4L2_PIX_FMT_GREY, MODE_RGB);
+    BOOST_REQUIRE(convert != NULL);
+    BOOST_REQUIRE(convert(grey, sizeof(grey), 3, 1, 0, grey_rgb, NULL));
+    uint8_t expected[] = {0, 0, 0, 77, 77, 77, 255, 255, 255};
+    BOOST_REQUIRE_EQUAL(grey_rgb.size(), sizeof(expected));
+    BOOST_CHECK(memcmp(&grey_rgb[0], expected, sizeof(expected)) == 0);
+
+    BOOST_CHECK(camera::getPixelConverter(V4L2_PIX_FMT_MJPEG, MODE_RGB) == NULL);
+    BOOST_CHECK(camera::getPixelConverter(V4L2_PIX_FMT_GREY, MODE_UYVY) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(pixel_converter_luma_test) {
+    using namespace base::samples::frame;
+
+    // Wide enough for the SIMD loop and a scalar rest, rows are padded.
+    const uint32_t width = 38, height = 3, stride = 2 * width + 4, nv12_stride = width + 2;
+    std::vector<uint8_t> yuyv(stride * height), uyvy(stride * height), luma(width * height);
+    std::vector<uint8_t> nv12(nv12_stride * height + nv12_stride * 2, 0x80);
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            uint8_t value = (uint8_t)(7 * x + 31 * y);
+            luma[y * width + x] = value;
+            yuyv[y * stride + 2 * x] = value;
+            yuyv[y * stride + 2 * x + 1] = 0xF0;
+            uyvy[y * stride + 2 * x] = 0xF0;
+            uyvy[y * stride + 2 * x + 1] = value;
+            nv12[y * nv12_stride + x] = value;
+        }
+    }
+
+    std::vector<uint8_t> gray;
+    camera::PixelConvertFunction convert = camera::getPixelConverter(V4L2_PIX_FMT_YUYV, MODE_GRAYSCALE);
+    BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), width, height, stride, gray, NULL));
+    BOOST_CHECK(gray == luma);
+
+    convert = camera::getPixelConverter(V4L2_PIX_FMT_UYVY, MODE_GRAYSCALE);
+    BOOST_REQUIRE(convert(&uyvy[0], uyvy.size(), width, height, stride, gray, NULL));
+    BOOST_CHECK(gray == luma);
+
+    convert = camera::getPixelConverter(V4L2_PIX_FMT_NV12, MODE_GRAYSCALE);
+    BOOST_REQUIRE(convert(&nv12[0], nv12.size(), width, height, nv12_stride, gray, NULL));
+    BOOST_CHECK(gray == luma);
+}
+
+BOOST_AUTO_TEST_CASE(pixel_converter_pool_test) {
+    using namespace base::samples::frame;
+
+    const uint32_t width = 64, height = 75;
+    std::vector<uint8_t> yuyv(width * height * 2);
+    for(size_t i = 0; i < yuyv.size(); ++i) {
+        yuyv[i] = (uint8_t)(i * 13 + i / 7);
+    }
+
+    std::vector<uint8_t> single, banded;
+    camera::PixelConvertFunction convert = camera::getPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB);
+    BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), width, height, 0, single, NULL));
+
+    // Small bands and no fast path, so all threads take part.
+    camera::ConvertPool pool(4);
+    BOOST_CHECK_EQUAL(pool.getThreadCount(), 4u);
+    pool.setBandBytes(1024);
+    pool.setMinParallelBytes(0);
+    for(int i = 0; i < 20; ++i) {
+        banded.clear();
+        BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), width, height, 0, banded, &pool));
+        BOOST_REQUIRE(banded == single);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pixel_converter_scale_test) {
+    using namespace base::samples::frame;
+
+    // The last source row is dropped for both scales.
+    const uint32_t width = 16, height = 9, stride = 2 * width + 4;
+    std::vector<uint8_t> yuyv(stride * height, 0x55);
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < width; ++x) {
+            yuyv[y * stride + 2 * x] = (uint8_t)(11 * x + 23 * y);
+            yuyv[y * stride + 2 * x + 1] = (uint8_t)(x % 2 ? 40 + 9 * y : 200 - 5 * x);
+        }
+    }
+
+    const uint32_t scales[] = {2, 4};
+    for(int i = 0; i < 2; ++i) {
+        uint32_t s = scales[i];
+        std::vector<uint8_t> gray, rgb, reference;
+        camera::PixelConvertFunction convert =
+                camera::getScaledPixelConverter(V4L2_PIX_FMT_YUYV, MODE_GRAYSCALE, s);
+        BOOST_REQUIRE(convert != NULL);
+        BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), width, height, stride, gray, NULL));
+        BOOST_REQUIRE_EQUAL(gray.size(), (width / s) * (height / s));
+        for(uint32_t y = 0; y < height / s; ++y) {
+            for(uint32_t x = 0; x < width / s; ++x) {
+                int sum = 0;
+                for(uint32_t r = 0; r < s; ++r) {
+                    for(uint32_t c = 0; c < s; ++c) {
+                        sum += yuyv[(y * s + r) * stride + 2 * (x * s + c)];
+                    }
+                }
+                BOOST_CHECK_EQUAL((int)gray[y * (width / s) + x], (sum + s * s / 2) / (s * s));
+            }
+        }
+
+        // A uniform block converts like a single pixel.
+        std::vector<uint8_t> block(s * 4 * s), pixel;
+        for(size_t j = 0; j < block.size(); j += 4) {
+            block[j] = 150; block[j + 1] = 90; block[j + 2] = 150; block[j + 3] = 170;
+        }
+        convert = camera::getScaledPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB, s);
+        BOOST_REQUIRE(convert(&block[0], block.size(), 2 * s, s, 0, rgb, NULL));
+        convert = camera::getPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB);
+        BOOST_REQUIRE(convert(&block[0], 4, 2, 1, 0, reference, NULL));
+        BOOST_CHECK(rgb == reference);
+    }
+
+    std::vector<uint8_t> out;
+    BOOST_CHECK(camera::getScaledPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB, 3) == NULL);
+    BOOST_CHECK(camera::getScaledPixelConverter(V4L2_PIX_FMT_NV12, MODE_RGB, 2) == NULL);
+    // Width not a multiple of 2 * scale.
+    BOOST_CHECK(!camera::getScaledPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB, 4)(
+            &yuyv[0], yuyv.size(), 12, 4, stride, out, NULL));
+    BOOST_CHECK(!camera::isScalableSize(12, 4, 4));
+    BOOST_CHECK(!camera::isScalableSize(16, 3, 4));
+    BOOST_CHECK(camera::isScalableSize(16, 4, 4));
+    BOOST_CHECK(camera::isScalableSize(12, 3, 1));
+}
+
+BOOST_AUTO_TEST_CASE(pixel_converter_region_test) {
+    using namespace base::samples::frame;
+
+    const uint32_t width = 12, height = 6, stride = 2 * width + 4;
+    std::vector<uint8_t> yuyv(stride * height, 0);
+    for(uint32_t y = 0; y < height; ++y) {
+        for(uint32_t x = 0; x < 2 * width; ++x) {
+            yuyv[y * stride + x] = (uint8_t)(16 + 3 * x + 17 * y);
+        }
+    }
+
+    // Cut between macropixels and clipped to the image.
+    camera::ImageRegion region(3, 4, 20, 5);
+    BOOST_REQUIRE(camera::clipRegion(V4L2_PIX_FMT_YUYV, width, height, 1, region));
+    BOOST_CHECK_EQUAL(region.x, 2u);
+    BOOST_CHECK_EQUAL(region.y, 4u);
+    BOOST_CHECK_EQUAL(region.width, 10u);
+    BOOST_CHECK_EQUAL(region.height, 2u);
+
+    // Same result as converting the whole image and cropping it afterwards.
+    // The region ends at the last byte of the image.
+    std::vector<uint8_t> whole, roi;
+    camera::PixelConvertFunction convert = camera::getPixelConverter(V4L2_PIX_FMT_YUYV, MODE_RGB);
+    BOOST_REQUIRE(convert(&yuyv[0], yuyv.size(), width, height, stride, whole, NULL));
+    BOOST_REQUIRE(camera::extractRegion(&yuyv[0], yuyv.size() - 4, width, stride, 
+            V4L2_PIX_FMT_YUYV, convert, region, roi));
+    BOOST_REQUIRE_EQUAL(roi.size(), region.width * region.height * 3u);
+    for(uint32_t y = 0; y < region.height; ++y) {
+        BOOST_CHECK(std::equal(roi.begin() + y * region.width * 3, 
+                roi.begin() + (y + 1) * region.width * 3,
+                whole.begin() + ((region.y + y) * width + region.x) * 3));
+    }
+
+    // Plain copy of the packed rows.
+    BOOST_REQUIRE(camera::extractRegion(&yuyv[0], yuyv.size(), width, stride, 
+            V4L2_PIX_FMT_YUYV, NULL, region, roi));
+    BOOST_REQUIRE_EQUAL(roi.size(), region.width * region.height * 2u);
+    BOOST_CHECK_EQUAL(roi[0], yuyv[4 * stride + 4]);
+    BOOST_CHECK_EQUAL(roi[roi.size() - 1], yuyv[5 * stride + 23]);
+
+    // Sized for the scale, planar and compressed images can not be cut.
+    region = camera::ImageRegion(0, 1, 12, 6);
+    BOOST_REQUIRE(camera::clipRegion(V4L2_PIX_FMT_UYVY, width, height, 4, region));
+    BOOST_CHECK_EQUAL(region.width, 8u);
+    BOOST_CHECK_EQUAL(region.height, 4u);
+    BOOST_CHECK(!camera::clipRegion(V4L2_PIX_FMT_NV12, width, height, 1, region));
+    BOOST_CHECK(!camera::clipRegion(V4L2_PIX_FMT_MJPEG, width, height, 1, region));
+    region = camera::ImageRegion(width, 0, 2, 2);
+    BOOST_CHECK(!camera::clipRegion(V4L2_PIX_FMT_YUYV, width, height, 1, region));
+}
+
+#endif
@@ -7,6 +7,9 @@
 #include "gst_test.h"
 #include "restart_test.h"
 #include "usb_test.h"
+#include "helpers_test.h"
+#include "jpeg_test.h"
+#include "pixel_converter_test.h"
 
 // You can use the following setups: 
 // BOOST_CHECK_MESSAGE(1 == 1, "Send test sucessfully");